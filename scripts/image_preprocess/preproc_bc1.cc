@@ -0,0 +1,178 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "./preproc_bc1.h"
+
+namespace {
+
+struct Color {
+  float r, g, b;
+};
+
+Color operator+(Color a, Color b) { return {a.r+b.r, a.g+b.g, a.b+b.b}; }
+Color operator-(Color a, Color b) { return {a.r-b.r, a.g-b.g, a.b-b.b}; }
+Color operator*(float s, Color a) { return {s*a.r, s*a.g, s*a.b}; }
+float Dot(Color a, Color b) { return a.r*b.r + a.g*b.g + a.b*b.b; }
+
+uint16_t PackRgb565(Color c) {
+  int r = std::max(0, std::min(31, int(std::round(c.r * 31.0f / 255.0f))));
+  int g = std::max(0, std::min(63, int(std::round(c.g * 63.0f / 255.0f))));
+  int b = std::max(0, std::min(31, int(std::round(c.b * 31.0f / 255.0f))));
+  return uint16_t((r << 11) | (g << 5) | b);
+}
+
+Color UnpackRgb565(uint16_t c) {
+  int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  return Color{float((r << 3) | (r >> 2)),
+               float((g << 2) | (g >> 4)),
+               float((b << 3) | (b >> 2))};
+}
+
+// Picks the best palette index for every texel, returns the squared error.
+float ChooseIndices(const Color block[16], uint16_t c0, uint16_t c1,
+                    int indices[16]) {
+  Color e0 = UnpackRgb565(c0), e1 = UnpackRgb565(c1);
+  Color palette[4] = {
+    e0, e1, (1.0f/3.0f) * (2.0f*e0 + e1), (1.0f/3.0f) * (e0 + 2.0f*e1)
+  };
+
+  float error = 0.0f;
+  for (int i = 0; i < 16; ++i) {
+    float best = 1e30f;
+    for (int p = 0; p < 4; ++p) {
+      Color d = block[i] - palette[p];
+      float dist = Dot(d, d);
+      if (dist < best) {
+        best = dist;
+        indices[i] = p;
+      }
+    }
+    error += best;
+  }
+  return error;
+}
+
+// Least squares fit of the two endpoints to a given index assignment.
+bool RefitEndpoints(const Color block[16], const int indices[16],
+                    Color* e0, Color* e1) {
+  static const float kWeights[4] = {0.0f, 1.0f, 1.0f/3.0f, 2.0f/3.0f};
+  float aa = 0, ab = 0, bb = 0;
+  Color ax{0, 0, 0}, bx{0, 0, 0};
+  for (int i = 0; i < 16; ++i) {
+    float b = kWeights[indices[i]], a = 1.0f - b;
+    aa += a*a; ab += a*b; bb += b*b;
+    ax = ax + a*block[i];
+    bx = bx + b*block[i];
+  }
+
+  float det = aa*bb - ab*ab;
+  if (std::abs(det) < 1e-6f) {
+    return false;
+  }
+
+  *e0 = (1.0f/det) * (bb*ax - ab*bx);
+  *e1 = (1.0f/det) * (aa*bx - ab*ax);
+  return true;
+}
+
+void EncodeBlock(const Color block[16], unsigned char* out) {
+  Color mean{0, 0, 0};
+  for (int i = 0; i < 16; ++i) {
+    mean = mean + block[i];
+  }
+  mean = (1.0f/16.0f) * mean;
+
+  // principal axis of the colors with power iteration on the covariance
+  float cov[6] = {};
+  for (int i = 0; i < 16; ++i) {
+    Color d = block[i] - mean;
+    cov[0] += d.r*d.r; cov[1] += d.r*d.g; cov[2] += d.r*d.b;
+    cov[3] += d.g*d.g; cov[4] += d.g*d.b; cov[5] += d.b*d.b;
+  }
+  Color axis{1, 1, 1};
+  for (int iter = 0; iter < 8; ++iter) {
+    Color next{cov[0]*axis.r + cov[1]*axis.g + cov[2]*axis.b,
+               cov[1]*axis.r + cov[3]*axis.g + cov[4]*axis.b,
+               cov[2]*axis.r + cov[4]*axis.g + cov[5]*axis.b};
+    float len = std::sqrt(Dot(next, next));
+    if (len < 1e-6f) {
+      break;
+    }
+    axis = (1.0f/len) * next;
+  }
+
+  float min_proj = 1e30f, max_proj = -1e30f;
+  for (int i = 0; i < 16; ++i) {
+    float proj = Dot(block[i] - mean, axis);
+    min_proj = std::min(min_proj, proj);
+    max_proj = std::max(max_proj, proj);
+  }
+
+  // inset the bounding box a bit, as the extremes are usually outliers
+  float inset = (max_proj - min_proj) / 16.0f;
+  Color e0 = mean + (max_proj - inset) * axis;
+  Color e1 = mean + (min_proj + inset) * axis;
+
+  uint16_t c0 = PackRgb565(e0), c1 = PackRgb565(e1);
+  int indices[16];
+  float error = ChooseIndices(block, c0, c1, indices);
+
+  Color refit0, refit1;
+  if (RefitEndpoints(block, indices, &refit0, &refit1)) {
+    uint16_t r0 = PackRgb565(refit0), r1 = PackRgb565(refit1);
+    int refit_indices[16];
+    float refit_error = ChooseIndices(block, r0, r1, refit_indices);
+    if (refit_error < error) {
+      c0 = r0; c1 = r1;
+      std::copy(refit_indices, refit_indices + 16, indices);
+    }
+  }
+
+  // c0 > c1 selects the four color mode, swapping the endpoints swaps the
+  // roles of the 0-1 and the 2-3 indices
+  if (c0 < c1) {
+    std::swap(c0, c1);
+    for (int& index : indices) {
+      index ^= 1;
+    }
+  } else if (c0 == c1) {
+    std::fill(indices, indices + 16, 0);
+  }
+
+  uint32_t bits = 0;
+  for (int i = 0; i < 16; ++i) {
+    bits |= uint32_t(indices[i]) << (2*i);
+  }
+
+  out[0] = c0 & 0xFF; out[1] = c0 >> 8;
+  out[2] = c1 & 0xFF; out[3] = c1 >> 8;
+  out[4] = bits & 0xFF; out[5] = (bits >> 8) & 0xFF;
+  out[6] = (bits >> 16) & 0xFF; out[7] = bits >> 24;
+}
+
+}  // namespace
+
+std::vector<unsigned char> EncodeBC1(const unsigned char* rgb,
+                                     int width, int height) {
+  int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+  std::vector<unsigned char> out(blocks_x * blocks_y * 8);
+
+  for (int by = 0; by < blocks_y; ++by) {
+    for (int bx = 0; bx < blocks_x; ++bx) {
+      Color block[16];
+      for (int y = 0; y < 4; ++y) {
+        for (int x = 0; x < 4; ++x) {
+          int px = std::min(bx*4 + x, width-1);
+          int py = std::min(by*4 + y, height-1);
+          const unsigned char* texel = rgb + 3*(py*width + px);
+          block[y*4 + x] = Color{float(texel[0]), float(texel[1]), float(texel[2])};
+        }
+      }
+      EncodeBlock(block, &out[8 * (by*blocks_x + bx)]);
+    }
+  }
+
+  return out;
+}
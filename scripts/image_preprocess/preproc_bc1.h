@@ -0,0 +1,9 @@
+#pragma once
+
+#include <vector>
+
+// Encodes an 8 bit RGB image into BC1 (aka DXT1, GL_COMPRESSED_RGB_S3TC_DXT1)
+// blocks. The width and the height doesn't have to be a multiple of four,
+// the edge texels are repeated to fill the partial blocks.
+std::vector<unsigned char> EncodeBC1(const unsigned char* rgb,
+                                     int width, int height);
@@ -1,13 +1,106 @@
 // Copyright (c) 2015, Tamas Csala
 
-#include <iomanip>
+#include <limits>
 #include <iostream>
 #include <algorithm>
+#include "./preproc_bc1.h"
+#include "./preproc_ktx.h"
+#include "./preproc_png.h"
+#include "./preproc_mipmap.h"
+#include "./preproc_metadata.h"
+#include "./preproc_progress.h"
+#include "./preproc_encoder_pool.h"
 #include "./preproc_cube2sphere.h"
 #include "./preproc_cdlod_quad_tree_node.h"
 
-static long image_counter = 0;
-static time_t start_timer, current_timer;
+struct NormalTexelData {
+  unsigned char x, z;
+};
+
+// Bakes the normals the terrain shader used to reconstruct per fragment
+// (central differences, normalize(mx-px, texel_size, my-py)), and stores the
+// x and z components of the normal (y is always positive) as two unorm8s.
+static void GenerateNormals(const unsigned short* heights, int w, int h,
+                            double texel_size, NormalTexelData* normals) {
+  auto height = [&](int x, int y) {
+    x = std::max(0, std::min(x, w-1));
+    y = std::max(0, std::min(y, h-1));
+    return heights[y*w + x] * kMaxHeight / std::numeric_limits<unsigned short>::max();
+  };
+
+  auto encode = [](double v) {
+    return static_cast<unsigned char>(clamp(round((v*0.5 + 0.5) * 255), 0, 255));
+  };
+
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      glm::dvec3 normal = glm::normalize(glm::dvec3{
+        height(x-1, y) - height(x+1, y),
+        texel_size,
+        height(x, y-1) - height(x, y+1)
+      });
+      normals[y*w + x] = NormalTexelData{encode(normal.x), encode(normal.z)};
+    }
+  }
+}
+
+// Writes the image with its full (Catmull-Rom filtered) mipmap chain.
+template<typename T, int kChannels>
+static void WriteMipmappedKtx(const std::string& path, const KtxFormat& format,
+                              const T* data, int w, int h) {
+  std::vector<KtxLevel> levels;
+  for (const auto& mipmap : GenerateMipmaps<T, kChannels>(data, w, h)) {
+    auto bytes = reinterpret_cast<const unsigned char*>(mipmap.data.data());
+    levels.push_back(KtxLevel{mipmap.width, mipmap.height,
+        std::vector<unsigned char>(bytes, bytes + mipmap.data.size()*sizeof(T))});
+  }
+  WriteKtx(path, format, levels);
+}
+
+static void WriteTile(const std::vector<std::string>& outputs,
+                      const unsigned short* image, int w, int h,
+                      double texel_size, int png_compression_level) {
+  const std::string& png_path = outputs[0];
+  const std::string& ktx_path = outputs[1];
+  const std::string& normal_png_path = outputs[2];
+  const std::string& normal_ktx_path = outputs[3];
+  {
+    std::vector<NormalTexelData> normals(w*h);
+    GenerateNormals(image, w, h, texel_size, normals.data());
+
+    WriteMipmappedKtx<unsigned char, 2>(
+        TemporaryPath(normal_ktx_path), kKtxRg8,
+        reinterpret_cast<const unsigned char*>(normals.data()), w, h);
+    WritePng(TemporaryPath(normal_png_path), normals.data(), w, h,
+             PngFormat::kGreyAlpha8, png_compression_level);
+  }
+
+  WriteMipmappedKtx<unsigned short, 1>(TemporaryPath(ktx_path), kKtxR16,
+                                       image, w, h);
+  WritePng(TemporaryPath(png_path), image, w, h,
+           PngFormat::kGrey16, png_compression_level);
+}
+
+static void WriteTile(const std::vector<std::string>& outputs,
+                      const DiffuseTexel* image, int w, int h,
+                      double /*texel_size*/, int png_compression_level) {
+  const std::string& png_path = outputs[0];
+  const std::string& compressed_ktx_path = outputs[1];
+  {
+    auto mipmaps = GenerateMipmaps<unsigned char, 3>(
+        reinterpret_cast<const unsigned char*>(image), w, h);
+    std::vector<KtxLevel> levels;
+    for (const auto& mipmap : mipmaps) {
+      levels.push_back(KtxLevel{mipmap.width, mipmap.height,
+          EncodeBC1(mipmap.data.data(), mipmap.width, mipmap.height)});
+    }
+
+    WriteKtx(TemporaryPath(compressed_ktx_path), kKtxBC1, levels);
+  }
+
+  WritePng(TemporaryPath(png_path), image, w, h,
+           PngFormat::kRgb8, png_compression_level);
+}
 
 CdlodQuadTreeNode::CdlodQuadTreeNode(double x, double z,
                                      CubeFace face, int level)
@@ -29,78 +122,248 @@ void CdlodQuadTreeNode::initChild(int i) {
   }
 }
 
-void CdlodQuadTreeNode::GenerateImage(TexQuadTreeNode& texture) {
+template<typename Dataset>
+std::string CdlodQuadTreeNode::tile_path() const {
+  // the tile grid of the dataset is the height dataset's, scaled down
+  long divisor = 1L << LevelOffset<Dataset>();
+  return "/" + std::to_string(int(face_)) +
+         "/" + std::to_string(level_ - LevelOffset<Dataset>()) +
+         "/" + std::to_string(long(x_) / divisor) +
+         "/" + std::to_string(long(z_) / divisor);
+}
+
+template<>
+std::vector<std::string> CdlodQuadTreeNode::outputPaths<HeightDataset>() const {
+  std::string path = tile_path<HeightDataset>();
+  std::string dir = HeightDataset::kOutputDir;
+  std::string normal_dir = HeightDataset::kNormalOutputDir;
+  return {dir + path + ".png", dir + path + ".ktx",
+          normal_dir + path + ".png", normal_dir + path + ".ktx"};
+}
+
+template<>
+std::vector<std::string> CdlodQuadTreeNode::outputPaths<DiffuseDataset>() const {
+  std::string path = tile_path<DiffuseDataset>();
+  std::string dir = DiffuseDataset::kOutputDir;
+  std::string compressed_dir = DiffuseDataset::kCompressedOutputDir;
+  return {dir + path + ".png", compressed_dir + path + ".ktx"};
+}
+
+void CdlodQuadTreeNode::GenerateImage(TileInputs& inputs,
+                                      TileOutputs& outputs,
+                                      const CdlodQuadTreeNode* next) {
   if (level_ < kMinLevel) {
     return;
   }
 
-  if (image_counter == 0) {
-    time(&start_timer);
+  bool has_children = level_ > kMinLevel;
+  if (has_children) {
+    for (int i = 0; i < 4; ++i) {
+      if (!children_[i]) {
+        initChild(i);
+      }
+    }
+  }
+
+  // the tile after this one is the first child, or the one after the subtree
+  const CdlodQuadTreeNode* next_tile = has_children ? children_[0].get() : next;
+  if (next_tile) {
+    next_tile->prefetchInputs(inputs);
+  }
+  GenerateTile(inputs, outputs);
+
+  if (has_children) {
+    for (int i = 0; i < 4; ++i) {
+      children_[i]->GenerateImage(inputs, outputs,
+                                  i < 3 ? children_[i+1].get() : next);
+      children_[i].reset();
+    }
+  }
+}
+
+void CdlodQuadTreeNode::GenerateTile(TileInputs& inputs,
+                                     TileOutputs& outputs) {
+  bool height = inputs.height && needsTile<HeightDataset>(outputs.progress);
+  bool diffuse = inputs.diffuse && needsTile<DiffuseDataset>(outputs.progress);
+  if (!height && !diffuse) {
+    return;
+  }
+
+  SampleGrid grid = projectSamples();
+  if (height) {
+    generateTile(*inputs.height, grid, outputs);
   }
-  time(&current_timer);
+  if (diffuse) {
+    generateTile(*inputs.diffuse, grid, outputs);
+  }
+}
 
-  if (++image_counter % 10 == 0) {
-    std::cout.precision(6);
-    double percent = image_counter * 100.0 / kImageCount;
-    double elapsed_time = difftime(current_timer, start_timer) / 60;
-    double remaining = elapsed_time * (100-percent) / percent;
-    std::cout << '[' << std::setw(8) << percent << " %] " <<
-      "elapsed: " << elapsed_time << "m, remaining: " << remaining << "m" << std::endl;
+template<typename Dataset>
+bool CdlodQuadTreeNode::needsTile(Progress& progress) const {
+  if (!hasTile<Dataset>()) {
+    return false;
+  }
+  if (!synthetic_input && OutputsExist(outputPaths<Dataset>())) {
+    progress.TileSkipped();
+    return false;
   }
+  return true;
+}
 
+CdlodQuadTreeNode::SampleGrid CdlodQuadTreeNode::projectSamples() const {
   int w = kTexNodeDimension+2*kBorderSize, h = w;
-  TexelData *image = new TexelData[w*h]{};
-  for (int x = 0; x < w; ++x) {
-    for (int y = 0; y < h; ++y) {
-      double left_x = x_ - size()/2, top_z = z_ - size()/2;
+  SampleGrid grid{w, std::vector<glm::dvec2>(w*h),
+                  std::vector<glm::dvec2>(w*h)};
 
+  double left_x = x_ - size()/2, top_z = z_ - size()/2;
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
       glm::dvec3 sample{
         left_x + (x-kBorderSize) * size() / (w-2*kBorderSize), 0,
         top_z  + (y-kBorderSize) * size() / (h-2*kBorderSize)
       };
-      glm::dvec2 plane_sample = Cube2Plane(sample, face_, kFaceSize);
+      grid.samples[y*w + x] = Cube2NormalizedPlane(sample, face_, kFaceSize);
+    }
+  }
 
-      // derivatives for mipmapping
-      glm::dvec3 next_sample{
-        left_x + (x+0.99-kBorderSize) * size() / (w-2*kBorderSize), 0,
-        top_z  + (y+0.99-kBorderSize) * size() / (h-2*kBorderSize)
-      };
-      glm::dvec2 plane_next_sample = Cube2Plane(next_sample, face_, kFaceSize);
-      glm::dvec2 diff = plane_next_sample - plane_sample;
+  // The Jacobian of the projection, from the central differences of the
+  // neighbouring samples (one-sided at the edges of the grid), instead of
+  // projecting a second position per texel. The footprint is the bounding
+  // box of a (0.99 wide, as before) texel, which unlike the difference
+  // along the diagonal, doesn't cancel out where the mapping is rotated.
+  auto sample = [&](int x, int y) { return grid.samples[y*w + x]; };
+  for (int y = 0; y < h; ++y) {
+    int prev_y = std::max(y-1, 0), next_y = std::min(y+1, h-1);
+    for (int x = 0; x < w; ++x) {
+      int prev_x = std::max(x-1, 0), next_x = std::min(x+1, w-1);
+      glm::dvec2 d_dx = NormalizedPlaneDifference(
+          sample(next_x, y), sample(prev_x, y)) / double(next_x - prev_x);
+      glm::dvec2 d_dz = NormalizedPlaneDifference(
+          sample(x, next_y), sample(x, prev_y)) / double(next_y - prev_y);
+      grid.footprints[y*w + x] = 0.99 * (glm::abs(d_dx) + glm::abs(d_dz));
+    }
+  }
+
+  return grid;
+}
+
+void CdlodQuadTreeNode::prefetchInputs(TileInputs& inputs) const {
+  if (synthetic_input) {
+    return;
+  }
+
+  // Every 32th texel or so is enough to find the input tiles, as those are
+  // a lot larger than that, on the level that is sampled.
+  constexpr int kGridSize = 9;
+  double border = size() * kBorderSize / kTexNodeDimension;
+  double step = (size() + 2*border) / (kGridSize-1);
+  double left_x = x_ - size()/2 - border, top_z = z_ - size()/2 - border;
+  std::vector<glm::dvec2> samples(kGridSize*kGridSize);
+  for (int y = 0; y < kGridSize; ++y) {
+    for (int x = 0; x < kGridSize; ++x) {
+      glm::dvec3 sample{left_x + x*step, 0, top_z + y*step};
+      samples[y*kGridSize + x] = Cube2NormalizedPlane(sample, face_, kFaceSize);
+    }
+  }
+
+  // the footprints of the texels, the same way as in projectSamples
+  double texels_per_step = step * kTexNodeDimension / size();
+  std::vector<glm::dvec2> footprints(kGridSize*kGridSize);
+  auto sample = [&](int x, int y) { return samples[y*kGridSize + x]; };
+  for (int y = 0; y < kGridSize; ++y) {
+    int prev_y = std::max(y-1, 0), next_y = std::min(y+1, kGridSize-1);
+    for (int x = 0; x < kGridSize; ++x) {
+      int prev_x = std::max(x-1, 0), next_x = std::min(x+1, kGridSize-1);
+      glm::dvec2 d_dx = NormalizedPlaneDifference(
+          sample(next_x, y), sample(prev_x, y)) / double(next_x - prev_x);
+      glm::dvec2 d_dz = NormalizedPlaneDifference(
+          sample(x, next_y), sample(x, prev_y)) / double(next_y - prev_y);
+      footprints[y*kGridSize + x] =
+          0.99 * (glm::abs(d_dx) + glm::abs(d_dz)) / texels_per_step;
+    }
+  }
+
+  prefetchInputs(inputs.height, samples, footprints);
+  prefetchInputs(inputs.diffuse, samples, footprints);
+}
+
+template<typename Dataset>
+void CdlodQuadTreeNode::prefetchInputs(
+    TexQuadTreeNode<Dataset>* texture, const std::vector<glm::dvec2>& samples,
+    const std::vector<glm::dvec2>& footprints) const {
+  if (!texture) {
+    return;
+  }
 
-      image[y*w + x] = texture.FetchPixel(plane_sample, diff);
+  // Prefetch is called even if there's nothing to prefetch, as the prefetcher
+  // counts the calls to know which prefetched tiles are stale.
+  std::vector<glm::dvec2> input_samples, input_footprints;
+  if (hasTile<Dataset>() && !OutputsExist(outputPaths<Dataset>())) {
+    for (size_t i = 0; i < samples.size(); ++i) {
+      input_samples.push_back(NormalizedPlane2Input<Dataset>(samples[i]));
+      input_footprints.push_back(
+          NormalizedPlane2Input<Dataset>(footprints[i]));
     }
   }
+  texture->Prefetch(input_samples.data(), input_footprints.data(),
+                    input_samples.size());
+}
+
+template<typename Dataset>
+void CdlodQuadTreeNode::generateTile(TexQuadTreeNode<Dataset>& texture,
+                                     const SampleGrid& grid,
+                                     TileOutputs& outputs) {
+  using TexelData = typename Dataset::Texel;
 
-  Magick::Image out;
-#ifdef HEIGHTMAP
-  out.read(w, h, "I", Magick::ShortPixel, image);
-#else
-  out.read(w, h, "RGB", Magick::CharPixel, image);
-#endif
-  delete[] image;
-
-  std::string dir = kOutputDir + "/" + std::to_string(int(face_)) +
-                                 "/" + std::to_string(level_) +
-                                 "/" + std::to_string(long(x_));
-  std::string filename = std::to_string(long(z_)) + ".png";
-
-  int ret = system(("mkdir -p " + dir).c_str());
-  assert (ret == 0);
-
-  out.matte(false);
-  out.quality(100);
-#ifdef HEIGHTMAP
-  out.defineValue("png", "color-type", "0");
-  out.defineValue("png", "bit-depth", "16");
-#endif
-  out.write(dir + "/" + filename);
-
-  for (int i = 0; i < 4; ++i) {
-    if (!children_[i]) {
-      initChild(i);
+  int w = kTexNodeDimension+2*Dataset::kBorderSize, h = w;
+  // the border of the dataset is the inner part of the grid's border
+  int offset = kBorderSize - Dataset::kBorderSize;
+
+  std::vector<TexelData> image(w*h);
+  std::vector<glm::dvec2> samples(w), diffs(w);
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      int idx = (y+offset)*grid.width + (x+offset);
+      samples[x] = NormalizedPlane2Input<Dataset>(grid.samples[idx]);
+      diffs[x] = NormalizedPlane2Input<Dataset>(grid.footprints[idx]);
     }
-    children_[i]->GenerateImage(texture);
-    children_[i].reset();
+
+    texture.FetchRow(samples.data(), diffs.data(), w, &image[y*w]);
   }
+  texture.age();
+
+  if (synthetic_input) {
+    outputs.progress.TileWritten(0);
+    return;
+  }
+
+  std::vector<std::string> paths = outputPaths<Dataset>();
+  double texel_size = size() / kElevationTexSizeWithBorders;
+  Progress& progress = outputs.progress;
+  int compression_level = outputs.png_compression_level;
+  MetadataFile* metadata = outputs.metadata[face_];
+  int level = level_;
+  double x = x_, z = z_;
+  outputs.encoder.Submit(
+      [paths, image = std::move(image), w, h, texel_size, compression_level,
+       &progress, metadata, level, x, z]() {
+    for (const std::string& path : paths) {
+      CreateParentDirectories(path);
+    }
+
+    // Every output is written into a temporary file first, and they are only
+    // renamed when all of them are complete. The metadata is written before
+    // that, so a committed tile always has its record.
+    WriteTile(paths, image.data(), w, h, texel_size, compression_level);
+    if (metadata) {
+      metadata->Write(level, x, z, ComputeTileMetadata(
+          image.data(), w, h, Dataset::kBorderSize));
+    }
+
+    size_t bytes = 0;
+    for (const std::string& path : paths) {
+      bytes += CommitOutput(path);
+    }
+    progress.TileWritten(bytes);
+  });
 }
@@ -4,9 +4,32 @@
 #define ENGINE_CDLOD_QUAD_TREE_NODE_H_
 
 #include <memory>
+#include <string>
+#include <vector>
 #include "./preproc_tex_quad_tree_node.h"
 #include "./preproc_cube2sphere.h"
 
+class Progress;
+class EncoderPool;
+class MetadataFile;
+
+// The input quadtrees of the datasets, nullptr for the datasets that are
+// not generated.
+struct TileInputs {
+  TexQuadTreeNode<HeightDataset>* height = nullptr;
+  TexQuadTreeNode<DiffuseDataset>* diffuse = nullptr;
+};
+
+// Where the generated tiles go.
+struct TileOutputs {
+  Progress& progress;
+  EncoderPool& encoder;  // the tiles are encoded and written by these threads
+  int png_compression_level;
+  MetadataFile* metadata[6];  // per face, nullptr if it isn't written
+};
+
+// A node of the tile grid of the height dataset (see kFaceSize), that
+// generates the tiles of every dataset that covers the same area.
 class CdlodQuadTreeNode {
  public:
   CdlodQuadTreeNode(double x, double z, CubeFace face, int level);
@@ -14,7 +37,16 @@ class CdlodQuadTreeNode {
   double scale() const { return pow(2, level_); }
   double size() const { return kTexNodeDimension * scale(); }
 
-  void GenerateImage(TexQuadTreeNode& texture);
+  // Generates this tile, and every tile below it (depth-first). The inputs of
+  // every tile are prefetched while the previous one is generated, next is
+  // the tile generated after this subtree (if it's known).
+  void GenerateImage(TileInputs& inputs, TileOutputs& outputs,
+                     const CdlodQuadTreeNode* next = nullptr);
+
+  // Generates only this tile of the datasets, except the ones, whose outputs
+  // already exist. The sample positions are projected once, for all of them.
+  // The tiles are written asynchronously, by the encoder threads.
+  void GenerateTile(TileInputs& inputs, TileOutputs& outputs);
 
  private:
   double x_, z_;
@@ -22,7 +54,42 @@ class CdlodQuadTreeNode {
   int level_;
   std::unique_ptr<CdlodQuadTreeNode> children_[4];
 
+  // The sample positions of the tile in the normalized input plane, with a
+  // border of kBorderSize, and the footprints of the texels (for the
+  // selection of the input level).
+  struct SampleGrid {
+    int width;
+    std::vector<glm::dvec2> samples, footprints;
+  };
+
   void initChild(int i);
+  SampleGrid projectSamples() const;
+
+  // Prefetches the input tiles of the tile, using a sparse grid of samples.
+  void prefetchInputs(TileInputs& inputs) const;
+  template<typename Dataset>
+  void prefetchInputs(TexQuadTreeNode<Dataset>* texture,
+                      const std::vector<glm::dvec2>& samples,
+                      const std::vector<glm::dvec2>& footprints) const;
+
+  // If the dataset has a tile here (it might have fewer levels).
+  template<typename Dataset>
+  bool hasTile() const { return level_ - LevelOffset<Dataset>() >= kMinLevel; }
+
+  // If the tile of the dataset has to be generated.
+  template<typename Dataset>
+  bool needsTile(Progress& progress) const;
+
+  template<typename Dataset>
+  void generateTile(TexQuadTreeNode<Dataset>& texture,
+                    const SampleGrid& grid, TileOutputs& outputs);
+
+  // The files the tile of the dataset is written into.
+  template<typename Dataset>
+  std::vector<std::string> outputPaths() const;
+
+  template<typename Dataset>
+  std::string tile_path() const; // face/level/x/z
 };
 
 #endif
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cmath>
 #include "./preproc_settings.h"
 
 enum CubeFace {
@@ -101,9 +102,11 @@ inline glm::dvec3 Cube2Sphere(const glm::dvec3& pos,
   return (kRadius + pos.y) * Cubify(pos_on_cube);
 }
 
-inline glm::dvec2 Cube2Plane(const glm::dvec3& pos,
-                              CubeFace face,
-                              double face_size) {
+// The position in the equirectangular input, in [0, 1]. It doesn't depend
+// on the dataset, so it is computed once for all of them.
+inline glm::dvec2 Cube2NormalizedPlane(const glm::dvec3& pos,
+                                       CubeFace face,
+                                       double face_size) {
   glm::dvec3 pos_on_cube = FaceLocalToUnitCube(pos, face, face_size);
   glm::dvec3 pos_on_unit_sphere = Cubify(pos_on_cube);
   glm::dvec2 angles{
@@ -112,7 +115,32 @@ inline glm::dvec2 Cube2Plane(const glm::dvec3& pos,
   };
 
   return glm::dvec2{
-    (angles.x + M_PI) / (2*M_PI) * (kInputWidth - 1),
-    (M_PI - angles.y) / M_PI * (kInputHeight - 1),
+    (angles.x + M_PI) / (2*M_PI),
+    (M_PI - angles.y) / M_PI,
+  };
+}
+
+// The difference of two positions on the normalized plane, with the
+// longitude wrapping around.
+inline glm::dvec2 NormalizedPlaneDifference(const glm::dvec2& a,
+                                            const glm::dvec2& b) {
+  glm::dvec2 diff = a - b;
+  diff.x -= std::round(diff.x);
+  return diff;
+}
+
+// The texel coordinates in the input of the dataset.
+template<typename Dataset>
+inline glm::dvec2 NormalizedPlane2Input(const glm::dvec2& pos) {
+  return glm::dvec2{
+    pos.x * (Dataset::kInputWidth - 1),
+    pos.y * (Dataset::kInputHeight - 1),
   };
 }
+
+template<typename Dataset>
+inline glm::dvec2 Cube2Plane(const glm::dvec3& pos,
+                             CubeFace face,
+                             double face_size) {
+  return NormalizedPlane2Input<Dataset>(Cube2NormalizedPlane(pos, face, face_size));
+}
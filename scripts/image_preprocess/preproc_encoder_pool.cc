@@ -0,0 +1,77 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <algorithm>
+#include "./preproc_encoder_pool.h"
+
+EncoderPool::EncoderPool(int thread_count, size_t max_queued_jobs)
+    : max_queued_jobs_(std::max<size_t>(max_queued_jobs, 1)) {
+  for (int i = 0; i < std::max(thread_count, 1); ++i) {
+    threads_.emplace_back([this]() { run(); });
+  }
+}
+
+EncoderPool::~EncoderPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  job_available_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void EncoderPool::Submit(std::function<void()> job) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_done_.wait(lock, [this]() {
+    return jobs_.size() < max_queued_jobs_ || error_;
+  });
+  rethrowError();
+
+  jobs_.push_back(std::move(job));
+  job_available_.notify_one();
+}
+
+void EncoderPool::Finish() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_done_.wait(lock, [this]() {
+    return (jobs_.empty() && running_jobs_ == 0) || error_;
+  });
+  rethrowError();
+}
+
+void EncoderPool::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    job_available_.wait(lock, [this]() { return !jobs_.empty() || stopping_; });
+    if (jobs_.empty()) {
+      return;  // stopping
+    }
+
+    std::function<void()> job = std::move(jobs_.front());
+    jobs_.pop_front();
+    running_jobs_++;
+
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      job();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+
+    running_jobs_--;
+    if (error && !error_) {
+      error_ = error;
+    }
+    job_done_.notify_all();
+  }
+}
+
+// Requires the mutex to be locked.
+void EncoderPool::rethrowError() {
+  if (error_) {
+    std::rethrow_exception(error_);
+  }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+// Threads that encode and write the generated tiles, so that the workers can
+// go on sampling the next tile meanwhile. The queue is bounded, Submit blocks
+// while it is full, so the tiles waiting for encoding use bounded memory.
+class EncoderPool {
+ public:
+  EncoderPool(int thread_count, size_t max_queued_jobs);
+  ~EncoderPool();
+
+  // Throws the exception of a failed job, if there was any.
+  void Submit(std::function<void()> job);
+
+  // Waits until every submitted job is done, and throws the exception of
+  // the first failed one.
+  void Finish();
+
+ private:
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> jobs_;
+  size_t max_queued_jobs_;
+  int running_jobs_ = 0;
+  bool stopping_ = false;
+  std::exception_ptr error_;
+
+  std::mutex mutex_;
+  std::condition_variable job_available_, job_done_;
+
+  void run();
+  void rethrowError();
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cmath>
+
+inline float BellFunc(float x) {
+  float f = x * 0.75; // Converting -2 to +2 to -1.5 to +1.5
+  if (f > -1.5 && f < -0.5) {
+    return 0.5 * pow(f + 1.5, 2.0);
+  } else if (f > -0.5 && f < 0.5) {
+    return 3.0 / 4.0 - (f*f);
+  } else if (f > 0.5 && f < 1.5) {
+    return 0.5 * pow(f - 1.5, 2.0);
+  } else {
+    return 0.0;
+  }
+}
+
+inline float CatMullRom(float x) {
+  const float B = 0.0;
+  const float C = 0.5;
+  float f = std::abs(x);
+
+  if (f < 1.0) {
+    return ((12 - 9*B - 6*C) * (f*f*f) +
+            (-18 + 12*B + 6*C) * (f*f) +
+            (6 - 2*B)) / 6.0;
+  } else if (1.0 <= f && f < 2.0) {
+    return ((-B - 6*C) * (f*f*f) +
+            (6*B + 30*C) * (f*f) +
+            (-12*B - 48*C) * f +
+             8*B + 24*C) / 6.0;
+  } else {
+    return 0.0;
+  }
+}
@@ -1,23 +1,75 @@
+#include <string>
+#include <cstdlib>
 #include <iostream>
+#include <algorithm>
 #include "./preproc_settings.h"
-#include "./preproc_tex_quad_tree_node.h"
-#include "./preproc_cdlod_quad_tree_node.h"
+#include "./preproc_parallel_driver.h"
 
-int main(int argv, char** argc) {
-  int tw = kInputWidth, th = kInputHeight;
-  TexQuadTreeNode tex_node (nullptr, tw/2, th/2, tw, th, kInputMaxLevel, 0);
+static void PrintUsage(const char* program) {
+  std::cerr << "Usage: " << program << " <face>... [--threads N] [--memory-budget MB]"
+            << " [--encode-threads N] [--png-compression 0-9]"
+            << " [--height-only | --diffuse-only] [--synthetic]\n"
+            << "  face: 0-5, or 'all' for every face\n"
+            << "  --threads: the number of worker threads "
+            << "(default: as many as the cores and the memory budget allow)\n"
+            << "  --memory-budget: the memory the input caches of the workers "
+            << "can use in MB, split evenly between them (default: 4096)\n"
+            << "  --encode-threads: the number of threads encoding and writing "
+            << "the tiles (default: as many as the cores)\n"
+            << "  --png-compression: the zlib level of the PNG outputs, 0 is "
+            << "the fastest, 9 is the smallest (default: 6)\n"
+            << "  --height-only, --diffuse-only: generate only one of the "
+            << "datasets (by default both are generated in the same pass)\n"
+            << "  --synthetic: sample a procedural input instead of the input "
+            << "images, without writing anything (for benchmarking)"
+            << std::endl;
+}
+
+int main(int argc, char** argv) {
+  DriverOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--threads" && i+1 < argc) {
+      options.thread_count = std::atoi(argv[++i]);
+    } else if (arg == "--memory-budget" && i+1 < argc) {
+      options.memory_budget_mb = std::atol(argv[++i]);
+    } else if (arg == "--encode-threads" && i+1 < argc) {
+      options.encode_threads = std::atoi(argv[++i]);
+    } else if (arg == "--png-compression" && i+1 < argc) {
+      options.png_compression_level = std::atoi(argv[++i]);
+    } else if (arg == "--height-only") {
+      options.diffuse = false;
+    } else if (arg == "--diffuse-only") {
+      options.height = false;
+    } else if (arg == "--synthetic") {
+      options.synthetic_input = true;
+    } else if (arg == "all") {
+      for (int face = 0; face < 6; ++face) {
+        options.faces.push_back(CubeFace(face));
+      }
+    } else if (arg.size() == 1 && '0' <= arg[0] && arg[0] < '6') {
+      options.faces.push_back(CubeFace(arg[0]-'0'));
+    } else {
+      std::cerr << "Invalid parameter: " << arg << std::endl;
+      PrintUsage(argv[0]);
+      return -1;
+    }
+  }
 
-  if (argv != 2) {
+  if (options.faces.empty()) {
     std::cerr << "Face parameter must be specified" << std::endl;
+    PrintUsage(argv[0]);
     return -1;
   }
 
-  char face = argc[1][0];
-  if ('0' <= face && face < '6') {
-    CdlodQuadTreeNode node (kFaceSize/2, kFaceSize/2, CubeFace(face-'0'), kMaxLevel);
-    node.GenerateImage(tex_node);
-  } else {
-    std::cout << "Invalid face parameter!";
+  std::sort(options.faces.begin(), options.faces.end());
+  options.faces.erase(std::unique(options.faces.begin(), options.faces.end()),
+                      options.faces.end());
+
+  try {
+    RunParallel(options);
+  } catch (const std::exception& ex) {
+    std::cerr << ex.what() << std::endl;
     return -1;
   }
 
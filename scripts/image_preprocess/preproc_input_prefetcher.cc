@@ -0,0 +1,119 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <utility>
+#include <exception>
+#include "./preproc_input_prefetcher.h"
+
+InputPrefetcher::InputPrefetcher(PngFormat format)
+    : format_(format), thread_([this]() { run(); }) { }
+
+InputPrefetcher::~InputPrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_.notify_all();
+  thread_.join();
+}
+
+void InputPrefetcher::Prefetch(const std::vector<std::string>& paths) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  request_++;
+  for (const std::string& path : paths) {
+    auto iter = entries_.find(path);
+    if (iter != entries_.end()) {
+      iter->second.request = request_;
+    } else {
+      entries_.emplace(path, Entry{State::kQueued, request_});
+      queue_.push_back(path);
+    }
+  }
+  dropStaleEntries();
+  queued_.notify_one();
+}
+
+bool InputPrefetcher::Take(const std::string& path,
+                           std::vector<unsigned char>& texels,
+                           unsigned& width, unsigned& height) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto iter = entries_.find(path);
+  if (iter == entries_.end()) {
+    return false;
+  }
+
+  // Only the caller of Prefetch and Take removes entries, so the entry
+  // stays valid while waiting.
+  Entry& entry = iter->second;
+  decoded_.wait(lock, [&entry]() { return entry.state != State::kDecoding; });
+
+  bool decoded = entry.state == State::kDecoded;
+  if (decoded) {
+    texels = std::move(entry.texels);
+    width = entry.width;
+    height = entry.height;
+    memory_used_ -= texels.size();
+  }
+  entries_.erase(path);  // a queued path is skipped by the decoder thread
+  return decoded;
+}
+
+size_t InputPrefetcher::memory_used() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return memory_used_;
+}
+
+// Requires the mutex to be locked.
+void InputPrefetcher::dropStaleEntries() {
+  for (auto iter = entries_.begin(); iter != entries_.end();) {
+    const Entry& entry = iter->second;
+    if (entry.request + 1 < request_ && entry.state != State::kDecoding) {
+      memory_used_ -= entry.texels.size();
+      iter = entries_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+void InputPrefetcher::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queued_.wait(lock, [this]() { return !queue_.empty() || stopping_; });
+    if (stopping_) {
+      return;
+    }
+
+    std::string path = std::move(queue_.front());
+    queue_.pop_front();
+    auto iter = entries_.find(path);
+    if (iter == entries_.end() || iter->second.state != State::kQueued) {
+      continue;  // taken or dropped meanwhile
+    }
+    // The entries being decoded aren't removed, and rehashing doesn't move
+    // the elements, so this stays valid while the mutex is unlocked.
+    Entry& entry = iter->second;
+    entry.state = State::kDecoding;
+
+    lock.unlock();
+    std::vector<unsigned char> texels;
+    unsigned width = 0, height = 0;
+    bool decoded = true;
+    try {
+      texels = ReadPng(path, format_, width, height);
+    } catch (const std::exception&) {
+      decoded = false;  // Take reports it, by reading the image again
+    }
+    lock.lock();
+
+    if (decoded) {
+      entry.state = State::kDecoded;
+      memory_used_ += texels.size();
+      entry.texels = std::move(texels);
+      entry.width = width;
+      entry.height = height;
+    } else {
+      entry.state = State::kFailed;
+    }
+    decoded_.notify_all();
+  }
+}
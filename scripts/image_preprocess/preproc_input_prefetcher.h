@@ -0,0 +1,55 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+#include "./preproc_png.h"
+
+// Decodes input images on a background thread, before they are needed, so
+// the sampling thread doesn't have to wait for the decoding. The requests are
+// made one output tile ahead, the images requested by the last two calls of
+// Prefetch are kept until they are taken, the older ones are dropped.
+class InputPrefetcher {
+ public:
+  explicit InputPrefetcher(PngFormat format);
+  ~InputPrefetcher();
+
+  void Prefetch(const std::vector<std::string>& paths);
+
+  // Takes the decoded image, waiting for it if it is being decoded. Returns
+  // false if it wasn't requested, or its decoding didn't start yet, or it
+  // failed, the image should be read by the caller then.
+  bool Take(const std::string& path, std::vector<unsigned char>& texels,
+            unsigned& width, unsigned& height);
+
+  // The memory used by the decoded images, that aren't taken yet.
+  size_t memory_used() const;
+
+ private:
+  enum class State { kQueued, kDecoding, kDecoded, kFailed };
+
+  struct Entry {
+    State state;
+    unsigned request;  // the last call of Prefetch, that requested it
+    std::vector<unsigned char> texels;
+    unsigned width = 0, height = 0;
+  };
+
+  PngFormat format_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::deque<std::string> queue_;
+  unsigned request_ = 0;
+  size_t memory_used_ = 0;
+  bool stopping_ = false;
+
+  mutable std::mutex mutex_;
+  std::condition_variable queued_, decoded_;
+  std::thread thread_;
+
+  void run();
+  void dropStaleEntries();
+};
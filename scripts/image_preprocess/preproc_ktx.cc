@@ -0,0 +1,63 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include "./preproc_ktx.h"
+
+static void WriteUint32(std::ofstream& out, uint32_t value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void WritePadding(std::ofstream& out, size_t size) {
+  static const char kZeros[4] = {};
+  out.write(kZeros, (4 - size % 4) % 4);
+}
+
+void WriteKtx(const std::string& path, const KtxFormat& format,
+              const std::vector<KtxLevel>& levels) {
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    throw std::runtime_error("Can't open " + path + " for writing");
+  }
+
+  static const unsigned char kIdentifier[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+  };
+  out.write(reinterpret_cast<const char*>(kIdentifier), sizeof(kIdentifier));
+  WriteUint32(out, 0x04030201); // endianness
+  WriteUint32(out, format.gl_type);
+  WriteUint32(out, format.gl_type_size);
+  WriteUint32(out, format.gl_format);
+  WriteUint32(out, format.gl_internal_format);
+  WriteUint32(out, format.gl_base_internal_format);
+  WriteUint32(out, levels[0].width);
+  WriteUint32(out, levels[0].height);
+  WriteUint32(out, 0); // pixel depth
+  WriteUint32(out, 0); // number of array elements
+  WriteUint32(out, 1); // number of faces
+  WriteUint32(out, levels.size());
+  WriteUint32(out, 0); // bytes of key value data
+
+  bool compressed = (format.gl_type == 0);
+  for (const KtxLevel& level : levels) {
+    if (compressed) {
+      WriteUint32(out, level.data.size());
+      out.write(reinterpret_cast<const char*>(level.data.data()), level.data.size());
+      WritePadding(out, level.data.size());
+    } else {
+      // every row has to be 4 byte aligned
+      size_t row_size = level.data.size() / level.height;
+      size_t padded_row_size = (row_size + 3) / 4 * 4;
+      WriteUint32(out, padded_row_size * level.height);
+      for (int y = 0; y < level.height; ++y) {
+        out.write(reinterpret_cast<const char*>(&level.data[y*row_size]), row_size);
+        WritePadding(out, row_size);
+      }
+    }
+  }
+
+  if (!out) {
+    throw std::runtime_error("Failed to write " + path);
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// GL enums that are used in the KTX headers (the preprocessor doesn't
+// include any GL headers).
+constexpr unsigned kGlUnsignedByte = 0x1401;
+constexpr unsigned kGlUnsignedShort = 0x1403;
+constexpr unsigned kGlRed = 0x1903;
+constexpr unsigned kGlRgb = 0x1907;
+constexpr unsigned kGlRg = 0x8227;
+constexpr unsigned kGlR16 = 0x822A;
+constexpr unsigned kGlRg8 = 0x822B;
+constexpr unsigned kGlRgb8 = 0x8051;
+constexpr unsigned kGlCompressedRgbS3tcDxt1 = 0x83F0;
+
+struct KtxFormat {
+  unsigned gl_type;      // 0 for compressed formats
+  unsigned gl_type_size;
+  unsigned gl_format;    // 0 for compressed formats
+  unsigned gl_internal_format;
+  unsigned gl_base_internal_format;
+};
+
+constexpr KtxFormat kKtxR16{kGlUnsignedShort, 2, kGlRed, kGlR16, kGlRed};
+constexpr KtxFormat kKtxRg8{kGlUnsignedByte, 1, kGlRg, kGlRg8, kGlRg};
+constexpr KtxFormat kKtxRgb8{kGlUnsignedByte, 1, kGlRgb, kGlRgb8, kGlRgb};
+constexpr KtxFormat kKtxBC1{0, 1, 0, kGlCompressedRgbS3tcDxt1, kGlRgb};
+
+struct KtxLevel {
+  int width, height;
+  // Tightly packed texel rows for uncompressed formats, the writer takes
+  // care of the 4 byte row alignment required by the format.
+  std::vector<unsigned char> data;
+};
+
+// Writes a 2D texture with its mipmap chain into a KTX 1.1 file.
+void WriteKtx(const std::string& path, const KtxFormat& format,
+              const std::vector<KtxLevel>& levels);
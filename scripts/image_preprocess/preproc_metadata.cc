@@ -0,0 +1,187 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "./preproc_bc1.h"
+#include "./preproc_metadata.h"
+
+namespace {
+
+constexpr char kMagic[4] = {'R', 'L', 'M', 'D'};
+constexpr uint32_t kVersion = 1;
+constexpr int kLevelCount = kMaxLevel + 1;
+
+struct Header {
+  char magic[4];
+  uint32_t version, face, level_count, record_size, padding;
+  uint64_t level_offsets[kLevelCount];
+};
+
+// The number of tiles in a row of the level.
+long TilesPerRow(int level) {
+  return 1L << (kMaxLevel - level);
+}
+
+Header CreateHeader(CubeFace face) {
+  Header header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.face = face;
+  header.level_count = kLevelCount;
+  header.record_size = sizeof(TileMetadataRecord);
+  header.padding = 0;
+
+  uint64_t offset = sizeof(Header);
+  for (int level = kMaxLevel; level >= 0; --level) {
+    header.level_offsets[level] = offset;
+    offset += sqr(TilesPerRow(level)) * sizeof(TileMetadataRecord);
+  }
+  return header;
+}
+
+size_t FileSize(const Header& header) {
+  // level 0 is the last one
+  return header.level_offsets[0] +
+         sqr(TilesPerRow(0)) * sizeof(TileMetadataRecord);
+}
+
+uint32_t Fnv1a(const unsigned char* bytes, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+} // namespace
+
+HeightMetadata ComputeTileMetadata(const unsigned short* image, int w, int h,
+                                   int border_size) {
+  HeightMetadata metadata{};
+  metadata.flags = kTileMetadataPresent;
+  if (std::all_of(image, image + w*h,
+                  [image](unsigned short v) { return v == image[0]; })) {
+    metadata.flags |= kTileMetadataConstant;
+  }
+  metadata.checksum = Fnv1a(reinterpret_cast<const unsigned char*>(image),
+                            w*h*sizeof(unsigned short));
+
+  // The tile covers the texels between the borders, including both edges,
+  // as the edge texels are shared by the neighbouring tiles.
+  int size = kTexNodeDimension;
+  auto height = [&](int x, int y) {
+    return int(image[(y+border_size)*w + (x+border_size)]);
+  };
+
+  int min = std::numeric_limits<unsigned short>::max(), max = 0;
+  int roughness = 0;
+  for (int y = 0; y <= size; ++y) {
+    // the texels of the half resolution grid around this one
+    int y0 = y & ~1, y1 = std::min(y0 + 2, size);
+    double fy = (y - y0) / 2.0;
+    for (int x = 0; x <= size; ++x) {
+      int value = height(x, y);
+      min = std::min(min, value);
+      max = std::max(max, value);
+
+      int x0 = x & ~1, x1 = std::min(x0 + 2, size);
+      double fx = (x - x0) / 2.0;
+      double coarse =
+          (1-fy) * ((1-fx) * height(x0, y0) + fx * height(x1, y0)) +
+          fy     * ((1-fx) * height(x0, y1) + fx * height(x1, y1));
+      roughness = std::max(roughness, int(std::ceil(std::abs(value - coarse))));
+    }
+  }
+
+  metadata.min = min;
+  metadata.max = max;
+  metadata.roughness = roughness;
+  return metadata;
+}
+
+DiffuseMetadata ComputeTileMetadata(const DiffuseTexel* image, int w, int h,
+                                    int /*border_size*/) {
+  DiffuseMetadata metadata{};
+  metadata.flags = kTileMetadataPresent;
+
+  DiffuseTexel color = image[0];
+  bool constant = std::all_of(image, image + w*h, [color](DiffuseTexel v) {
+    return v.r == color.r && v.g == color.g && v.b == color.b;
+  });
+  if (constant) {
+    metadata.flags |= kTileMetadataConstant;
+    metadata.color = color;
+
+    // every block of the tile (and its mipmaps) is this one
+    DiffuseTexel block[16];
+    std::fill(block, block + 16, color);
+    std::vector<unsigned char> encoded = EncodeBC1(
+        reinterpret_cast<const unsigned char*>(block), 4, 4);
+    std::copy(encoded.begin(), encoded.end(), metadata.bc1_block);
+  }
+  return metadata;
+}
+
+MetadataFile::MetadataFile(const std::string& path, CubeFace face)
+    : path_(path) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Couldn't open " + path);
+  }
+
+  Header expected = CreateHeader(face);
+  Header header;
+  bool valid = pread(fd_, &header, sizeof(header), 0) == sizeof(header) &&
+               std::memcmp(&header, &expected, sizeof(header)) == 0 &&
+               lseek(fd_, 0, SEEK_END) == off_t(FileSize(expected));
+  if (!valid) {
+    // the records of the tiles, that weren't generated are zeros
+    if (ftruncate(fd_, 0) != 0 || ftruncate(fd_, FileSize(expected)) != 0) {
+      close(fd_);
+      throw std::runtime_error("Couldn't resize " + path);
+    }
+    write(0, &expected, sizeof(expected));
+  }
+}
+
+MetadataFile::~MetadataFile() {
+  close(fd_);
+}
+
+void MetadataFile::Write(int level, double x, double z,
+                         const HeightMetadata& metadata) {
+  write(recordOffset(level, x, z) + offsetof(TileMetadataRecord, height),
+        &metadata, sizeof(metadata));
+}
+
+void MetadataFile::Write(int level, double x, double z,
+                         const DiffuseMetadata& metadata) {
+  write(recordOffset(level, x, z) + offsetof(TileMetadataRecord, diffuse),
+        &metadata, sizeof(metadata));
+}
+
+size_t MetadataFile::recordOffset(int level, double x, double z) const {
+  static const Header header = CreateHeader(kPosX);  // same for every face
+  long tile_size = long(kTexNodeDimension) << level;
+  long tx = long(x) / tile_size, tz = long(z) / tile_size;
+  return header.level_offsets[level] +
+         (tz * TilesPerRow(level) + tx) * sizeof(TileMetadataRecord);
+}
+
+void MetadataFile::write(size_t offset, const void* data, size_t size) {
+  if (pwrite(fd_, data, size, offset) != ssize_t(size)) {
+    throw std::runtime_error("Couldn't write " + path_);
+  }
+}
+
+std::string MetadataPath(CubeFace face) {
+  return std::string{HeightDataset::kOutputDir} + "/" +
+         std::to_string(int(face)) + "/metadata.bin";
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include "./preproc_settings.h"
+#include "./preproc_cube2sphere.h"
+
+// A sidecar file per face, with a fixed size record for every node of the
+// tile grid, so that the runtime knows the height range of a tile, and if it
+// is constant, without loading it. The layout has to match the runtime's
+// cdlod/tile_metadata.hpp. Every field is little endian.
+//
+// header: "RLMD", version, face, level count, record size, padding, then the
+//         byte offset of the records of every level (uint64s, from level 0)
+// records: the levels from the top (the whole face) to level 0, every level
+//          in row major order (z, then x)
+//
+// A record of a tile, that wasn't generated yet is all zeros.
+
+enum TileMetadataFlags : uint8_t {
+  kTileMetadataPresent = 1 << 0,
+  kTileMetadataConstant = 1 << 1  // every texel (with the border) is the same
+};
+
+struct HeightMetadata {
+  // the range of the texels of the tile (without the border)
+  uint16_t min, max;
+  // The largest error of the tile (in texel values), if it was sampled at
+  // half of its resolution, with bilinear interpolation.
+  uint16_t roughness;
+  uint8_t flags;
+  uint8_t padding;
+  // FNV-1a of the level 0 texels, with the border (16 bit, native order)
+  uint32_t checksum;
+};
+
+struct DiffuseMetadata {
+  uint8_t flags;
+  DiffuseTexel color;  // if it's constant
+  uint8_t bc1_block[8];  // the color as a BC1 block, if it's constant
+};
+
+struct TileMetadataRecord {
+  HeightMetadata height;  // of the height tile of the node
+  DiffuseMetadata diffuse;  // of the diffuse tile covering the same area
+};
+
+static_assert(sizeof(HeightMetadata) == 12, "Unexpected padding");
+static_assert(sizeof(DiffuseMetadata) == 12, "Unexpected padding");
+static_assert(sizeof(TileMetadataRecord) == 24, "Unexpected padding");
+
+HeightMetadata ComputeTileMetadata(const unsigned short* image, int w, int h,
+                                   int border_size);
+DiffuseMetadata ComputeTileMetadata(const DiffuseTexel* image, int w, int h,
+                                    int border_size);
+
+// The sidecar of a face. The records of the height and the diffuse tiles are
+// written separately, with pwrite, so it can be used from multiple threads.
+class MetadataFile {
+ public:
+  // Opens the file, creating it if it doesn't exist (or it is invalid). The
+  // records of an existing file are kept, so that the ones of the skipped
+  // tiles stay valid. Throws std::runtime_error on failure.
+  MetadataFile(const std::string& path, CubeFace face);
+  ~MetadataFile();
+
+  MetadataFile(const MetadataFile&) = delete;
+  MetadataFile& operator=(const MetadataFile&) = delete;
+
+  // level, x and z are the ones of the node of the tile grid.
+  void Write(int level, double x, double z, const HeightMetadata& metadata);
+  void Write(int level, double x, double z, const DiffuseMetadata& metadata);
+
+ private:
+  std::string path_;
+  int fd_ = -1;
+
+  size_t recordOffset(int level, double x, double z) const;
+  void write(size_t offset, const void* data, size_t size);
+};
+
+// Where the metadata of the face is written (next to its height tiles).
+std::string MetadataPath(CubeFace face);
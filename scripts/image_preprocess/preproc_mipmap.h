@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "./preproc_filters.h"
+#include "./preproc_settings.h"
+
+// A single mipmap level of an image, with the channels interleaved.
+template<typename T>
+struct MipLevel {
+  int width, height;
+  std::vector<T> data;
+};
+
+// Resizes an image with a separable Catmull-Rom filter, that is widened by
+// the minification ratio, so that it doesn't alias. This is the same filter
+// that is used to sample the input dataset.
+template<typename T, int kChannels>
+MipLevel<T> ResizeCatmullRom(const MipLevel<T>& src, int width, int height) {
+  auto resize_1d = [](const double* src, int src_size, int src_stride,
+                      double* dst, int dst_size, int dst_stride,
+                      int channel_count) {
+    double scale = double(src_size) / dst_size;
+    double support = 2 * std::max(scale, 1.0);
+    for (int i = 0; i < dst_size; ++i) {
+      double center = (i + 0.5) * scale - 0.5;
+      int first = int(std::floor(center - support)) + 1;
+      int last = int(std::ceil(center + support)) - 1;
+
+      std::vector<double> sum(channel_count, 0.0);
+      double sum_weight = 0.0;
+      for (int j = first; j <= last; ++j) {
+        double weight = CatMullRom((j - center) / std::max(scale, 1.0));
+        int clamped_j = std::max(0, std::min(j, src_size-1));
+        for (int c = 0; c < channel_count; ++c) {
+          sum[c] += weight * src[clamped_j*src_stride + c];
+        }
+        sum_weight += weight;
+      }
+      for (int c = 0; c < channel_count; ++c) {
+        dst[i*dst_stride + c] = sum[c] / sum_weight;
+      }
+    }
+  };
+
+  // horizontal pass
+  std::vector<double> src_row(src.width * kChannels);
+  std::vector<double> horizontal(width * src.height * kChannels);
+  for (int y = 0; y < src.height; ++y) {
+    for (int i = 0; i < src.width * kChannels; ++i) {
+      src_row[i] = src.data[y * src.width * kChannels + i];
+    }
+    resize_1d(src_row.data(), src.width, kChannels,
+              &horizontal[y * width * kChannels], width, kChannels, kChannels);
+  }
+
+  // vertical pass, one column (of all channels) at a time
+  std::vector<double> result(width * height * kChannels);
+  for (int x = 0; x < width; ++x) {
+    resize_1d(&horizontal[x * kChannels], src.height, width * kChannels,
+              &result[x * kChannels], height, width * kChannels, kChannels);
+  }
+
+  MipLevel<T> dst{width, height, std::vector<T>(result.size())};
+  for (size_t i = 0; i < result.size(); ++i) {
+    dst.data[i] = static_cast<T>(clamp(round(result[i]),
+                                       std::numeric_limits<T>::min(),
+                                       std::numeric_limits<T>::max()));
+  }
+
+  return dst;
+}
+
+// Generates the full mipmap chain (down to 1x1) of an image, the first element
+// of the return value being the image itself.
+template<typename T, int kChannels>
+std::vector<MipLevel<T>> GenerateMipmaps(const T* data, int width, int height) {
+  std::vector<MipLevel<T>> levels;
+  levels.push_back(MipLevel<T>{width, height,
+                               std::vector<T>(data, data + width*height*kChannels)});
+
+  while (levels.back().width > 1 || levels.back().height > 1) {
+    const MipLevel<T>& last = levels.back();
+    MipLevel<T> next = ResizeCatmullRom<T, kChannels>(
+        last, std::max(last.width/2, 1), std::max(last.height/2, 1));
+    levels.push_back(std::move(next));
+  }
+
+  return levels;
+}
@@ -0,0 +1,205 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include "./preproc_progress.h"
+#include "./preproc_metadata.h"
+#include "./preproc_encoder_pool.h"
+#include "./preproc_parallel_driver.h"
+#include "./preproc_tex_quad_tree_node.h"
+#include "./preproc_cdlod_quad_tree_node.h"
+
+namespace {
+
+// The subtrees below this level are processed as a single job, the tiles
+// above it are separate jobs.
+constexpr int kJobLevel = std::max(kMaxLevel - 3, kMinLevel);
+
+struct Job {
+  double x, z;
+  CubeFace face;
+  int level;
+  bool whole_subtree;
+};
+
+void CollectJobs(double x, double z, CubeFace face, int level,
+                 std::vector<Job>& jobs) {
+  if (level <= kJobLevel) {
+    jobs.push_back(Job{x, z, face, level, true});
+    return;
+  }
+
+  jobs.push_back(Job{x, z, face, level, false});
+  double s4 = kTexNodeDimension * double(1L << level) / 4;
+  CollectJobs(x-s4, z+s4, face, level-1, jobs);
+  CollectJobs(x+s4, z+s4, face, level-1, jobs);
+  CollectJobs(x-s4, z-s4, face, level-1, jobs);
+  CollectJobs(x+s4, z-s4, face, level-1, jobs);
+}
+
+int DatasetCount(const DriverOptions& options) {
+  return int(options.height) + int(options.diffuse);
+}
+
+long TileCount(const DriverOptions& options) {
+  long tiles_per_face = (options.height ? ImageCount<HeightDataset>() : 0) +
+                        (options.diffuse ? ImageCount<DiffuseDataset>() : 0);
+  return tiles_per_face * options.faces.size();
+}
+
+int WorkerCount(const DriverOptions& options, size_t job_count) {
+  int count = options.thread_count;
+  if (count <= 0) {
+    count = std::max(1u, std::thread::hardware_concurrency());
+    int budget_limit = options.memory_budget_mb /
+                       (kMinInputCacheMB * DatasetCount(options));
+    count = std::min(count, std::max(budget_limit, 1));
+  }
+  return std::min<int>(count, job_count);
+}
+
+int EncoderCount(const DriverOptions& options) {
+  if (options.encode_threads > 0) {
+    return options.encode_threads;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// The memory budget is split evenly between the input caches.
+size_t InputCacheBudget(const DriverOptions& options, int worker_count) {
+  return (options.memory_budget_mb << 20) /
+         (worker_count * DatasetCount(options));
+}
+
+template<typename Dataset>
+std::unique_ptr<TexQuadTreeNode<Dataset>> CreateInputRoot(size_t budget) {
+  int tw = Dataset::kInputWidth, th = Dataset::kInputHeight;
+  auto root = std::make_unique<TexQuadTreeNode<Dataset>>(
+      nullptr, tw/2, th/2, tw, th, Dataset::kInputMaxLevel, 0);
+  root->set_memory_budget(budget);
+  return root;
+}
+
+} // namespace
+
+void RunParallel(const DriverOptions& options) {
+  if (DatasetCount(options) == 0) {
+    throw std::invalid_argument("No dataset is selected");
+  }
+  if (options.png_compression_level < 0 || 9 < options.png_compression_level) {
+    throw std::invalid_argument("The PNG compression level must be 0-9");
+  }
+  synthetic_input = options.synthetic_input;
+
+  std::vector<Job> jobs;
+  for (CubeFace face : options.faces) {
+    // the tiles above the subtrees have to be done first, they are the
+    // least detailed ones, and the first ones the runtime needs
+    CollectJobs(kFaceSize/2, kFaceSize/2, face, kMaxLevel, jobs);
+  }
+  std::stable_partition(jobs.begin(), jobs.end(),
+                        [](const Job& job) { return !job.whole_subtree; });
+
+  Progress progress(TileCount(options));
+  // the metadata sidecars, they are written by the encoder threads, so they
+  // have to outlive the pool
+  std::vector<std::unique_ptr<MetadataFile>> metadata_files(6);
+  if (!synthetic_input) {
+    for (CubeFace face : options.faces) {
+      std::string path = MetadataPath(face);
+      CreateParentDirectories(path);
+      metadata_files[face] = std::make_unique<MetadataFile>(path, face);
+    }
+  }
+  // a few tiles per thread can wait for encoding, the workers block after that
+  int encoder_count = EncoderCount(options);
+  EncoderPool encoder(encoder_count, 2*encoder_count);
+  TileOutputs outputs{progress, encoder, options.png_compression_level, {}};
+  for (int face = 0; face < 6; ++face) {
+    outputs.metadata[face] = metadata_files[face].get();
+  }
+  std::atomic<size_t> next_job{0};
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  int worker_count = WorkerCount(options, jobs.size());
+  size_t cache_budget = InputCacheBudget(options, worker_count);
+  std::cout << "Generating " << TileCount(options)
+            << " tiles in " << jobs.size() << " jobs on " << worker_count
+            << " threads (encoding on " << encoder_count << " threads), with "
+            << (cache_budget >> 20) << " MB input cache per dataset and worker"
+            << std::endl;
+
+  auto worker = [&]() {
+    try {
+      std::unique_ptr<TexQuadTreeNode<HeightDataset>> height;
+      std::unique_ptr<TexQuadTreeNode<DiffuseDataset>> diffuse;
+      TileInputs inputs;
+      if (options.height) {
+        height = CreateInputRoot<HeightDataset>(cache_budget);
+        inputs.height = height.get();
+      }
+      if (options.diffuse) {
+        diffuse = CreateInputRoot<DiffuseDataset>(cache_budget);
+        inputs.diffuse = diffuse.get();
+      }
+
+      size_t job_index;
+      while (!failed && (job_index = next_job++) < jobs.size()) {
+        const Job& job = jobs[job_index];
+        CdlodQuadTreeNode node (job.x, job.z, job.face, job.level);
+        if (job.whole_subtree) {
+          node.GenerateImage(inputs, outputs);
+        } else {
+          node.GenerateTile(inputs, outputs);
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      failed = true;
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < worker_count; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  // report the progress while the workers and the encoders run
+  std::atomic<bool> finished{false};
+  std::thread reporter([&]() {
+    while (!finished) {
+      for (int i = 0; i < 50 && !finished; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      progress.Report();
+    }
+  });
+
+  for (std::thread& thread : workers) {
+    thread.join();
+  }
+  try {
+    encoder.Finish();
+  } catch (...) {
+    if (!error) {
+      error = std::current_exception();
+    }
+  }
+  finished = true;
+  reporter.join();
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
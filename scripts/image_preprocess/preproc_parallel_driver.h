@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+#include "./preproc_cube2sphere.h"
+
+struct DriverOptions {
+  std::vector<CubeFace> faces;
+  int thread_count = 0;         // 0: as many as the memory budget allows
+  int encode_threads = 0;       // 0: as many as the cores
+  int png_compression_level = 6;  // 0-9, like zlib's
+  size_t memory_budget_mb = 4096;  // of the input caches of the workers
+  bool height = true, diffuse = true;  // the datasets to generate
+  bool synthetic_input = false;  // see ::synthetic_input
+};
+
+// Generates the tiles of the given faces on multiple threads. Every face is
+// split into subtrees, that are processed depth-first by the worker threads
+// (for the locality of the input tiles). Every worker has its own input
+// quadtree for each dataset, that gets an even share of the memory budget.
+// The sampled tiles are encoded and written by a separate pool of threads.
+// Tiles, whose outputs exist already are skipped, so an interrupted run can
+// be continued by starting it again with the same parameters.
+void RunParallel(const DriverOptions& options);
@@ -0,0 +1,114 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <fstream>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <lodepng.h>
+#include "./preproc_png.h"
+
+namespace {
+
+void SetColorMode(LodePNGColorMode& mode, PngFormat format) {
+  switch (format) {
+    case PngFormat::kGrey16:
+      mode.colortype = LCT_GREY;
+      mode.bitdepth = 16;
+      break;
+    case PngFormat::kGreyAlpha8:
+      mode.colortype = LCT_GREY_ALPHA;
+      mode.bitdepth = 8;
+      break;
+    case PngFormat::kRgb8:
+      mode.colortype = LCT_RGB;
+      mode.bitdepth = 8;
+      break;
+  }
+}
+
+// PNG stores 16 bit samples in big endian order.
+void SwapBytes16(std::vector<unsigned char>& bytes) {
+  for (size_t i = 0; i + 1 < bytes.size(); i += 2) {
+    std::swap(bytes[i], bytes[i+1]);
+  }
+}
+
+bool IsLittleEndian() {
+  const unsigned short one = 1;
+  return *reinterpret_cast<const unsigned char*>(&one) == 1;
+}
+
+// Maps the zlib-like compression level onto lodepng's deflate settings.
+void SetCompressionLevel(lodepng::State& state, int level) {
+  LodePNGCompressSettings& zlib = state.encoder.zlibsettings;
+  if (level <= 0) {
+    zlib.btype = 0;  // stored, without compression
+    zlib.use_lz77 = 0;
+    state.encoder.filter_strategy = LFS_ZERO;
+    return;
+  }
+
+  level = std::min(level, 9);
+  zlib.btype = 2;  // dynamic huffman codes
+  zlib.use_lz77 = 1;
+  zlib.windowsize = std::min(256u << level, 32768u);
+  zlib.minmatch = 3;
+  zlib.nicematch = level < 4 ? 32 : (level < 7 ? 128 : 258);
+  zlib.lazymatching = level >= 4;
+  state.encoder.filter_strategy = level < 3 ? LFS_ZERO : LFS_MINSUM;
+}
+
+} // namespace
+
+std::vector<unsigned char> ReadPng(const std::string& path, PngFormat format,
+                                   unsigned& width, unsigned& height) {
+  std::vector<unsigned char> file;
+  unsigned error = lodepng::load_file(file, path);
+  if (error) {
+    throw std::runtime_error("Couldn't read " + path + ": " +
+                             lodepng_error_text(error));
+  }
+
+  lodepng::State state;
+  SetColorMode(state.info_raw, format);
+  std::vector<unsigned char> texels;
+  error = lodepng::decode(texels, width, height, state, file);
+  if (error) {
+    throw std::runtime_error("Couldn't decode " + path + ": " +
+                             lodepng_error_text(error));
+  }
+
+  if (format == PngFormat::kGrey16 && IsLittleEndian()) {
+    SwapBytes16(texels);
+  }
+  return texels;
+}
+
+void WritePng(const std::string& path, const void* texels, int width,
+              int height, PngFormat format, int compression_level) {
+  lodepng::State state;
+  SetColorMode(state.info_raw, format);
+  SetColorMode(state.info_png.color, format);
+  state.encoder.auto_convert = 0;
+  SetCompressionLevel(state, compression_level);
+
+  size_t size = size_t(width) * height * lodepng_get_bpp(&state.info_raw) / 8;
+  auto bytes = static_cast<const unsigned char*>(texels);
+  std::vector<unsigned char> raw(bytes, bytes + size);
+  if (format == PngFormat::kGrey16 && IsLittleEndian()) {
+    SwapBytes16(raw);
+  }
+
+  std::vector<unsigned char> png;
+  unsigned error = lodepng::encode(png, raw, width, height, state);
+  if (error) {
+    throw std::runtime_error("Couldn't encode " + path + ": " +
+                             lodepng_error_text(error));
+  }
+
+  std::ofstream out(path, std::ios::binary);
+  out.write(reinterpret_cast<const char*>(png.data()), png.size());
+  if (!out) {
+    throw std::runtime_error("Couldn't write " + path);
+  }
+}
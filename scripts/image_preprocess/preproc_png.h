@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// PNG decoding and encoding with lodepng.
+enum class PngFormat {
+  kGrey16,      // unsigned shorts (in native byte order in memory)
+  kGreyAlpha8,  // 2 unsigned chars per texel
+  kRgb8         // 3 unsigned chars per texel
+};
+
+// Reads a PNG (of any format), converting it to the given one. The returned
+// bytes are the texels in that format. Throws std::runtime_error on failure.
+std::vector<unsigned char> ReadPng(const std::string& path, PngFormat format,
+                                   unsigned& width, unsigned& height);
+
+// Writes the texels into a PNG file. The compression level is 0-9 like
+// zlib's (0: stored, 9: the slowest, the smallest output).
+// Throws std::runtime_error on failure.
+void WritePng(const std::string& path, const void* texels, int width,
+              int height, PngFormat format, int compression_level);
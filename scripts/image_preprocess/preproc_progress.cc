@@ -0,0 +1,101 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <cerrno>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "./preproc_progress.h"
+
+Progress::Progress(long total_tiles)
+    : total_tiles_(total_tiles)
+    , start_time_(Clock::now())
+    , last_report_time_(start_time_)
+{ }
+
+void Progress::TileSkipped() {
+  tiles_skipped_++;
+}
+
+void Progress::TileWritten(size_t bytes) {
+  bytes_written_ += bytes;
+  tiles_written_++;
+}
+
+void Progress::Report() {
+  Clock::time_point now = Clock::now();
+  double interval = std::chrono::duration<double>(now - last_report_time_).count();
+  double elapsed = std::chrono::duration<double>(now - start_time_).count();
+  if (interval <= 0 || elapsed <= 0) {
+    return;
+  }
+
+  long tiles = tiles_written_;
+  size_t bytes = bytes_written_;
+  double tiles_per_sec = (tiles - last_report_tiles_) / interval;
+  double mb_per_sec = (bytes - last_report_bytes_) / interval / (1 << 20);
+
+  long remaining_tiles = total_tiles_ - tiles_done();
+  double avg_tiles_per_sec = tiles / elapsed;
+  double remaining = avg_tiles_per_sec > 0
+      ? remaining_tiles / avg_tiles_per_sec / 60 : 0;
+
+  std::cout << std::fixed << std::setprecision(2)
+    << '[' << std::setw(6) << tiles_done() * 100.0 / total_tiles_ << " %] "
+    << tiles_done() << '/' << total_tiles_ << " tiles ("
+    << tiles_skipped_ << " skipped), "
+    << tiles_per_sec << " tiles/s, " << mb_per_sec << " MB/s, "
+    << "elapsed: " << elapsed / 60 << "m, remaining: " << remaining << "m"
+    << std::endl;
+
+  last_report_time_ = now;
+  last_report_tiles_ = tiles;
+  last_report_bytes_ = bytes;
+}
+
+std::string TemporaryPath(const std::string& path) {
+  size_t slash = path.find_last_of('/');
+  return path.substr(0, slash + 1) + ".tmp_" + path.substr(slash + 1);
+}
+
+size_t CommitOutput(const std::string& path) {
+  if (std::rename(TemporaryPath(path).c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Couldn't rename the output to " + path);
+  }
+
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    throw std::runtime_error("Couldn't stat " + path);
+  }
+  return info.st_size;
+}
+
+bool OutputsExist(const std::vector<std::string>& paths) {
+  struct stat info;
+  for (const std::string& path : paths) {
+    if (stat(path.c_str(), &info) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CreateParentDirectories(const std::string& path) {
+  size_t slash = path.find_last_of('/');
+  if (slash == std::string::npos || slash == 0) {
+    return;
+  }
+
+  std::string dir = path.substr(0, slash);
+  struct stat info;
+  if (stat(dir.c_str(), &info) == 0) {
+    return;
+  }
+
+  CreateParentDirectories(dir);
+  // another worker might have created it meanwhile
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Couldn't create the directory " + dir);
+  }
+}
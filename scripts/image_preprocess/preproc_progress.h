@@ -0,0 +1,47 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Thread-safe counters of the generated tiles, and a report of the real
+// throughput. The tiles skipped because they were already generated by a
+// previous run count towards the progress, but not towards the throughput.
+class Progress {
+ public:
+  explicit Progress(long total_tiles);
+
+  void TileSkipped();
+  void TileWritten(size_t bytes);
+
+  bool done() const { return tiles_done() == total_tiles_; }
+  long tiles_done() const { return tiles_written_ + tiles_skipped_; }
+
+  // Prints the tiles/s and MB/s since the last report, and the estimated
+  // remaining time, based on the average throughput of this run.
+  void Report();
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  const long total_tiles_;
+  std::atomic<long> tiles_written_{0}, tiles_skipped_{0};
+  std::atomic<size_t> bytes_written_{0};
+
+  Clock::time_point start_time_, last_report_time_;
+  long last_report_tiles_ = 0;
+  size_t last_report_bytes_ = 0;
+};
+
+// The outputs are written into temporary files first, that are renamed when
+// they are complete, so a tile is generated if all of its outputs exist, even
+// if the previous run was killed in the middle of writing.
+std::string TemporaryPath(const std::string& path);
+// Renames the temporary file to its final name, and returns its size.
+size_t CommitOutput(const std::string& path);
+bool OutputsExist(const std::vector<std::string>& paths);
+
+// Creates the directory of the file (and its parents) if they don't exist.
+void CreateParentDirectories(const std::string& path);
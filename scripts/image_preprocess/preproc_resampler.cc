@@ -0,0 +1,172 @@
+// Copyright (c) 2015, Tamas Csala
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "./preproc_resampler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define RESAMPLER_X86 1
+  #include <immintrin.h>
+#endif
+
+namespace {
+
+// The two pieces of the Catmull-Rom spline (B = 0, C = 0.5), for |x| < 1
+// and for 1 <= |x| < 2.
+inline float CatMullRomInner(float f) {
+  return (9 * (f*f*f) - 15 * (f*f) + 6) / 6.0;
+}
+
+inline float CatMullRomOuter(float f) {
+  return (-3 * (f*f*f) + 15 * (f*f) - 24 * f + 12) / 6.0;
+}
+
+template<typename T>
+inline T ToTexel(double value) {
+  double rounded = std::round(value);
+  rounded = std::max<double>(rounded, std::numeric_limits<T>::min());
+  rounded = std::min<double>(rounded, std::numeric_limits<T>::max());
+  return static_cast<T>(rounded);
+}
+
+// The weights are normalized, like in the 16 tap filter, because the sum of
+// the float weights isn't exactly one.
+inline double WeightSum(const ResampleTaps& t) {
+  return (double(t.wx[0]) + t.wx[1] + t.wx[2] + t.wx[3]) *
+         (double(t.wy[0]) + t.wy[1] + t.wy[2] + t.wy[3]);
+}
+
+template<int kChannels, typename T>
+void ResampleScalar(const T* data, int stride,
+                    const ResampleTaps* taps, int count, T* out) {
+  for (int i = 0; i < count; ++i) {
+    const ResampleTaps& t = taps[i];
+    double sum[kChannels] = {};
+    for (int r = 0; r < 4; ++r) {
+      const T* line = data + t.row[r]*stride*kChannels;
+      double row_sum[kChannels] = {};
+      for (int k = 0; k < 4; ++k) {
+        for (int c = 0; c < kChannels; ++c) {
+          row_sum[c] += t.wx[k] * line[t.col[k]*kChannels + c];
+        }
+      }
+      for (int c = 0; c < kChannels; ++c) {
+        sum[c] += t.wy[r] * row_sum[c];
+      }
+    }
+
+    double weight_sum = WeightSum(t);
+    for (int c = 0; c < kChannels; ++c) {
+      out[i*kChannels + c] = ToTexel<T>(sum[c] / weight_sum);
+    }
+  }
+}
+
+#if RESAMPLER_X86
+
+// One texel per iteration, the 4 lanes are the 4 horizontal taps. At the most
+// detailed input level (which is the most used one) the taps are adjacent
+// texels, and they are loaded together.
+__attribute__((target("avx2,fma")))
+void ResampleAvx2(const unsigned short* data, int stride,
+                  const ResampleTaps* taps, int count, unsigned short* out) {
+  for (int i = 0; i < count; ++i) {
+    const ResampleTaps& t = taps[i];
+    __m256d wx = _mm256_cvtps_pd(_mm_loadu_ps(t.wx));
+    bool adjacent = t.col[1] == t.col[0]+1 && t.col[2] == t.col[0]+2 &&
+                    t.col[3] == t.col[0]+3;
+
+    __m256d sum = _mm256_setzero_pd();
+    for (int r = 0; r < 4; ++r) {
+      const unsigned short* line = data + t.row[r]*stride;
+      __m128i texels;
+      if (adjacent) {
+        texels = _mm_cvtepu16_epi32(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(line + t.col[0])));
+      } else {
+        texels = _mm_setr_epi32(line[t.col[0]], line[t.col[1]],
+                                line[t.col[2]], line[t.col[3]]);
+      }
+      __m256d row = _mm256_mul_pd(_mm256_cvtepi32_pd(texels), wx);
+      sum = _mm256_fmadd_pd(_mm256_set1_pd(t.wy[r]), row, sum);
+    }
+
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum),
+                              _mm256_extractf128_pd(sum, 1));
+    half = _mm_add_sd(half, _mm_unpackhi_pd(half, half));
+    out[i] = ToTexel<unsigned short>(_mm_cvtsd_f64(half) / WeightSum(t));
+  }
+}
+
+// One texel per iteration, the lanes are the channels (the fourth is unused).
+__attribute__((target("avx2,fma")))
+void ResampleAvx2(const unsigned char* rgb_data, int stride,
+                  const ResampleTaps* taps, int count, unsigned char* rgb_out) {
+  for (int i = 0; i < count; ++i) {
+    const ResampleTaps& t = taps[i];
+    __m256d sum = _mm256_setzero_pd();
+    for (int r = 0; r < 4; ++r) {
+      const unsigned char* line = rgb_data + t.row[r]*stride*3;
+      __m256d row_sum = _mm256_setzero_pd();
+      for (int k = 0; k < 4; ++k) {
+        const unsigned char* texel = line + t.col[k]*3;
+        __m256d value = _mm256_cvtepi32_pd(
+            _mm_setr_epi32(texel[0], texel[1], texel[2], 0));
+        row_sum = _mm256_fmadd_pd(_mm256_set1_pd(t.wx[k]), value, row_sum);
+      }
+      sum = _mm256_fmadd_pd(_mm256_set1_pd(t.wy[r]), row_sum, sum);
+    }
+
+    alignas(32) double result[4];
+    _mm256_store_pd(result, sum);
+    double weight_sum = WeightSum(t);
+    for (int c = 0; c < 3; ++c) {
+      rgb_out[i*3 + c] = ToTexel<unsigned char>(result[c] / weight_sum);
+    }
+  }
+}
+
+#endif  // RESAMPLER_X86
+
+} // namespace
+
+void CatMullRomWeights(double fraction, float weights[4]) {
+  // the distances of the taps from the sample are 1+t, t, 1-t and 2-t
+  weights[0] = CatMullRomOuter(float(1 + fraction));
+  weights[1] = CatMullRomInner(float(fraction));
+  weights[2] = CatMullRomInner(float(1 - fraction));
+  weights[3] = CatMullRomOuter(float(2 - fraction));
+}
+
+bool ResamplerUsesAvx2() {
+#if RESAMPLER_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2") &&
+                           __builtin_cpu_supports("fma");
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+void ResampleSpan(const unsigned short* data, int stride,
+                  const ResampleTaps* taps, int count, unsigned short* out) {
+#if RESAMPLER_X86
+  if (ResamplerUsesAvx2()) {
+    ResampleAvx2(data, stride, taps, count, out);
+    return;
+  }
+#endif
+  ResampleScalar<1>(data, stride, taps, count, out);
+}
+
+void ResampleSpan(const unsigned char* rgb_data, int stride,
+                  const ResampleTaps* taps, int count, unsigned char* rgb_out) {
+#if RESAMPLER_X86
+  if (ResamplerUsesAvx2()) {
+    ResampleAvx2(rgb_data, stride, taps, count, rgb_out);
+    return;
+  }
+#endif
+  ResampleScalar<3>(rgb_data, stride, taps, count, rgb_out);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+// Separable Catmull-Rom resampling of the input tiles.
+//
+// Every output texel is a 4x4 tap filter, but the weights are the product of
+// 4 horizontal and 4 vertical weights, so they are computed once per axis,
+// for a whole span of texels, before filtering them. The filtering has an
+// AVX2 kernel, that is used if the CPU supports it (and a scalar fallback),
+// that give the same result as the 16 weight per texel filter, within one LSB.
+
+// The source texels and the weights of one output texel. The taps are at the
+// offsets -1, 0, 1, 2 from the texel the sample is in, along both axes.
+struct ResampleTaps {
+  int col[4], row[4];
+  float wx[4], wy[4];
+};
+
+// The Catmull-Rom weights of the 4 taps, for a sample at 'fraction' (0 <= x < 1)
+// after the second one.
+void CatMullRomWeights(double fraction, float weights[4]);
+
+// Filters 'count' texels. 'stride' is the width of the source in texels.
+void ResampleSpan(const unsigned short* data, int stride,
+                  const ResampleTaps* taps, int count, unsigned short* out);
+
+// The same for RGB8 texels (3 bytes each).
+void ResampleSpan(const unsigned char* rgb_data, int stride,
+                  const ResampleTaps* taps, int count, unsigned char* rgb_out);
+
+// If the AVX2 kernels are used on this machine.
+bool ResamplerUsesAvx2();
@@ -8,36 +8,90 @@ inline constexpr T pow(T const& x, std::size_t n){
     return n>0 ? x * pow(x, n-1) : 1;
 }
 
-#define HEIGHTMAP
+// The datasets, whose tiles are generated. Both of them are generated in the
+// same pass over the tiles (see CdlodQuadTreeNode::GenerateTile), so the
+// pipeline is templated on these, instead of the dataset being selected at
+// compile time.
+struct HeightDataset {
+  using Texel = unsigned short;
 
-#ifdef HEIGHTMAP
-  static const std::string kInputDir = "/media/icecool/Data/LoE_datasets/height/gmted2010_75/uv";
-  static const std::string kOutputDir = "/media/icecool/SSData/gmted2010_75_cube";
-  // static const std::string kOutputDir = "output";
+  static constexpr const char* kInputDir = "/media/icecool/Data/LoE_datasets/height/gmted2010_75/uv";
+  static constexpr const char* kOutputDir = "/media/icecool/SSData/gmted2010_75_cube";
+  static constexpr const char* kNormalOutputDir = "/media/icecool/SSData/gmted2010_75_normal_cube";
+  // static constexpr const char* kOutputDir = "output";
 
-  constexpr int kInputWidth = 172800, kInputHeight = 86400;
-  constexpr int kInputMaxLevel = 9;
-  constexpr int kBorderSize = 3;
+  static constexpr int kInputWidth = 172800, kInputHeight = 86400;
+  static constexpr int kInputMaxLevel = 9;
+  static constexpr int kBorderSize = 3;
 
-  constexpr long kFaceSize = 65536;
-  constexpr int kMaxLevel = 8;
-#else
-  static const std::string kInputDir = "/media/icecool/Data/LoE_datasets/diffuse/blue_marble_next_gen/uv";
-  static const std::string kOutputDir = "/home/icecool/projects/C++/OpenGL/ReLoEd/src/resources/textures/diffuse";
-  // static const std::string kOutputDir = "output";
+  static constexpr long kFaceSize = 65536;
+  static constexpr int kMaxLevel = 8;
+};
 
-  constexpr int kInputWidth = 86400, kInputHeight = 43200;
-  constexpr int kInputMaxLevel = 8;
-  constexpr int kBorderSize = 2;
+struct DiffuseTexel {
+  unsigned char r, g, b;
+};
 
-  constexpr long kFaceSize = 32768;
-  constexpr int kMaxLevel = 7;
-#endif
+struct DiffuseDataset {
+  using Texel = DiffuseTexel;
+
+  static constexpr const char* kInputDir = "/media/icecool/Data/LoE_datasets/diffuse/blue_marble_next_gen/uv";
+  static constexpr const char* kOutputDir = "/home/icecool/projects/C++/OpenGL/ReLoEd/src/resources/textures/diffuse";
+  // BC1 compressed tiles with a precomputed mipmap chain
+  static constexpr const char* kCompressedOutputDir = "/home/icecool/projects/C++/OpenGL/ReLoEd/src/resources/textures/diffuse_bc1";
+  // static constexpr const char* kOutputDir = "output";
+
+  static constexpr int kInputWidth = 86400, kInputHeight = 43200;
+  static constexpr int kInputMaxLevel = 8;
+  static constexpr int kBorderSize = 2;
+
+  static constexpr long kFaceSize = 32768;
+  static constexpr int kMaxLevel = 7;
+};
+
+// The tiles are traversed on the grid of the height dataset. The other
+// datasets have the same tile grid with fewer levels: a diffuse tile covers
+// the same area as the height tile one level above it.
+constexpr long kFaceSize = HeightDataset::kFaceSize;
+constexpr int kMaxLevel = HeightDataset::kMaxLevel;
+// The border of the shared sample grid, that has to be at least as wide as
+// the border of any of the datasets.
+constexpr int kBorderSize = HeightDataset::kBorderSize;
+
+template<typename Dataset>
+constexpr int LevelOffset() {
+  return kMaxLevel - Dataset::kMaxLevel;
+}
+
+static_assert(DiffuseDataset::kFaceSize << LevelOffset<DiffuseDataset>() == kFaceSize,
+              "The tile grids of the datasets have to match");
+static_assert(DiffuseDataset::kBorderSize <= kBorderSize,
+              "The sample grid doesn't cover the border of the diffuse tiles");
 
 constexpr long kRadius = kFaceSize / 2;
+// Has to match the runtime's CdlodTerrainSettings::kMaxHeight, as the normals
+// are baked with this height scale.
+constexpr double kHeightScale = 8;
+constexpr double kMaxHeight = kHeightScale * 8848 * (double(kRadius) / 6371000);
 constexpr int kTexNodeDimension = 256;
+// Has to match the runtime's CdlodTerrainSettings::kElevationTexSizeWithBorders,
+// the shader used it for the texel spacing of the normals, so they are baked
+// with the same slopes.
+constexpr int kElevationTexSizeWithBorders =
+    kTexNodeDimension + 2*HeightDataset::kBorderSize;
 constexpr int kMinLevel = 0;
-constexpr int kImageCount = pow(4, kMaxLevel-kMinLevel+1) / (4-1);
+
+// The number of tiles of a face of the dataset.
+template<typename Dataset>
+constexpr long ImageCount() {
+  return pow(4, Dataset::kMaxLevel-kMinLevel+1) / (4-1);
+}
+
+// The smallest input cache a worker gets per dataset, when the number of
+// workers is derived from the memory budget. The cache should hold the
+// working set of a few output tiles, otherwise the input tiles are decoded
+// again and again.
+constexpr int kMinInputCacheMB = 512;
 
 template <typename T, glm::precision P>
 static inline std::ostream& operator<<(std::ostream& os, const glm::detail::tvec2<T, P>& v) {
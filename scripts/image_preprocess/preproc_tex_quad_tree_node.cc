@@ -2,62 +2,185 @@
 
 #include <limits>
 #include <memory>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
-#include <Magick++.h>
+#include "./preproc_png.h"
+#include "./preproc_resampler.h"
 #include "./preproc_tex_quad_tree_node.h"
 
-TexQuadTreeNode::TexQuadTreeNode(TexQuadTreeNode* parent,
-                                 double x, double y, double sx, double sy,
-                                 int level, unsigned index)
+bool synthetic_input = false;
+
+namespace {
+
+constexpr PngFormat InputFormat(const unsigned short*) {
+  return PngFormat::kGrey16;
+}
+
+constexpr PngFormat InputFormat(const DiffuseTexel*) {
+  return PngFormat::kRgb8;
+}
+
+template<typename TexelData>
+TexelData SyntheticTexel(double value);
+
+template<>
+unsigned short SyntheticTexel<unsigned short>(double value) {
+  return static_cast<unsigned short>(value * 65535);
+}
+
+template<>
+DiffuseTexel SyntheticTexel<DiffuseTexel>(double value) {
+  auto c = static_cast<unsigned char>(value * 255);
+  return DiffuseTexel{c, c, static_cast<unsigned char>(255 - c)};
+}
+
+void ResampleTexels(const unsigned short* data, int stride,
+                    const ResampleTaps* taps, int count, unsigned short* out) {
+  ResampleSpan(data, stride, taps, count, out);
+}
+
+void ResampleTexels(const DiffuseTexel* data, int stride,
+                    const ResampleTaps* taps, int count, DiffuseTexel* out) {
+  static_assert(sizeof(DiffuseTexel) == 3, "DiffuseTexel must be packed RGB8");
+  ResampleSpan(reinterpret_cast<const unsigned char*>(data), stride,
+               taps, count, reinterpret_cast<unsigned char*>(out));
+}
+
+} // namespace
+
+template<typename Dataset>
+TexQuadTreeNode<Dataset>::TexQuadTreeNode(TexQuadTreeNode* parent,
+                                          double x, double y,
+                                          double sx, double sy,
+                                          int level, unsigned index)
     : parent_(parent)
     , x_(x), y_(y)
     , sx_(sx), sy_(sy)
     , index_(index), level_(level)
+    , cache_(parent ? parent->cache_ : std::make_shared<Cache>(
+          InputFormat(static_cast<const TexelData*>(nullptr))))
 { }
 
-std::string TexQuadTreeNode::texture_path() const {
+template<typename Dataset>
+TexQuadTreeNode<Dataset>::~TexQuadTreeNode() {
+  if (is_image_loaded()) {
+    unload();
+  }
+}
+
+template<typename Dataset>
+std::string TexQuadTreeNode<Dataset>::texture_path() const {
   char file_path[200];
   int tx = int_left_x(), ty = int_top_y();
-  sprintf(file_path, "%s/%d/%d/%d.png", kInputDir.c_str(), level_, tx, ty);
+  sprintf(file_path, "%s/%d/%d/%d.png", Dataset::kInputDir, level_, tx, ty);
 
   return file_path;
 }
 
-void TexQuadTreeNode::load() {
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::load() {
   if (is_image_loaded()) {
     return;
   }
 
-  Magick::Image image{texture_path()};
-  tex_w_ = image.columns();
-  tex_h_ = image.rows();
+  if (synthetic_input) {
+    generateSyntheticData();
+  } else {
+    std::vector<unsigned char> texels;
+    if (!cache_->prefetcher.Take(texture_path(), texels, tex_w_, tex_h_)) {
+      texels = ReadPng(texture_path(), InputFormat(data_.data()),
+                       tex_w_, tex_h_);
+    }
+    data_.resize(tex_w_*tex_h_);
+    std::memcpy(data_.data(), texels.data(), texels.size());
+  }
+
+  cache_->memory_used += data_.size() * sizeof(TexelData);
+  cache_->loaded_nodes.push_front(this);
+  cache_position_ = cache_->loaded_nodes.begin();
+  last_used_ = cache_->tile;
+  evict(*cache_);
+}
+
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::unload() {
+  cache_->memory_used -= data_.size() * sizeof(TexelData);
+  cache_->loaded_nodes.erase(cache_position_);
+  std::vector<TexelData>().swap(data_);
+}
+
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::touch() {
+  last_used_ = cache_->tile;
+  if (is_image_loaded()) {
+    auto& loaded_nodes = cache_->loaded_nodes;
+    loaded_nodes.splice(loaded_nodes.begin(), loaded_nodes, cache_position_);
+  }
+}
+
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::evict(Cache& cache) {
+  while (!cache.loaded_nodes.empty() &&
+         cache.memory_budget < cache.memory_used +
+                               cache.prefetcher.memory_used()) {
+    TexQuadTreeNode* node = cache.loaded_nodes.back();
+    if (node->last_used_ == cache.tile) {
+      break;  // everything is used by the current output tile
+    }
+    node->unload();
+  }
+}
+
+// A smooth function of the position in the input image, so that every level
+// of the input pyramid is (roughly) a downsampled version of the level below.
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::generateSyntheticData() {
+  constexpr int kBorderSize = Dataset::kBorderSize;
+  int borderless_width = std::max(int(sx_) >> std::max(level_, 0), 1);
+  int borderless_height = std::max(int(sy_) >> std::max(level_, 0), 1);
+  tex_w_ = borderless_width + 2*kBorderSize;
+  tex_h_ = borderless_height + 2*kBorderSize;
   data_.resize(tex_w_*tex_h_);
 
-#ifdef HEIGHTMAP
-  image.write(0, 0, tex_w_, tex_h_, "R", MagickCore::ShortPixel, data_.data());
-#else
-  image.write(0, 0, tex_w_, tex_h_, "RGB", MagickCore::CharPixel, data_.data());
-#endif
+  double texel_x = sx_ / borderless_width, texel_y = sy_ / borderless_height;
+  for (unsigned row = 0; row < tex_h_; ++row) {
+    for (unsigned col = 0; col < tex_w_; ++col) {
+      double x = left_x() + (int(col) - kBorderSize + 0.5) * texel_x;
+      double y = top_y() + (int(row) - kBorderSize + 0.5) * texel_y;
+      double v = 0.5 + 0.25*sin(x * 0.002) * cos(y * 0.003)
+                     + 0.25*sin(x * 0.05 + y * 0.07);
+      data_[row*tex_w_ + col] = SyntheticTexel<TexelData>(v);
+    }
+  }
 }
 
-void TexQuadTreeNode::age() {
-  last_used_++;
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::age() {
+  assert(!parent_);
+  cache_->tile++;
+  evict(*cache_);
+  prune();
+}
 
+template<typename Dataset>
+bool TexQuadTreeNode<Dataset>::prune() {
+  bool has_loaded_nodes = is_image_loaded();
   for (auto& child : children_) {
     if (child) {
-      // unload child if its age would exceed the ttl
-      if (kTimeToLiveInMemory <= child->last_used_) {
-        child.reset();
+      if (child->prune()) {
+        has_loaded_nodes = true;
       } else {
-        child->age();
+        child.reset();
       }
     }
   }
+  return has_loaded_nodes;
 }
 
+template<typename Dataset>
 template<typename T>
-void TexQuadTreeNode::initChildInternal(int i) {
+void TexQuadTreeNode<Dataset>::initChildInternal(int i) {
   T left_sx = T(sx_)/2;
   T right_sx = T(sx_) - T(sx_)/2;
   T top_sy = T(sy_)/2;
@@ -92,48 +215,52 @@ void TexQuadTreeNode::initChildInternal(int i) {
   }
 }
 
-void TexQuadTreeNode::initChild(int i) {
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::initChild(int i) {
   initChildInternal<int>(i);
 }
 
-static float BellFunc(float x) {
-  float f = x * 0.75; // Converting -2 to +2 to -1.5 to +1.5
-  if (f > -1.5 && f < -0.5) {
-    return 0.5 * pow(f + 1.5, 2.0);
-  } else if (f > -0.5 && f < 0.5) {
-    return 3.0 / 4.0 - (f*f);
-  } else if (f > 0.5 && f < 1.5) {
-    return 0.5 * pow(f - 1.5, 2.0);
-  } else {
-    return 0.0;
-  }
+template<typename Dataset>
+typename TexQuadTreeNode<Dataset>::TexelData
+TexQuadTreeNode<Dataset>::FetchPixel(glm::dvec2 sample, glm::dvec2 diff) {
+  TexelData ret;
+  FetchRow(&sample, &diff, 1, &ret);
+  return ret;
 }
 
-static float CatMullRom(float x) {
-  const float B = 0.0;
-  const float C = 0.5;
-  float f = std::abs(x);
-
-  if (f < 1.0) {
-    return ((12 - 9*B - 6*C) * (f*f*f) +
-            (-18 + 12*B + 6*C) * (f*f) +
-            (6 - 2*B)) / 6.0;
-  } else if (1.0 <= f && f < 2.0) {
-    return ((-B - 6*C) * (f*f*f) +
-            (6*B + 30*C) * (f*f) +
-            (-12*B - 48*C) * f +
-             8*B + 24*C) / 6.0;
-  } else {
-    return 0.0;
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::FetchRow(const glm::dvec2* samples,
+                                        const glm::dvec2* diffs,
+                                        int count, TexelData* out) {
+  positions_.resize(count);
+  taps_.resize(count);
+
+  // the texels are filtered in spans, that have the same source node
+  TexQuadTreeNode* source = nullptr;
+  int span_start = 0;
+  for (int i = 0; i < count; ++i) {
+    double x = samples[i].x, y = samples[i].y;
+    double dx = std::abs(diffs[i].x), dy = std::abs(diffs[i].y);
+    WrapCoordinates(x, y);
+    positions_[i] = glm::dvec2{x, y};
+
+    if (!source || !source->IsSourceFor(x, y, dx, dy)) {
+      if (source) {
+        source->Filter(&positions_[span_start], i - span_start,
+                       &taps_[span_start], &out[span_start]);
+      }
+      source = FindSource(x, y, dx, dy);
+      span_start = i;
+    }
+  }
+  if (source) {
+    source->Filter(&positions_[span_start], count - span_start,
+                   &taps_[span_start], &out[span_start]);
   }
 }
 
-TexelData TexQuadTreeNode::FetchPixel(glm::dvec2 sample, glm::dvec2 diff) {
-  return FetchPixel(sample.x, sample.y, std::abs(diff.x), std::abs(diff.y));
-}
-
-TexelData TexQuadTreeNode::FetchPixel(double x, double y,
-                                           double dx, double dy) {
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::WrapCoordinates(double& x, double& y) const {
   if (x < 0) {
     x += sx_;
   } else if (sx_ <= x) {
@@ -145,89 +272,145 @@ TexelData TexQuadTreeNode::FetchPixel(double x, double y,
   } else if (sy_ <= y) {
     y = sy_ - (y - sy_ + 1);
   }
+}
 
-  TexelData ret = FetchPixelInternal(x, y, dx, dy);
-  age();
-  return ret;
+template<typename Dataset>
+glm::dvec2 TexQuadTreeNode<Dataset>::pixelCoverage() const {
+  int borderless_width, borderless_height;
+  if (is_image_loaded()) {
+    borderless_width = tex_w_ - 2*Dataset::kBorderSize;
+    borderless_height = tex_h_ - 2*Dataset::kBorderSize;
+  } else {
+    // every level of the input pyramid has half the resolution of the one
+    // below it
+    borderless_width = std::max(int(sx_) >> std::max(level_, 0), 1);
+    borderless_height = std::max(int(sy_) >> std::max(level_, 0), 1);
+  }
+  return glm::dvec2{sx_ / borderless_width, sy_ / borderless_height};
+}
+
+template<typename Dataset>
+bool TexQuadTreeNode<Dataset>::IsDetailedEnough(double dx, double dy) const {
+  glm::dvec2 pixel_coverage = pixelCoverage();
+  return level_ == 0 || (pixel_coverage.x < dx && pixel_coverage.y < dy);
+}
+
+// FindSource would return this node for the sample, if the sample is inside
+// it, it is detailed enough, and none of its ancestors are.
+template<typename Dataset>
+bool TexQuadTreeNode<Dataset>::IsSourceFor(double x, double y,
+                                           double dx, double dy) const {
+  if (x < int_left_x() || int_right_x() <= x ||
+      y < int_top_y() || int_bottom_y() <= y) {
+    return false;
+  }
+  if (!IsDetailedEnough(dx, dy)) {
+    return false;
+  }
+  for (const TexQuadTreeNode* node = parent_; node; node = node->parent_) {
+    if (node->IsDetailedEnough(dx, dy)) {
+      return false;
+    }
+  }
+  return true;
 }
 
-TexelData TexQuadTreeNode::FetchPixelInternal(double x, double y,
-                                              double dx, double dy) {
+template<typename Dataset>
+TexQuadTreeNode<Dataset>* TexQuadTreeNode<Dataset>::FindSource(
+    double x, double y, double dx, double dy) {
   assert (int_left_x() <= x && x < int_right_x());
   assert (int_top_y() <= y && y < int_bottom_y());
 
-  last_used_ = 0;
-
   load();
+  touch();
+  if (IsDetailedEnough(dx, dy)) {
+    return this;
+  }
+
+  int idx;
+  if (x < x_) {
+    idx = y < y_ ? 0 : 2;
+  } else {
+    idx = y < y_ ? 1 : 3;
+  }
+
+  if (!children_[idx]) {
+    initChild(idx);
+  }
+  return children_[idx]->FindSource(x, y, dx, dy);
+}
+
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::Prefetch(const glm::dvec2* samples,
+                                        const glm::dvec2* diffs, int count) {
+  if (synthetic_input) {
+    return;
+  }
+
+  std::vector<std::string> paths;
+  for (int i = 0; i < count; ++i) {
+    double x = samples[i].x, y = samples[i].y;
+    WrapCoordinates(x, y);
+    planSource(x, y, std::abs(diffs[i].x), std::abs(diffs[i].y), paths);
+  }
+  cache_->prefetcher.Prefetch(paths);
+}
+
+// The same descent as FindSource's, without loading the nodes.
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::planSource(double x, double y,
+                                          double dx, double dy,
+                                          std::vector<std::string>& paths) {
+  if (!is_image_loaded()) {
+    std::string path = texture_path();
+    if (std::find(paths.begin(), paths.end(), path) == paths.end()) {
+      paths.push_back(std::move(path));
+    }
+  }
+  if (IsDetailedEnough(dx, dy)) {
+    return;
+  }
+
+  int idx;
+  if (x < x_) {
+    idx = y < y_ ? 0 : 2;
+  } else {
+    idx = y < y_ ? 1 : 3;
+  }
+
+  if (!children_[idx]) {
+    initChild(idx);
+  }
+  children_[idx]->planSource(x, y, dx, dy, paths);
+}
+
+template<typename Dataset>
+void TexQuadTreeNode<Dataset>::Filter(const glm::dvec2* positions, int count,
+                                      ResampleTaps* taps,
+                                      TexelData* out) const {
+  constexpr int kBorderSize = Dataset::kBorderSize;
   int borderless_width = tex_w_ - 2*kBorderSize;
   int borderless_height = tex_h_ - 2*kBorderSize;
   glm::dvec2 pixel_coverage = glm::dvec2{sx_ / borderless_width,
                                          sy_ / borderless_height};
 
-  if (level_ == 0 || (pixel_coverage.x < dx && pixel_coverage.y < dy)) {
-    glm::ivec2 top_left = glm::ivec2(glm::floor(glm::dvec2{x, y}));
-    glm::dvec2 fraction = glm::fract(glm::dvec2{x, y});
-
-#ifdef HEIGHTMAP
-    double sum = 0.0;
-#else
-    double sum_r = 0.0, sum_g = 0.0, sum_b = 0.0;
-#endif
-
-    double sum_weight = 0.0;
-    for (int xx = -1; xx <= 2; xx++) {
-      for (int yy = -1; yy <= 2; yy++) {
-        glm::ivec2 pos = top_left + glm::ivec2(xx, yy);
-
-        int col = (pos.x - int_left_x()) / pixel_coverage.x + kBorderSize;
-        int row = (pos.y - int_top_y()) / pixel_coverage.y + kBorderSize;
-        int idx = row*tex_w_ + col;
-        assert(0 <= idx && idx < data_.size());
-        TexelData texel_value = data_[idx];
-
-        double weight = CatMullRom(xx - fraction.x)
-                      * CatMullRom(-yy + fraction.y);
-        sum_weight += weight;
-
-#ifdef HEIGHTMAP
-        sum += texel_value * weight;
-#else
-        sum_r += texel_value.r * weight;
-        sum_g += texel_value.g * weight;
-        sum_b += texel_value.b * weight;
-#endif
-      }
-    }
-
-#ifdef HEIGHTMAP
-    return static_cast<TexelData>(clamp(round(sum / sum_weight),
-        std::numeric_limits<TexelData>::min(),
-        std::numeric_limits<TexelData>::max()));
-#else
-    return TexelData{
-      static_cast<unsigned char>(clamp(round(sum_r / sum_weight),
-        std::numeric_limits<unsigned char>::min(),
-        std::numeric_limits<unsigned char>::max())),
-      static_cast<unsigned char>(clamp(round(sum_g / sum_weight),
-        std::numeric_limits<unsigned char>::min(),
-        std::numeric_limits<unsigned char>::max())),
-      static_cast<unsigned char>(clamp(round(sum_b / sum_weight),
-        std::numeric_limits<unsigned char>::min(),
-        std::numeric_limits<unsigned char>::max()))
-    };
-#endif
-  } else {
-    int idx;
-    if (x < x_) {
-      idx = y < y_ ? 0 : 2;
-    } else {
-      idx = y < y_ ? 1 : 3;
-    }
+  for (int i = 0; i < count; ++i) {
+    glm::ivec2 top_left = glm::ivec2(glm::floor(positions[i]));
+    glm::dvec2 fraction = glm::fract(positions[i]);
 
-    if (!children_[idx]) {
-      initChild(idx);
+    for (int k = 0; k < 4; ++k) {
+      glm::ivec2 pos = top_left + glm::ivec2(k - 1);
+      taps[i].col[k] = (pos.x - int_left_x()) / pixel_coverage.x + kBorderSize;
+      taps[i].row[k] = (pos.y - int_top_y()) / pixel_coverage.y + kBorderSize;
+      assert(0 <= taps[i].col[k] && taps[i].col[k] < int(tex_w_));
+      assert(0 <= taps[i].row[k] && taps[i].row[k] < int(tex_h_));
     }
-    return children_[idx]->FetchPixelInternal(x, y, dx, dy);
+    CatMullRomWeights(fraction.x, taps[i].wx);
+    CatMullRomWeights(fraction.y, taps[i].wy);
   }
+
+  ResampleTexels(data_.data(), tex_w_, taps, count, out);
 }
 
+template class TexQuadTreeNode<HeightDataset>;
+template class TexQuadTreeNode<DiffuseDataset>;
@@ -3,31 +3,49 @@
 #ifndef ENGINE_CDLOD_TEXTURE_TEX_QUAD_TREE_NODE_H_
 #define ENGINE_CDLOD_TEXTURE_TEX_QUAD_TREE_NODE_H_
 
+#include <list>
 #include <memory>
 #include <cassert>
-#include <Magick++.h>
+#include <string>
+#include <vector>
 #include <glm/glm.hpp>
 #include "./preproc_settings.h"
-
-#ifdef HEIGHTMAP
-  using TexelData = unsigned short;
-#else
-  struct TexelData {
-    unsigned char r, g, b;
-  };
-#endif
-
+#include "./preproc_resampler.h"
+#include "./preproc_input_prefetcher.h"
+
+// Generate a procedural input instead of reading the input images, for
+// benchmarking (nothing is written in this mode).
+extern bool synthetic_input;
+
+// The quadtree of the input tiles of a dataset, that loads them lazily, and
+// keeps them cached within a memory budget, unloading the least recently used
+// ones. The tiles the next output tile will need can be prefetched, then they
+// are decoded on a background thread.
+template<typename Dataset>
 class TexQuadTreeNode {
  public:
+  using TexelData = typename Dataset::Texel;
+
   TexQuadTreeNode(TexQuadTreeNode* parent,
                   double center_x, double center_y,
                   double size_x, double size_y,
                   int mip_level, unsigned index);
+  ~TexQuadTreeNode();
 
   void load();
 
+  // Should be called on the root, once per output tile. Unloads the least
+  // recently used tiles while the cache is over its budget (the tiles used
+  // for the current output tile are kept even if they don't fit).
   void age();
 
+  // The budget of the whole tree (set on the root).
+  void set_memory_budget(size_t bytes) { cache_->memory_budget = bytes; }
+  // The memory used by the loaded and the prefetched tiles of the tree.
+  size_t memory_used() const {
+    return cache_->memory_used + cache_->prefetcher.memory_used();
+  }
+
   double center_x() const { return x_; }
   double center_y() const { return y_; }
   double size_x() const { return sx_; }
@@ -53,7 +71,7 @@ class TexQuadTreeNode {
   std::string texture_path() const;
 
   bool is_image_loaded() const { return !data_.empty(); }
-  int last_used() const { return last_used_; }
+  unsigned last_used() const { return last_used_; }
   unsigned data_start_offset() const { return data_start_offset_; }
   const std::vector<TexelData>& data() const { return data_; }
   TexQuadTreeNode* parent() const { return parent_; }
@@ -63,9 +81,54 @@ class TexQuadTreeNode {
 
   TexelData FetchPixel(glm::dvec2 sample, glm::dvec2 diff);
 
+  // Samples a span of texels. The source node is only looked up again if
+  // the cached one can't be used for the next texel, and the cached tree is
+  // not aged, that should be done once per output tile with age().
+  // The results are the same as FetchPixel's.
+  void FetchRow(const glm::dvec2* samples, const glm::dvec2* diffs,
+                int count, TexelData* out);
+
+  // Starts decoding the tiles FetchRow would load for these samples (the
+  // samples can be a sparse subset of the ones of the next output tile).
+  void Prefetch(const glm::dvec2* samples, const glm::dvec2* diffs, int count);
+
  private:
-  TexelData FetchPixel(double x, double y, double dx, double dy);
-  TexelData FetchPixelInternal(double x, double y, double dx, double dy);
+  // Shared by the nodes of a tree.
+  struct Cache {
+    explicit Cache(PngFormat format) : prefetcher(format) {}
+
+    size_t memory_budget = size_t(kMinInputCacheMB) << 20;
+    size_t memory_used = 0;  // by the loaded tiles
+    unsigned tile = 0;  // the number of age() calls
+    std::list<TexQuadTreeNode*> loaded_nodes;  // the most recently used first
+    InputPrefetcher prefetcher;
+  };
+
+  void WrapCoordinates(double& x, double& y) const;
+
+  // The node whose data should be used for the sample (the first one from this
+  // node, that is detailed enough, or a leaf).
+  TexQuadTreeNode* FindSource(double x, double y, double dx, double dy);
+  bool IsDetailedEnough(double dx, double dy) const;
+  // The area a texel covers. If the node isn't loaded, it's predicted from
+  // its level.
+  glm::dvec2 pixelCoverage() const;
+  bool IsSourceFor(double x, double y, double dx, double dy) const;
+  void Filter(const glm::dvec2* positions, int count,
+              ResampleTaps* taps, TexelData* out) const;
+
+  void generateSyntheticData();
+
+  // Marks the node as used by the current output tile.
+  void touch();
+  void unload();
+  static void evict(Cache& cache);
+  // Deletes the subtrees that don't have loaded nodes. Returns whether this
+  // one has.
+  bool prune();
+  // Collects the paths of the tiles FindSource would load for the sample.
+  void planSource(double x, double y, double dx, double dy,
+                  std::vector<std::string>& paths);
 
   TexQuadTreeNode* parent_;
   double x_, y_, sx_, sy_;
@@ -74,8 +137,13 @@ class TexQuadTreeNode {
   std::unique_ptr<TexQuadTreeNode> children_[4];
   std::vector<TexelData> data_;
 
-  int last_used_ = 0;
-  static const int kTimeToLiveInMemory = 1 << 16;
+  // scratch buffers of FetchRow
+  std::vector<glm::dvec2> positions_;
+  std::vector<ResampleTaps> taps_;
+
+  std::shared_ptr<Cache> cache_;
+  typename std::list<TexQuadTreeNode*>::iterator cache_position_;
+  unsigned last_used_ = 0;  // the output tile, that used this node last
 
   template<typename T>
   void initChildInternal(int i);
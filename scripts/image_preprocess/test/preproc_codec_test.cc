@@ -0,0 +1,211 @@
+// Copyright (c) 2015, Tamas Csala
+
+// Round-trip test of the tile encoders of the preprocessor, on the CPU: the
+// BC1 blocks are decoded in software, and the KTX files are parsed back with
+// the runtime's decoder. Exits with a non-zero code if any check fails.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../preproc_bc1.h"
+#include "../preproc_ktx.h"
+#include "cdlod/texture_data.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", \
+                   __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+struct Rgb {
+  int r, g, b;
+};
+
+static Rgb Unpack565(uint16_t c) {
+  int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  return Rgb{(r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2)};
+}
+
+// Decodes the blocks like the GPU does (with the exact 1/3 and 1/2 weights,
+// the hardware may round a bit differently). The texels of the 3 color mode's
+// transparent black index are returned as (-1, -1, -1).
+static std::vector<Rgb> DecodeBC1(const std::vector<unsigned char>& blocks,
+                                  int width, int height) {
+  int blocks_x = (width + 3) / 4;
+  std::vector<Rgb> texels(width * height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const unsigned char* block = &blocks[8 * ((y/4)*blocks_x + x/4)];
+      uint16_t c0 = block[0] | (block[1] << 8);
+      uint16_t c1 = block[2] | (block[3] << 8);
+      uint32_t bits = block[4] | (block[5] << 8) | (block[6] << 16) |
+                      (uint32_t(block[7]) << 24);
+      Rgb e0 = Unpack565(c0), e1 = Unpack565(c1);
+      Rgb palette[4] = {e0, e1};
+      if (c0 > c1) {
+        palette[2] = Rgb{(2*e0.r + e1.r) / 3, (2*e0.g + e1.g) / 3,
+                         (2*e0.b + e1.b) / 3};
+        palette[3] = Rgb{(e0.r + 2*e1.r) / 3, (e0.g + 2*e1.g) / 3,
+                         (e0.b + 2*e1.b) / 3};
+      } else {
+        palette[2] = Rgb{(e0.r + e1.r) / 2, (e0.g + e1.g) / 2,
+                         (e0.b + e1.b) / 2};
+        palette[3] = Rgb{-1, -1, -1};
+      }
+      int index = (bits >> (2 * ((y%4)*4 + x%4))) & 3;
+      texels[y*width + x] = palette[index];
+    }
+  }
+  return texels;
+}
+
+// The largest per-channel difference between the image and its round trip.
+static int MaxError(const std::vector<unsigned char>& rgb, int width,
+                    int height) {
+  std::vector<unsigned char> blocks = EncodeBC1(rgb.data(), width, height);
+  CHECK(blocks.size() == size_t((width+3)/4 * ((height+3)/4) * 8));
+  std::vector<Rgb> decoded = DecodeBC1(blocks, width, height);
+
+  int max_error = 0;
+  for (int i = 0; i < width*height; ++i) {
+    const Rgb& texel = decoded[i];
+    // the encoder always uses the four color mode (or a single color)
+    CHECK(texel.r >= 0);
+    max_error = std::max({max_error, std::abs(texel.r - rgb[3*i+0]),
+                                     std::abs(texel.g - rgb[3*i+1]),
+                                     std::abs(texel.b - rgb[3*i+2])});
+  }
+  return max_error;
+}
+
+static std::vector<unsigned char> SolidImage(int width, int height, Rgb color) {
+  std::vector<unsigned char> rgb(3 * width * height);
+  for (int i = 0; i < width*height; ++i) {
+    rgb[3*i+0] = color.r; rgb[3*i+1] = color.g; rgb[3*i+2] = color.b;
+  }
+  return rgb;
+}
+
+// Smooth changes in every direction, like most of the diffuse tiles (at most
+// about 5 per texel).
+static std::vector<unsigned char> SmoothImage(int width, int height) {
+  std::vector<unsigned char> rgb(3 * width * height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      unsigned char* texel = &rgb[3 * (y*width + x)];
+      texel[0] = 128 + 100*std::sin(x*0.05);
+      texel[1] = 128 + 80*std::cos(y*0.07);
+      texel[2] = 60 + 40*std::sin((x+y)*0.03);
+    }
+  }
+  return rgb;
+}
+
+static void TestBC1() {
+  // 565 quantization only: at most 4 for the 5 bit channels
+  CHECK(MaxError(SolidImage(4, 4, Rgb{200, 100, 50}), 4, 4) <= 4);
+  CHECK(MaxError(SolidImage(4, 4, Rgb{0, 0, 0}), 4, 4) == 0);
+  CHECK(MaxError(SolidImage(4, 4, Rgb{255, 255, 255}), 4, 4) == 0);
+
+  // red and green, the principal axis points towards the green, so the
+  // first endpoint is the smaller 565 value, and the encoder has to swap
+  // them to stay in the four color mode
+  std::vector<unsigned char> two_colors = SolidImage(4, 4, Rgb{0, 255, 0});
+  for (int i = 0; i < 8; ++i) {
+    two_colors[3*i+0] = 200; two_colors[3*i+1] = 0; two_colors[3*i+2] = 0;
+  }
+  CHECK(MaxError(two_colors, 4, 4) <= 4);
+  std::vector<unsigned char> blocks = EncodeBC1(two_colors.data(), 4, 4);
+  uint16_t c0 = blocks[0] | (blocks[1] << 8), c1 = blocks[2] | (blocks[3] << 8);
+  CHECK(c0 > c1);
+
+  // the changes in a block aren't on a line, so the error is larger
+  CHECK(MaxError(SmoothImage(4, 4), 4, 4) <= 8);
+  // odd sizes, with partial blocks at the edges
+  CHECK(MaxError(SmoothImage(7, 5), 7, 5) <= 8);
+  CHECK(MaxError(SmoothImage(1, 1), 1, 1) <= 4);
+  CHECK(MaxError(SmoothImage(262, 262), 262, 262) <= 16);
+}
+
+static void TestKtx() {
+  // an uncompressed odd sized texture, whose rows need padding
+  std::vector<KtxLevel> levels;
+  for (int size = 5; size > 0; size /= 2) {
+    std::vector<unsigned char> rgb = SmoothImage(size, size);
+    levels.push_back(KtxLevel{size, size, rgb});
+  }
+  std::string path = "preproc_codec_test_rgb8.ktx";
+  WriteKtx(path, kKtxRgb8, levels);
+
+  Cdlod::TileBuffer file;
+  Cdlod::ReadFile(path, file);
+  Cdlod::TextureData data;
+  Cdlod::DecodeKtx(std::move(file), path, data);
+  CHECK(data.level_count == levels.size());
+  CHECK(data.internal_format == kGlRgb8);
+  CHECK(data.format == kGlRgb);
+  CHECK(data.type == kGlUnsignedByte);
+  size_t offset = 64;
+  for (size_t i = 0; i < std::min(data.level_count, levels.size()); ++i) {
+    const Cdlod::TextureData::Level& level = data.levels[i];
+    int size = levels[i].width;
+    size_t padded_row_size = (3*size + 3) / 4 * 4;
+    offset += sizeof(uint32_t);
+    CHECK(level.width == size && level.height == size);
+    CHECK(level.offset == offset);
+    CHECK(level.size == padded_row_size * size);
+    for (int y = 0; y < size; ++y) {
+      CHECK(std::equal(&levels[i].data[3*size*y], &levels[i].data[3*size*(y+1)],
+                       data.bytes.data() + level.offset + padded_row_size*y));
+    }
+    offset += level.size;
+  }
+
+  // a BC1 mipmap chain, like the diffuse tiles
+  levels.clear();
+  for (int size = 18; size > 0; size /= 2) {
+    std::vector<unsigned char> rgb = SmoothImage(size, size);
+    levels.push_back(KtxLevel{size, size, EncodeBC1(rgb.data(), size, size)});
+  }
+  path = "preproc_codec_test_bc1.ktx";
+  WriteKtx(path, kKtxBC1, levels);
+
+  Cdlod::ReadFile(path, file);
+  Cdlod::DecodeKtx(std::move(file), path, data);
+  CHECK(data.compressed());
+  CHECK(data.internal_format == kGlCompressedRgbS3tcDxt1);
+  CHECK(data.level_count == levels.size());
+  offset = 64;
+  for (size_t i = 0; i < std::min(data.level_count, levels.size()); ++i) {
+    const Cdlod::TextureData::Level& level = data.levels[i];
+    offset += sizeof(uint32_t);
+    CHECK(level.width == levels[i].width && level.height == levels[i].height);
+    CHECK(level.offset == offset);
+    CHECK(level.size == levels[i].data.size());
+    CHECK(std::equal(levels[i].data.begin(), levels[i].data.end(),
+                     data.bytes.data() + level.offset));
+    offset += level.size;  // BC1 blocks are 8 bytes, no padding
+  }
+}
+
+int main() {
+  TestBC1();
+  TestKtx();
+  if (failures != 0) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,201 @@
+// Copyright (c), Tamas Csala
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <Silice3D/core/scene.hpp>
+
+#include "camera_path.hpp"
+#include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/frame_profiler.hpp"
+#include "cdlod/memory_stats.hpp"
+
+std::vector<CameraPathSample> LoadCameraPath(const std::string& path) {
+  std::ifstream file{path};
+  if (!file) {
+    throw std::runtime_error("Can't open camera path " + path);
+  }
+
+  std::vector<CameraPathSample> samples;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream stream{line};
+    CameraPathSample sample;
+    stream >> sample.pos.x >> sample.pos.y >> sample.pos.z
+           >> sample.forward.x >> sample.forward.y >> sample.forward.z
+           >> sample.up.x >> sample.up.y >> sample.up.z;
+    if (!stream) {
+      throw std::runtime_error("Invalid camera path line in " + path + ": " +
+                               line);
+    }
+    samples.push_back(sample);
+  }
+
+  if (samples.empty()) {
+    throw std::runtime_error("Empty camera path " + path);
+  }
+  return samples;
+}
+
+/* CameraPathRecorder */
+
+CameraPathRecorder::CameraPathRecorder(Silice3D::GameObject* parent,
+                                       const std::string& path)
+    : Silice3D::GameObject(parent), file_(path) {
+  if (!file_) {
+    throw std::runtime_error("Can't write camera path " + path);
+  }
+  file_.precision(std::numeric_limits<double>::max_digits10);
+  file_ << "# camera path, a sample per " << kCameraPathTimestep
+        << "s: pos forward up" << std::endl;
+}
+
+void CameraPathRecorder::Update() {
+  // the frames don't line up with the timestep, the camera's state at the
+  // end of the frame is recorded for all the samples that fell into it
+  unrecorded_time_ += scene_->camera_time().dt();
+  while (unrecorded_time_ >= kCameraPathTimestep) {
+    const Silice3D::Transform& transform = scene_->camera()->transform();
+    glm::dvec3 pos = transform.pos();
+    glm::dvec3 forward = transform.forward();
+    glm::dvec3 up = transform.up();
+    file_ << pos.x << ' ' << pos.y << ' ' << pos.z << ' '
+          << forward.x << ' ' << forward.y << ' ' << forward.z << ' '
+          << up.x << ' ' << up.y << ' ' << up.z << '\n';
+    unrecorded_time_ -= kCameraPathTimestep;
+  }
+}
+
+/* CameraPathPlayer */
+
+// "Terrain draw" -> "terrain_draw"
+static std::string ColumnName(const char* stage_name) {
+  std::string name = stage_name;
+  for (char& c : name) {
+    c = c == ' ' || c == '-' ? '_' : tolower(c);
+  }
+  return name;
+}
+
+CameraPathPlayer::CameraPathPlayer(Silice3D::GameObject* parent,
+                                   GLFWwindow* window, const std::string& path,
+                                   const std::string& output_path)
+    : Silice3D::GameObject(parent)
+    , window_(window)
+    , samples_(LoadCameraPath(path))
+    , output_(output_path)
+    , output_path_(output_path) {
+  if (!output_) {
+    throw std::runtime_error("Can't write replay statistics " + output_path);
+  }
+
+  // The GPU timings are the latest available results, those are usually
+  // two frames late.
+  output_ << "frame,frame_ms";
+  for (const char* clock : {"cpu", "gpu"}) {
+    for (int i = 0; i < int(Cdlod::FrameStage::kCount); ++i) {
+      output_ << ',' << ColumnName(Cdlod::FrameStageName(Cdlod::FrameStage(i)))
+              << '_' << clock << "_ms";
+    }
+  }
+  // The fragments are counted by a query, whose result is usually two frames
+  // late too.
+  output_ << ",geometry_nodes,texture_nodes,tile_loads,tile_uploads"
+             ",queued_tiles,decoded_mb,resident_mb,tile_reads,io_queue_depth"
+             ",fragments,overdraw"
+          << std::endl;
+
+  last_loads_count_ = CdlodTerrainSettings::tile_loads_count;
+  last_uploads_count_ = CdlodTerrainSettings::tile_uploads_count;
+  last_io_stats_ = Cdlod::TileLoader::IoStats();
+
+  int width = 0, height = 0;
+  glfwGetFramebufferSize(window_, &width, &height);
+  ScreenResized(width, height);
+
+  glfwSwapInterval(0);
+}
+
+void CameraPathPlayer::ScreenResized(size_t width, size_t height) {
+  screen_pixels_ = std::max<size_t>(width * height, 1);
+}
+
+void CameraPathPlayer::Update() {
+  if (frame_ > samples_.size()) {
+    return;  // waiting for the window to close
+  }
+
+  Clock::time_point now = Clock::now();
+  if (frame_ != 0) {
+    double frame_time =
+        std::chrono::duration<double, std::milli>(now - last_frame_start_).count();
+    sum_frame_time_ += frame_time;
+    writeFrameStats(frame_time);
+  }
+  last_frame_start_ = now;
+
+  if (frame_ == samples_.size()) {
+    output_.close();
+    std::cout << "Replayed " << samples_.size() << " frames, "
+              << sum_frame_time_ / samples_.size() << "ms avg frame time, "
+              << "statistics saved to " << output_path_ << std::endl;
+    glfwSetWindowShouldClose(window_, GL_TRUE);
+    frame_++;
+    return;
+  }
+
+  const CameraPathSample& sample = samples_[frame_++];
+  Silice3D::Transform& transform = scene_->camera()->transform();
+  transform.set_pos(sample.pos);
+  transform.set_forward(sample.forward);
+  transform.set_up(sample.up);
+}
+
+void CameraPathPlayer::writeFrameStats(double frame_time) {
+  const Cdlod::FrameProfiler& profiler = Cdlod::FrameProfiler::Get();
+  Cdlod::TerrainMemoryStats memory_stats = Cdlod::MemoryAccounting::Snapshot();
+  size_t loads_count = CdlodTerrainSettings::tile_loads_count;
+  size_t uploads_count = CdlodTerrainSettings::tile_uploads_count;
+  Cdlod::TileIoStats io_stats = Cdlod::TileLoader::IoStats();
+
+  char buffer[64];
+  auto format = [&buffer](double value) {
+    snprintf(buffer, sizeof(buffer), "%.3f", value);
+    return buffer;
+  };
+
+  output_ << frame_ - 1 << ',' << format(frame_time);
+  for (int i = 0; i < int(Cdlod::FrameStage::kCount); ++i) {
+    output_ << ',' << format(profiler.cpuTimings(Cdlod::FrameStage(i)).last);
+  }
+  for (int i = 0; i < int(Cdlod::FrameStage::kCount); ++i) {
+    output_ << ',' << format(profiler.gpuTimings(Cdlod::FrameStage(i)).last);
+  }
+  output_ << ',' << CdlodTerrainSettings::geom_nodes_count
+          << ',' << CdlodTerrainSettings::texture_nodes_count
+          << ',' << loads_count - last_loads_count_
+          << ',' << uploads_count - last_uploads_count_
+          << ',' << memory_stats.tier(Cdlod::MemoryTier::kQueued).tiles;
+  output_ << ',' << format(
+      memory_stats.tier(Cdlod::MemoryTier::kDecoded).bytes / (1024.0 * 1024.0));
+  output_ << ',' << format(
+      memory_stats.tier(Cdlod::MemoryTier::kResident).bytes / (1024.0 * 1024.0));
+  // the average number of reads in flight during the frame
+  output_ << ',' << io_stats.tiles - last_io_stats_.tiles;
+  output_ << ',' << format(
+      (io_stats.read_seconds - last_io_stats_.read_seconds) / (frame_time / 1000));
+  size_t fragments_count = CdlodTerrainSettings::fragments_count;
+  output_ << ',' << fragments_count
+          << ',' << format(double(fragments_count) / screen_pixels_);
+  output_ << '\n';
+
+  last_loads_count_ = loads_count;
+  last_uploads_count_ = uploads_count;
+  last_io_stats_ = io_stats;
+}
@@ -0,0 +1,72 @@
+// Copyright (c), Tamas Csala
+
+#ifndef LOE_CAMERA_PATH_H_
+#define LOE_CAMERA_PATH_H_
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <Silice3D/core/game_object.hpp>
+
+#include "cdlod/tile_loader.hpp"
+
+struct CameraPathSample {
+  glm::dvec3 pos, forward, up;
+};
+
+// A camera path is a text file, with a "pos forward up" line (9 numbers) per
+// kTimestep of the camera time. Lines starting with '#' are comments.
+static constexpr double kCameraPathTimestep = 1.0 / 60.0;
+
+std::vector<CameraPathSample> LoadCameraPath(const std::string& path);
+
+// Samples the transform of the scene's camera with a fixed timestep, and
+// writes it to the file.
+class CameraPathRecorder : public Silice3D::GameObject {
+ public:
+  CameraPathRecorder(Silice3D::GameObject* parent, const std::string& path);
+
+ private:
+  std::ofstream file_;
+  double unrecorded_time_ = 0;
+
+  virtual void Update() override;
+};
+
+// Moves the scene's camera along a recorded path, one sample per frame, so a
+// replay renders the same camera poses regardless of the frame rate. The
+// scene steps the time of the day with the same fixed timestep (see
+// Skybox::set_fixed_timestep), so the lighting matches too. The statistics
+// of every frame are written to a CSV file, and the window is closed at the
+// end of the path. The vsync is turned off for the replay.
+//
+// It has to be added after the FpsDisplay, which closes the frames of the
+// FrameProfiler: the timings of a frame are read in the next one's Update.
+class CameraPathPlayer : public Silice3D::GameObject {
+ public:
+  CameraPathPlayer(Silice3D::GameObject* parent, GLFWwindow* window,
+                   const std::string& path, const std::string& output_path);
+
+  const CameraPathSample& firstSample() const { return samples_.front(); }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  GLFWwindow* window_;
+  std::vector<CameraPathSample> samples_;
+  std::ofstream output_;
+  std::string output_path_;
+  size_t frame_ = 0;
+  Clock::time_point last_frame_start_;
+  double sum_frame_time_ = 0;
+  size_t last_loads_count_ = 0, last_uploads_count_ = 0;
+  Cdlod::TileIoStats last_io_stats_;
+  size_t screen_pixels_ = 1;
+
+  virtual void Update() override;
+  virtual void ScreenResized(size_t width, size_t height) override;
+  void writeFrameStats(double frame_time);
+};
+
+#endif  // LOE_CAMERA_PATH_H_
@@ -2,21 +2,38 @@
 
 #include <memory>
 #include <Silice3D/camera/icamera.hpp>
+#include <Silice3D/common/make_unique.hpp>
 
 #include "cdlod/cdlod_quad_tree.hpp"
 #include "cdlod/geometry/quad_grid_mesh.hpp"
 #include "cdlod/cdlod_quad_tree_node.hpp"
 #include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/frame_profiler.hpp"
 
 namespace Cdlod {
 
-CdlodQuadTree::CdlodQuadTree(size_t kFaceSize, CubeFace face)
+// The preprocessor writes it next to the elevation tiles of the face.
+static std::string MetadataPath(CubeFace face) {
+  return std::string{"/media/icecool/Data/LoE_datasets/height/gmted2010_75/cube"}
+         + "/" + std::to_string(int(face)) + "/metadata.bin";
+}
+
+CdlodQuadTree::CdlodQuadTree(size_t kFaceSize, CubeFace face,
+                             VirtualTextureCache* virtual_texture_cache)
   : max_node_level_(log2(kFaceSize) - CdlodTerrainSettings::kNodeDimensionExp)
-  , root_(kFaceSize/2, kFaceSize/2, face, max_node_level_) {}
+  , metadata_(Silice3D::make_unique<TileMetadata>(MetadataPath(face), face))
+  , root_(kFaceSize/2, kFaceSize/2, face, max_node_level_, nullptr,
+          virtual_texture_cache, metadata_.get()) {}
 
-void CdlodQuadTree::render(const Silice3D::ICamera& cam, QuadGridMesh& mesh,
-                           Silice3D::ThreadPool& thread_pool) {
-  root_.selectNodes(cam.transform().pos(), cam.frustum(), mesh, thread_pool);
+void CdlodQuadTree::render(const Silice3D::ICamera& cam, double lod_distance,
+                           double pixel_scale, QuadGridMesh& mesh,
+                           TileLoader& tile_loader) {
+  {
+    FrameProfiler::ScopedCpuTimer timer{FrameStage::kSelection};
+    root_.selectNodes(cam.transform().pos(), cam.frustum(), lod_distance,
+                      pixel_scale, mesh, tile_loader);
+  }
+  FrameProfiler::ScopedCpuTimer timer{FrameStage::kAge};
   root_.age();
 }
 
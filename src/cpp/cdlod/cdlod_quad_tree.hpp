@@ -7,21 +7,28 @@
 #include <Silice3D/camera/icamera.hpp>
 
 #include "cdlod/geometry/quad_grid_mesh.hpp"
+#include "cdlod/tile_metadata.hpp"
 #include "cdlod/cdlod_quad_tree_node.hpp"
 
 namespace Cdlod {
 
 class CdlodQuadTree {
   size_t max_node_level_;
+  // the nodes point to it, so it can't move with the tree
+  std::unique_ptr<TileMetadata> metadata_;
   CdlodQuadTreeNode root_;
 
  public:
-  CdlodQuadTree(size_t kFaceSize, CubeFace face);
+  CdlodQuadTree(size_t kFaceSize, CubeFace face,
+                VirtualTextureCache* virtual_texture_cache = nullptr);
   CdlodQuadTree(CdlodQuadTree&&) = default;
 
-  void render(const Silice3D::ICamera& cam, QuadGridMesh& mesh,
-              Silice3D::ThreadPool& thread_pool);
+  void render(const Silice3D::ICamera& cam, double lod_distance,
+              double pixel_scale, QuadGridMesh& mesh,
+              TileLoader& tile_loader);
   size_t max_node_level() const { return max_node_level_; }
+  CdlodQuadTreeNode& root() { return root_; }
+  const CdlodQuadTreeNode& root() const { return root_; }
 };
 
 } // namespace Cdlod
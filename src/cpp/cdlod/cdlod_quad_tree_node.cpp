@@ -2,30 +2,67 @@
 
 #include <lodepng.h>
 #include <algorithm>
+#include <cmath>
 #include <glad/glad.h>
 #include <oglwrap/oglwrap.h>
 #include <Silice3D/common/make_unique.hpp>
 
 #include "cdlod/cdlod_quad_tree_node.hpp"
 #include "cdlod/collision/cube2sphere.hpp"
+#include "cdlod/frame_profiler.hpp"
+#include "cdlod/memory_stats.hpp"
+#include "cdlod/trace.hpp"
+#include "cdlod/virtual_texture_cache.hpp"
 
 #define gl(func) OGLWRAP_CHECKED_FUNCTION(func)
 
 namespace Cdlod {
 
+constexpr int CdlodQuadTreeNode::TextureSelection::kSourceCount;
+
 CdlodQuadTreeNode::CdlodQuadTreeNode(double x, double z, CubeFace face,
-                                     int level, CdlodQuadTreeNode* parent)
-    : x_(x), z_(z), face_(face), level_(level), parent_(parent) {
+                                     int level, CdlodQuadTreeNode* parent,
+                                     VirtualTextureCache* virtual_texture_cache,
+                                     const TileMetadata* metadata)
+    : x_(x), z_(z), face_(face), level_(level), parent_(parent)
+    , virtual_texture_cache_(virtual_texture_cache), metadata_(metadata) {
   calculateMinMax();
   refreshMinMax();
 }
 
+// The nodes are only moved when the trees are constructed, before any load.
+CdlodQuadTreeNode::CdlodQuadTreeNode(CdlodQuadTreeNode&& other)
+    : x_(other.x_), z_(other.z_), face_(other.face_), level_(other.level_)
+    , bbox_(std::move(other.bbox_)), parent_(other.parent_)
+    , virtual_texture_cache_(other.virtual_texture_cache_)
+    , metadata_(other.metadata_)
+    , last_used_(other.last_used_)
+    , is_enqued_for_async_load_(other.is_enqued_for_async_load_.load())
+    , texture_(std::move(other.texture_))
+    , cached_selection_(other.cached_selection_)
+    , has_cached_selection_(other.has_cached_selection_) {
+  for (int i = 0; i < 4; ++i) {
+    children_[i] = std::move(other.children_[i]);
+  }
+}
+
 CdlodQuadTreeNode::~CdlodQuadTreeNode() {
+  MemoryAccounting::Update(memoryStatsLevel(), MemoryTier::kDecoded,
+                           texture_.decoded_bytes, 0);
+  MemoryAccounting::Update(memoryStatsLevel(), MemoryTier::kResident,
+                           texture_.resident_bytes, 0);
+
   if (texture_.is_loaded_to_gpu) {
     CdlodTerrainSettings::texture_nodes_count--;
+    if (virtual_texture_cache_) {
+      virtual_texture_cache_->release(texture_);
+    }
     if (texture_.elevation.size != 0) {
       texture_.elevation.handle.makeNonResident();
     }
+    if (texture_.normal.size != 0) {
+      texture_.normal.handle.makeNonResident();
+    }
     if (texture_.diffuse.size != 0) {
       texture_.diffuse.handle.makeNonResident();
     }
@@ -46,28 +83,37 @@ void CdlodQuadTreeNode::initChild(int i) {
     x = x_+s4; z = z_-s4;
   }
 
-  children_[i] = Silice3D::make_unique<CdlodQuadTreeNode>(x, z, face_, level_-1, this);
+  children_[i] = Silice3D::make_unique<CdlodQuadTreeNode>(x, z, face_, level_-1, this,
+                                                          virtual_texture_cache_,
+                                                          metadata_);
 }
 
 void CdlodQuadTreeNode::selectNodes(const glm::vec3& cam_pos,
                                     const Silice3D::Frustum& frustum,
+                                    double lod_distance,
+                                    double pixel_scale,
                                     QuadGridMesh& grid_mesh,
-                                    Silice3D::ThreadPool& thread_pool) {
+                                    TileLoader& tile_loader) {
   last_used_ = 0;
 
   bool is_node_visible = bbox_.collidesWithFrustum(frustum);
 
-  StreamedTextureInfo texinfo;
-  selectTexture(cam_pos, frustum, thread_pool, texinfo, is_node_visible);
-
   if (!is_node_visible) {
+    // only its own tiles are prefetched, without walking up the chain
+    TextureSelection selection;
+    selectTexture(cam_pos, frustum, tile_loader, selection, false);
     return;
   }
 
-  // If we can cover the whole area or if we are a leaf
-  Silice3D::Sphere sphere(cam_pos, CdlodTerrainSettings::kSmallestGeometryLodDistance * scale());
+  const StreamedTextureInfo& texinfo =
+      resolveTextures(cam_pos, frustum, tile_loader);
+
+  // If we can cover the whole area, if we are a leaf, or if the children
+  // wouldn't look any different
+  Silice3D::Sphere sphere(cam_pos, lod_distance * scale());
   if (!bbox_.collidesWithSphere(sphere) ||
-      level_ <= CdlodTerrainSettings::kLevelOffset - CdlodTerrainSettings::kGeomDiv) {
+      level_ <= CdlodTerrainSettings::kLevelOffset - CdlodTerrainSettings::kGeomDiv ||
+      !isGeometricErrorVisible(cam_pos, pixel_scale)) {
     if (bbox_.collidesWithFrustum(frustum)) {
       grid_mesh.addToRenderList(x_, z_, level_, int(face_), texinfo);
     }
@@ -81,7 +127,8 @@ void CdlodQuadTreeNode::selectNodes(const glm::vec3& cam_pos,
       cc[i] = children_[i]->collidesWithSphere(sphere);
       if (cc[i]) {
         // Ask child to render what we can't
-        children_[i]->selectNodes(cam_pos, frustum, grid_mesh, thread_pool);
+        children_[i]->selectNodes(cam_pos, frustum, lod_distance, pixel_scale,
+                                  grid_mesh, tile_loader);
       }
     }
 
@@ -94,12 +141,45 @@ void CdlodQuadTreeNode::selectNodes(const glm::vec3& cam_pos,
 }
 
 
+const StreamedTextureInfo& CdlodQuadTreeNode::resolveTextures(
+    const glm::vec3& cam_pos, const Silice3D::Frustum& frustum,
+    TileLoader& tile_loader) {
+  if (has_cached_selection_) {
+    bool valid = true;
+    for (int i = 0; i < TextureSelection::kSourceCount; ++i) {
+      const CdlodQuadTreeNode* source = cached_selection_.sources[i];
+      valid = valid && source->texture_.residency_generation ==
+                       cached_selection_.residency_generations[i];
+    }
+    if (valid) {
+      if (virtual_texture_cache_) {
+        for (int i = 0; i < TextureSelection::kSourceCount; ++i) {
+          virtual_texture_cache_->touch(cached_selection_.sources[i]->texture_);
+        }
+      }
+      return cached_selection_.texinfo;
+    }
+  }
+
+  cached_selection_ = TextureSelection{};
+  selectTexture(cam_pos, frustum, tile_loader, cached_selection_, true);
+  has_cached_selection_ = cached_selection_.complete;
+  return cached_selection_.texinfo;
+}
+
+void CdlodQuadTreeNode::setSelectionSource(TextureSelection& selection,
+                                           int index) {
+  selection.sources[index] = this;
+  selection.residency_generations[index] = texture_.residency_generation;
+}
+
 void CdlodQuadTreeNode::selectTexture(const glm::vec3& cam_pos,
                                       const Silice3D::Frustum& frustum,
-                                      Silice3D::ThreadPool& thread_pool,
-                                      StreamedTextureInfo& texinfo,
+                                      TileLoader& tile_loader,
+                                      TextureSelection& selection,
                                       bool is_node_visible,
                                       int recursion_level /*= 0*/) {
+  StreamedTextureInfo& texinfo = selection.texinfo;
   bool need_geometry = (texinfo.geometry_current == nullptr);
   bool need_normal   = (texinfo.normal_current == nullptr);
   bool need_diffuse  = (texinfo.diffuse_current == nullptr);
@@ -114,18 +194,24 @@ void CdlodQuadTreeNode::selectTexture(const glm::vec3& cam_pos,
       loadTexture(true);
       upload();
     }
+    if (virtual_texture_cache_) {
+      virtual_texture_cache_->touch(texture_);
+    }
 
     if (need_geometry) {
       texinfo.geometry_current = &texture_.elevation;
       texinfo.geometry_next = &texture_.elevation;
+      setSelectionSource(selection, 0);
     }
     if (need_normal) {
-      texinfo.normal_current = &texture_.elevation;
-      texinfo.normal_next = &texture_.elevation;
+      texinfo.normal_current = &texture_.normal;
+      texinfo.normal_next = &texture_.normal;
+      setSelectionSource(selection, 1);
     }
     if (need_diffuse) {
       texinfo.diffuse_current = &texture_.diffuse;
       texinfo.diffuse_next = &texture_.diffuse;
+      setSelectionSource(selection, 2);
     }
 
     return;
@@ -144,7 +230,12 @@ void CdlodQuadTreeNode::selectTexture(const glm::vec3& cam_pos,
     }
 
     if (texture_.is_loaded_to_gpu) {
-      assert(parent_->texture_.is_loaded_to_gpu);
+      // With virtual texturing, the parent might have been evicted, the
+      // page table falls back to the closest resident ancestor then.
+      assert(virtual_texture_cache_ || parent_->texture_.is_loaded_to_gpu);
+      if (virtual_texture_cache_) {
+        virtual_texture_cache_->touch(texture_);
+      }
 
       if (can_use_geometry) {
         texinfo.geometry_current = &texture_.elevation;
@@ -153,32 +244,98 @@ void CdlodQuadTreeNode::selectTexture(const glm::vec3& cam_pos,
         } else {
           texinfo.geometry_next = &texture_.elevation;
         }
+        setSelectionSource(selection, 0);
       }
 
       if (can_use_normal) {
-        texinfo.normal_current = &texture_.elevation;
-        texinfo.normal_next = &parent_->texture_.elevation;
+        texinfo.normal_current = &texture_.normal;
+        texinfo.normal_next = &parent_->texture_.normal;
+        setSelectionSource(selection, 1);
       }
 
       if (can_use_diffuse) {
         texinfo.diffuse_current = &texture_.diffuse;
         texinfo.diffuse_next = &parent_->texture_.diffuse;
+        setSelectionSource(selection, 2);
       }
     } else {
       // this one should be used, but not yet loaded -> start async load, but
-      // make do with the parent for now.
-      is_enqued_for_async_load_ = true;
-      int priority = level_ + (is_node_visible ? 0 : 2);
-      thread_pool.enqueue(priority, [this](){
-        loadTexture(false);
-        is_enqued_for_async_load_ = false;
-      });
+      // make do with the parent for now. The loader is cleared every frame,
+      // so the jobs are re-enqueued with their current priority.
+      selection.complete = false;
+      enqueueLoad(tile_loader, level_ + (is_node_visible ? 0 : 2));
     }
   }
 
   if (is_node_visible) {
-    parent_->selectTexture(cam_pos, frustum, thread_pool,
-                           texinfo, is_node_visible, recursion_level+1);
+    parent_->selectTexture(cam_pos, frustum, tile_loader,
+                           selection, is_node_visible, recursion_level+1);
+  }
+}
+
+CdlodQuadTreeNode* CdlodQuadTreeNode::child(int i) {
+  if (!children_[i]) {
+    initChild(i);
+  }
+  return children_[i].get();
+}
+
+CdlodQuadTreeNode* CdlodQuadTreeNode::descendant(const TileId& id) {
+  if (id.face != face_ || id.level > level_) {
+    return nullptr;
+  }
+
+  CdlodQuadTreeNode* node = this;
+  while (node->level_ > id.level) {
+    // see initChild for the order of the children
+    int i = (id.x > node->x_ ? 1 : 0) + (id.z < node->z_ ? 2 : 0);
+    node = node->child(i);
+    if (!node->hasElevationTexture() && !node->hasDiffuseTexture()) {
+      return nullptr;
+    }
+  }
+  if (std::abs(node->x_ - id.x) > 0.5 || std::abs(node->z_ - id.z) > 0.5) {
+    return nullptr;
+  }
+  return node;
+}
+
+void CdlodQuadTreeNode::enqueueLoad(TileLoader& tile_loader, int priority,
+                                    std::shared_ptr<TileFiles> files) {
+  if (is_enqued_for_async_load_) {
+    return;
+  }
+
+  is_enqued_for_async_load_ = true;
+  unsigned generation = MemoryAccounting::Enqueued(memoryStatsLevel());
+  TileLoader::Job job;
+  job.priority = priority;
+  if (!files) {
+    job.paths = texturePaths();
+  }
+  job.decode = [this, generation, files](TileFiles& read_files) {
+    MemoryAccounting::Dequeued(memoryStatsLevel(), generation);
+    loadTexture(false, files ? std::move(*files) : std::move(read_files));
+    is_enqued_for_async_load_ = false;
+  };
+  job.cancel = [this]() {
+    is_enqued_for_async_load_ = false;
+  };
+  tile_loader.enqueue(std::move(job));
+}
+
+void CdlodQuadTreeNode::collectResidentTiles(
+    std::vector<SnapshotTile>& tiles) const {
+  if (texture_.is_loaded_to_gpu) {
+    SnapshotTile tile;
+    tile.id = tileId();
+    tile.paths = texturePaths();
+    tiles.push_back(std::move(tile));
+  }
+  for (const auto& child : children_) {
+    if (child) {
+      child->collectResidentTiles(tiles);
+    }
   }
 }
 
@@ -199,12 +356,13 @@ void CdlodQuadTreeNode::age() {
 
 std::string CdlodQuadTreeNode::getDiffuseMapPath() const {
   assert(hasDiffuseTexture());
-  return std::string{"/media/icecool/Data/LoE_datasets/diffuse/blue_marble_next_gen/cube"}
+  return std::string{"/media/icecool/Data/LoE_datasets/diffuse/blue_marble_next_gen/"}
+         + (CdlodTerrainSettings::kCompressedDiffuse ? "cube_bc1" : "cube")
          + "/" + std::to_string(int(face_))
          + "/" + std::to_string(diffuseTextureLevel())
          + "/" + std::to_string(long(x_) >> CdlodTerrainSettings::kDiffuseToElevationLevelOffset)
          + "/" + std::to_string(long(z_) >> CdlodTerrainSettings::kDiffuseToElevationLevelOffset)
-         + ".png";
+         + (CdlodTerrainSettings::kCompressedDiffuse ? ".ktx" : ".png");
 }
 
 
@@ -215,7 +373,17 @@ std::string CdlodQuadTreeNode::getHeightMapPath() const {
          + "/" + std::to_string(elevationTextureLevel())
          + "/" + std::to_string(long(x_))
          + "/" + std::to_string(long(z_))
-         + ".png";
+         + (CdlodTerrainSettings::kPrecomputedMipmaps ? ".ktx" : ".png");
+}
+
+std::string CdlodQuadTreeNode::getNormalMapPath() const {
+  assert(hasElevationTexture());
+  return std::string{"/media/icecool/Data/LoE_datasets/normal/gmted2010_75/cube"}
+         + "/" + std::to_string(int(face_))
+         + "/" + std::to_string(elevationTextureLevel())
+         + "/" + std::to_string(long(x_))
+         + "/" + std::to_string(long(z_))
+         + (CdlodTerrainSettings::kPrecomputedMipmaps ? ".ktx" : ".png");
 }
 
 int CdlodQuadTreeNode::elevationTextureLevel() const {
@@ -234,15 +402,55 @@ bool CdlodQuadTreeNode::hasDiffuseTexture() const {
   return CdlodTerrainSettings::kLevelOffset <= diffuseTextureLevel();
 }
 
-void CdlodQuadTreeNode::loadTexture(bool synchronous_load) {
+const TileMetadataRecord::Height* CdlodQuadTreeNode::heightMetadata() const {
+  if (!metadata_ || !hasElevationTexture()) {
+    return nullptr;
+  }
+  return metadata_->height(elevationTextureLevel(), long(x_), long(z_));
+}
+
+// The record of the node has the diffuse tile, that covers the same area as
+// its elevation tile (so it's one level below it in the diffuse dataset).
+const TileMetadataRecord::Diffuse* CdlodQuadTreeNode::diffuseMetadata() const {
+  if (!metadata_ || !hasDiffuseTexture()) {
+    return nullptr;
+  }
+  return metadata_->diffuse(elevationTextureLevel(), long(x_), long(z_));
+}
+
+std::vector<std::string> CdlodQuadTreeNode::texturePaths() const {
+  std::vector<std::string> paths;
+  if (hasElevationTexture()) {
+    const TileMetadataRecord::Height* metadata = heightMetadata();
+    if (!metadata || !(metadata->flags & kTileMetadataConstant)) {
+      // the heights of an evicted tile are still in the memory
+      if (!texture_.is_evicted) {
+        paths.push_back(getHeightMapPath());
+      }
+      paths.push_back(getNormalMapPath());
+    }
+  }
+  if (hasDiffuseTexture()) {
+    const TileMetadataRecord::Diffuse* metadata = diffuseMetadata();
+    if (!metadata || !(metadata->flags & kTileMetadataConstant)) {
+      paths.push_back(getDiffuseMapPath());
+    }
+  }
+  return paths;
+}
+
+void CdlodQuadTreeNode::loadTexture(bool synchronous_load, TileFiles files) {
   if (parent_ && !parent_->texture_.is_loaded_to_memory) {
+    TraceScope trace{"Parent load"};
     parent_->loadTexture(true);
   }
   if (texture_.is_loaded_to_memory) {
     return;
   }
 
+  TraceScope trace{"loadTexture"};
   if (synchronous_load) {
+    TraceScope lock_trace{"Lock wait"};
     texture_.load_mutex.lock();
   } else {
     if (!texture_.load_mutex.try_lock()) {
@@ -254,132 +462,314 @@ void CdlodQuadTreeNode::loadTexture(bool synchronous_load) {
   if (!texture_.is_loaded_to_memory) {
     try {
       if (hasElevationTexture()) {
-        std::vector<unsigned char> data;
-        unsigned width, height;
-        std::string path = getHeightMapPath();
-        unsigned error = lodepng::decode(data, width, height, path, LCT_GREY, 16);
-        if (error) {
-          std::cerr << "Image decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
-          throw std::runtime_error("Image decoder error");
-        }
-        assert(width == CdlodTerrainSettings::kElevationTexSizeWithBorders);
-        assert(height == CdlodTerrainSettings::kElevationTexSizeWithBorders);
-        assert(data.size()%2 == 0);
-        texture_.elevation_data.resize(data.size()/2);
-        // Big endian decoding!
-        for (int i = 0; i < data.size()/2; ++i) {
-          texture_.elevation_data[i] = data[2*i]*256 + data[2*i+1];
+        if (texture_.is_evicted) {
+          // the heights (and so the min/max) didn't change
+          loadNormals(files);
+        } else {
+          loadElevation(files);
+          TraceScope min_max_trace{"Min/max"};
+          calculateMinMax();
         }
-  	    calculateMinMax();
       }
 
       if (hasDiffuseTexture()) {
-        std::vector<unsigned char> data;
-        unsigned width, height;
-        std::string path = getDiffuseMapPath();
-        // TODO: masik overloadot talalni, aminel nem kell masolni
-        unsigned error = lodepng::decode(data, width, height, path, LCT_RGB, 8);
-        if (error) {
-          std::cerr << "Image decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
-          throw std::runtime_error("Image decoder error");
-        }
-        assert(width == CdlodTerrainSettings::kDiffuseTexSizeWithBorders);
-        assert(height == CdlodTerrainSettings::kDiffuseTexSizeWithBorders);
-        assert(data.size()%3 == 0);
-        texture_.diffuse_data.resize(data.size()/3);
-        std::memcpy(texture_.diffuse_data.data(), data.data(), data.size());
+        loadDiffuse(files);
       }
     } catch (std::exception& ex) {
       std::cout << ex.what() << std::endl;
       std::terminate();
     }
 
+    texture_.is_evicted = false;
     texture_.is_loaded_to_memory = true;
+    CdlodTerrainSettings::tile_loads_count++;
+    updateDecodedMemory();
   }
 
   texture_.load_mutex.unlock();
 }
 
+void CdlodQuadTreeNode::loadElevation(TileFiles& files) {
+  const TileMetadataRecord::Height* metadata = heightMetadata();
+  int size = CdlodTerrainSettings::kElevationTexSizeWithBorders;
+  bool mipmapped = CdlodTerrainSettings::kPrecomputedMipmaps;
+  loadNormals(files);
+
+  if (metadata && (metadata->flags & kTileMetadataConstant)) {
+    GLushort height = metadata->min;
+    CreateConstantTexture(&height, sizeof(height), size, GL_R16, GL_RED,
+                          GL_UNSIGNED_SHORT, mipmapped, texture_.elevation_data);
+    return;
+  }
+
+  std::string height_path = getHeightMapPath();
+  if (mipmapped) {
+    DecodeKtx(files.take(height_path), height_path, texture_.elevation_data);
+  } else {
+    DecodePng(files.take(height_path), height_path, LCT_GREY, 16, size,
+              GL_R16, GL_RED, GL_UNSIGNED_SHORT, texture_.elevation_data);
+  }
+
+  if (metadata) {
+    TraceScope trace{"Checksum"};
+    static_assert(CdlodTerrainSettings::kElevationTexSizeWithBorders *
+                  sizeof(GLushort) % 4 == 0, "The rows must not be padded");
+    const TextureData& data = texture_.elevation_data;
+    uint32_t checksum = TileChecksum(data.bytes.data() + data.levels[0].offset,
+                                     size * size * sizeof(GLushort));
+    if (checksum != metadata->checksum) {
+      std::cerr << height_path << " doesn't match its metadata, the "
+                << "sidecar is probably stale" << std::endl;
+    }
+  }
+}
+
+void CdlodQuadTreeNode::loadNormals(TileFiles& files) {
+  const TileMetadataRecord::Height* metadata = heightMetadata();
+  int size = CdlodTerrainSettings::kElevationTexSizeWithBorders;
+  bool mipmapped = CdlodTerrainSettings::kPrecomputedMipmaps;
+
+  if (metadata && (metadata->flags & kTileMetadataConstant)) {
+    // A flat tile, its normals all point upwards (the x and z components
+    // are encoded as unorm8s).
+    const GLubyte normal[2] = {128, 128};
+    CreateConstantTexture(normal, sizeof(normal), size, GL_RG8, GL_RG,
+                          GL_UNSIGNED_BYTE, mipmapped, texture_.normal_data);
+    return;
+  }
+
+  std::string path = getNormalMapPath();
+  if (mipmapped) {
+    DecodeKtx(files.take(path), path, texture_.normal_data);
+  } else {
+    DecodePng(files.take(path), path, LCT_GREY_ALPHA, 8, size,
+              GL_RG8, GL_RG, GL_UNSIGNED_BYTE, texture_.normal_data);
+  }
+}
+
+void CdlodQuadTreeNode::loadDiffuse(TileFiles& files) {
+  const TileMetadataRecord::Diffuse* metadata = diffuseMetadata();
+  int size = CdlodTerrainSettings::kDiffuseTexSizeWithBorders;
+
+  if (metadata && (metadata->flags & kTileMetadataConstant)) {
+    if (CdlodTerrainSettings::kCompressedDiffuse) {
+      CreateConstantBC1Texture(metadata->bc1_block, size,
+                               texture_.diffuse_data);
+    } else {
+      CreateConstantTexture(metadata->color, sizeof(metadata->color), size,
+                            GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, false,
+                            texture_.diffuse_data);
+    }
+    return;
+  }
+
+  std::string path = getDiffuseMapPath();
+  if (CdlodTerrainSettings::kCompressedDiffuse) {
+    DecodeKtx(files.take(path), path, texture_.diffuse_data);
+  } else {
+    DecodePng(files.take(path), path, LCT_RGB, 8, size,
+              GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, texture_.diffuse_data);
+  }
+}
+
 void CdlodQuadTreeNode::upload() {
+  FrameProfiler::ScopedCpuTimer timer{FrameStage::kUpload};
   loadTexture(true);
+  if (virtual_texture_cache_) {
+    uploadToVirtualTexture();
+    return;
+  }
   if (parent_ && !parent_->texture_.is_loaded_to_gpu) {
     parent_->upload();
   }
 
   if (!texture_.is_loaded_to_gpu) {
+    FrameProfiler::ScopedGpuSpan gpu_span{FrameStage::kUpload};
+    size_t resident_bytes = 0;
     if (hasElevationTexture()) {
       refreshMinMax();
-
-      gl::Bind(texture_.elevation.handle);
-      texture_.elevation.handle.upload(
-          gl::kR16, CdlodTerrainSettings::kElevationTexSizeWithBorders,
-          CdlodTerrainSettings::kElevationTexSizeWithBorders, gl::kRed,
-          gl::kUnsignedShort, texture_.elevation_data.data());
-
-      texture_.elevation.handle.generateMipmap();
-      texture_.elevation.handle.maxAnisotropy();
-      texture_.elevation.handle.minFilter(gl::kLinearMipmapLinear);
-      texture_.elevation.handle.magFilter(gl::kLinear);
-      texture_.elevation.handle.wrapS(gl::kClampToEdge);
-      texture_.elevation.handle.wrapT(gl::kClampToEdge);
-
-      texture_.elevation.handle.makeBindless();
-      texture_.elevation.handle.makeResident();
-      gl::Unbind(texture_.elevation.handle);
-
-      double scale = static_cast<double>(CdlodTerrainSettings::kElevationTexSizeWithBorders)
-                   / static_cast<double>(CdlodTerrainSettings::kTextureDimension);
-      texture_.elevation.size = scale * size();
-      texture_.elevation.position = glm::vec2(x_ - texture_.elevation.size/2,
-                                              z_ - texture_.elevation.size/2);
-
-      texture_.elevation_data.clear();
+      resident_bytes += GpuMemorySize(texture_.elevation_data) +
+                        GpuMemorySize(texture_.normal_data);
+
+      // The elevation data is kept in the memory (level 0 alone is about
+      // 137 KB, it's counted as decoded memory), the descendants use it to
+      // calculate their min/max heights. The std::vector, that it was
+      // before, kept its capacity when it was cleared here, and the
+      // descendants read the stale heights from it, but a cleared
+      // TextureData gives back its buffer.
+      uploadTexture(texture_.elevation, texture_.elevation_data,
+                    CdlodTerrainSettings::kElevationTexSizeWithBorders);
+
+      uploadTexture(texture_.normal, texture_.normal_data,
+                    CdlodTerrainSettings::kElevationTexSizeWithBorders);
+      texture_.normal_data.clear();
     }
 
     if (hasDiffuseTexture()) {
-      gl::Bind(texture_.diffuse.handle);
-      texture_.diffuse.handle.upload(
-          gl::kRgb8, CdlodTerrainSettings::kDiffuseTexSizeWithBorders,
-          CdlodTerrainSettings::kDiffuseTexSizeWithBorders, gl::kRgb,
-          gl::kUnsignedByte, texture_.diffuse_data.data());
-
-      texture_.diffuse.handle.generateMipmap();
-      texture_.diffuse.handle.maxAnisotropy();
-      texture_.diffuse.handle.minFilter(gl::kLinearMipmapLinear);
-      texture_.diffuse.handle.magFilter(gl::kLinear);
-      texture_.diffuse.handle.wrapS(gl::kClampToEdge);
-      texture_.diffuse.handle.wrapT(gl::kClampToEdge);
-
-      texture_.diffuse.handle.makeBindless();
-      texture_.diffuse.handle.makeResident();
-
-      double scale = static_cast<double>(CdlodTerrainSettings::kDiffuseTexSizeWithBorders)
-                   / static_cast<double>(CdlodTerrainSettings::kTextureDimension);
-      texture_.diffuse.size = scale * size();
-      texture_.diffuse.position = glm::vec2(x_ - texture_.diffuse.size/2,
-                                            z_ - texture_.diffuse.size/2);
-
+      resident_bytes += GpuMemorySize(texture_.diffuse_data);
+      uploadTexture(texture_.diffuse, texture_.diffuse_data,
+                    CdlodTerrainSettings::kDiffuseTexSizeWithBorders);
       texture_.diffuse_data.clear();
     }
 
     texture_.is_loaded_to_gpu = true;
+    texture_.residency_generation++;
     CdlodTerrainSettings::texture_nodes_count++;
+    CdlodTerrainSettings::tile_uploads_count++;
+    updateResidentMemory(resident_bytes);
+    updateDecodedMemory();
   }
 }
 
+void CdlodQuadTreeNode::uploadToVirtualTexture() {
+  if (texture_.is_loaded_to_gpu) {
+    return;
+  }
+
+  FrameProfiler::ScopedGpuSpan gpu_span{FrameStage::kUpload};
+  // the layers of the page that are written
+  size_t resident_bytes = GpuMemorySize(texture_.elevation_data) +
+                          GpuMemorySize(texture_.normal_data) +
+                          GpuMemorySize(texture_.diffuse_data);
+
+  // The roots are always needed as the last fallback, so they are pinned.
+  long tile_x = long(x_ / size()), tile_z = long(z_ / size());
+  if (!virtual_texture_cache_->upload(face_, elevationTextureLevel(),
+                                      tile_x, tile_z, texture_,
+                                      parent_ == nullptr)) {
+    return; // every page is in use, try again in the next frame
+  }
+
+  refreshMinMax();
+  texture_.normal_data.clear();
+  texture_.diffuse_data.clear();
+
+  texture_.is_loaded_to_gpu = true;
+  texture_.residency_generation++;
+  CdlodTerrainSettings::texture_nodes_count++;
+  CdlodTerrainSettings::tile_uploads_count++;
+  updateResidentMemory(resident_bytes);
+  updateDecodedMemory();
+}
+
+void CdlodQuadTreeNode::uploadTexture(TextureBaseInfo& texture,
+                                      const TextureData& data,
+                                      int size_with_borders) {
+  gl::Bind(texture.handle);
+  UploadTextureData(texture.handle, data);
+  texture.handle.maxAnisotropy();
+  texture.handle.minFilter(gl::kLinearMipmapLinear);
+  texture.handle.magFilter(gl::kLinear);
+  texture.handle.wrapS(gl::kClampToEdge);
+  texture.handle.wrapT(gl::kClampToEdge);
+
+  texture.handle.makeBindless();
+  texture.handle.makeResident();
+  gl::Unbind(texture.handle);
+
+  double scale = static_cast<double>(size_with_borders)
+               / static_cast<double>(CdlodTerrainSettings::kTextureDimension);
+  texture.size = scale * size();
+  texture.position = glm::vec2(x_ - texture.size/2, z_ - texture.size/2);
+}
+
 bool CdlodQuadTreeNode::collidesWithSphere(const Silice3D::Sphere& sphere) const {
   return bbox_.collidesWithSphere(sphere);
 }
 
+double CdlodQuadTreeNode::geometricError() const {
+  // The vertices of the node sample the elevation texture of the same level.
+  double error = texture_.max_h - texture_.min_h;
+  if (metadata_) {
+    int texel_error = metadata_->geometricError(level_, long(x_), long(z_));
+    if (texel_error >= 0) {
+      error = std::min(error, texel_error * CdlodTerrainSettings::kMaxHeight /
+                              std::numeric_limits<GLushort>::max());
+    }
+  }
+
+  // The triangles are chords of the sphere, even if the terrain is flat.
+  double spacing = scale();
+  return error + spacing*spacing / (8*CdlodTerrainSettings::kSphereRadius);
+}
+
+// The error is smaller on the screen than the threshold, if the node is
+// farther than error * pixel_scale / threshold. The neighbours of the node
+// might be subdivided, their vertices on the common edge are T-junctions
+// then: the morphing doesn't change (the node morphs by its own level, the
+// neighbours aren't fully morphed at the edge), so the surface isn't
+// continuous there. The gaps are under the threshold, and the skirts of the
+// nodes (see GridMesh) are deeper than that, so the sky doesn't show through.
+bool CdlodQuadTreeNode::isGeometricErrorVisible(const glm::vec3& cam_pos,
+                                                double pixel_scale) const {
+  if (pixel_scale <= 0) {
+    return true;
+  }
+
+  double radius = geometricError() * pixel_scale /
+                  CdlodTerrainSettings::kMaxGeometricErrorInPixels;
+  return bbox_.collidesWithSphere(Silice3D::Sphere(cam_pos, radius));
+}
+
+// The tiles of the node are accounted at the level of its elevation tile.
+int CdlodQuadTreeNode::memoryStatsLevel() const {
+  return std::max(std::min(elevationTextureLevel(),
+                           CdlodTerrainSettings::kMaxTextureLevel), 0);
+}
+
+void CdlodQuadTreeNode::updateDecodedMemory() {
+  size_t decoded_bytes = texture_.elevation_data.memory_size() +
+                         texture_.normal_data.memory_size() +
+                         texture_.diffuse_data.memory_size();
+  MemoryAccounting::Update(memoryStatsLevel(), MemoryTier::kDecoded,
+                           texture_.decoded_bytes, decoded_bytes);
+  texture_.decoded_bytes = decoded_bytes;
+}
+
+void CdlodQuadTreeNode::updateResidentMemory(size_t resident_bytes) {
+  MemoryAccounting::Update(memoryStatsLevel(), MemoryTier::kResident,
+                           texture_.resident_bytes, resident_bytes);
+  texture_.resident_bytes = resident_bytes;
+}
+
 void CdlodQuadTreeNode::calculateMinMax() {
   if (!texture_.elevation_data.empty()) {
     texture_.min_max_src = this;
   } else if (parent_ && parent_->texture_.min_max_src) {
     texture_.min_max_src = parent_->texture_.min_max_src;
+  }
+
+  // The sidecar has the exact range of the tile, that is at least as tight
+  // as the one from the texels of the tile or its ancestors.
+  if (const TileMetadataRecord::Height* metadata = heightMetadata()) {
+    setMinMax(metadata->min, metadata->max);
+  } else if (texture_.min_max_src) {
+    calculateMinMaxFromTexels();
+  } else if (parent_ && parent_->texture_.min <= parent_->texture_.max) {
+    // the range of the parent (if it's known) contains this one's, and it's
+    // still better than the whole height range
+    setMinMax(parent_->texture_.min, parent_->texture_.max);
   } else {
     return; // no elevation info from the parents -> nothing to do
   }
 
+  for (auto& child : children_) {
+    if (child && !child->texture_.is_loaded_to_memory) {
+      child->calculateMinMax();
+    }
+  }
+}
+
+void CdlodQuadTreeNode::setMinMax(GLushort min, GLushort max) {
+  texture_.min = min;
+  texture_.max = max;
+  texture_.min_h = texture_.min * CdlodTerrainSettings::kMaxHeight /
+                   std::numeric_limits<GLushort>::max();
+  texture_.max_h = texture_.max * CdlodTerrainSettings::kMaxHeight /
+                   std::numeric_limits<GLushort>::max();
+}
+
+void CdlodQuadTreeNode::calculateMinMaxFromTexels() {
   auto& src = texture_.min_max_src;
   int texSize = CdlodTerrainSettings::kTextureDimension;
   int texSizeWBorder = CdlodTerrainSettings::kElevationTexSizeWithBorders;
@@ -396,28 +786,19 @@ void CdlodQuadTreeNode::calculateMinMax() {
   glm::ivec2 min_coord = glm::ivec2(floor((this_min - src_min) * src_to_tex_scale));
   glm::ivec2 max_coord = glm::ivec2(ceil ((this_max - src_min) * src_to_tex_scale));
 
-  texture_.min = std::numeric_limits<GLushort>::max();
-  texture_.max = std::numeric_limits<GLushort>::min();
+  GLushort min = std::numeric_limits<GLushort>::max();
+  GLushort max = std::numeric_limits<GLushort>::min();
 
-  auto& data = src->texture_.elevation_data;
+  const GLushort* data = src->texture_.elevation_data.level0<GLushort>();
   for (int x = min_coord.x; x < max_coord.x; ++x) {
     for (int y = min_coord.y; y < max_coord.y; ++y) {
       GLushort height = data[y*texSizeWBorder + x];
-      texture_.min = std::min(texture_.min, height);
-      texture_.max = std::max(texture_.max, height);
+      min = std::min(min, height);
+      max = std::max(max, height);
     }
   }
 
-  texture_.min_h = texture_.min * CdlodTerrainSettings::kMaxHeight /
-                   std::numeric_limits<GLushort>::max();
-  texture_.max_h = texture_.max * CdlodTerrainSettings::kMaxHeight /
-                   std::numeric_limits<GLushort>::max();
-
-  for (auto& child : children_) {
-    if (child && !child->texture_.is_loaded_to_memory) {
-      child->calculateMinMax();
-    }
-  }
+  setMinMax(min, max);
 }
 
 void CdlodQuadTreeNode::refreshMinMax() {
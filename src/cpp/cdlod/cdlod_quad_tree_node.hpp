@@ -3,34 +3,89 @@
 #ifndef ENGINE_CDLOD_QUAD_TREE_NODE_H_
 #define ENGINE_CDLOD_QUAD_TREE_NODE_H_
 
+#include <atomic>
 #include <memory>
-#include <Silice3D/common/thread_pool.hpp>
+#include <vector>
 
 #include "cdlod/geometry/quad_grid_mesh.hpp"
+#include "cdlod/residency_snapshot.hpp"
 #include "cdlod/texture_info.hpp"
+#include "cdlod/tile_metadata.hpp"
+#include "cdlod/tile_loader.hpp"
 #include "cdlod/cdlod_terrain_settings.hpp"
 #include "cdlod/collision/spherized_aabb.hpp"
 
 namespace Cdlod {
 
+class VirtualTextureCache;
+
 class CdlodQuadTreeNode {
  public:
   CdlodQuadTreeNode(double x, double z, CubeFace face, int level,
-                    CdlodQuadTreeNode* parent = nullptr);
+                    CdlodQuadTreeNode* parent = nullptr,
+                    VirtualTextureCache* virtual_texture_cache = nullptr,
+                    const TileMetadata* metadata = nullptr);
   ~CdlodQuadTreeNode();
 
-  CdlodQuadTreeNode(CdlodQuadTreeNode&&) = default;
+  CdlodQuadTreeNode(CdlodQuadTreeNode&& other);
 
   void age();
+
+  int level() const { return level_; }
+  TileId tileId() const { return TileId{face_, level_, x_, z_}; }
+
+  // The child is created if it doesn't exist yet.
+  CdlodQuadTreeNode* child(int i);
+  // The node of the tile, created with the nodes on the path to it if they
+  // don't exist yet. Returns null if the tile isn't below this node, or if it
+  // doesn't have textures.
+  CdlodQuadTreeNode* descendant(const TileId& id);
+  bool hasElevationTexture() const;
+  bool hasDiffuseTexture() const;
+  bool isLoadedToMemory() const { return texture_.is_loaded_to_memory; }
+  bool isLoadedToGpu() const { return texture_.is_loaded_to_gpu; }
+
+  // Starts an async load of the tiles of the node (the smaller the priority,
+  // the sooner), unless it's already enqueued. If files are given, those are
+  // decoded instead of reading them (the missing ones are still read).
+  void enqueueLoad(TileLoader& tile_loader, int priority,
+                   std::shared_ptr<TileFiles> files = nullptr);
+  // Loads the tiles synchronously if they aren't loaded yet. With virtual
+  // texturing it fails if every page is in use.
+  void upload();
+
+  // Appends the tiles of the subtree that are loaded to the GPU.
+  void collectResidentTiles(std::vector<SnapshotTile>& tiles) const;
+
+  // lod_distance is the LOD range of the level 0 nodes (see
+  // kSmallestGeometryLodDistance). pixel_scale is the size of a unit long
+  // object on the screen (in pixels) from unit distance, or 0 if the nodes
+  // shouldn't be selected by their geometric error.
   void selectNodes(const glm::vec3& cam_pos,
                    const Silice3D::Frustum& frustum,
+                   double lod_distance,
+                   double pixel_scale,
                    QuadGridMesh& grid_mesh,
-                   Silice3D::ThreadPool& thread_pool);
-
+                   TileLoader& tile_loader);
+
+  // The textures that selectTexture found for a node, and the nodes whose
+  // tiles they are (in the order of geometry, normal, diffuse).
+  struct TextureSelection {
+    static constexpr int kSourceCount = 3;
+
+    StreamedTextureInfo texinfo;
+    CdlodQuadTreeNode* sources[kSourceCount] = {};
+    unsigned residency_generations[kSourceCount] = {};
+    // false if a tile that should have been used wasn't resident yet
+    bool complete = true;
+  };
+
+  // Walks up the parent chain for the nearest usable tiles, uploads the
+  // loaded ones, and enqueues the missing ones.
   void selectTexture(const glm::vec3& cam_pos,
                      const Silice3D::Frustum& frustum,
-                     Silice3D::ThreadPool& thread_pool,
-                     StreamedTextureInfo& texinfo,
+                     TileLoader& tile_loader,
+                     TextureSelection& selection,
                      bool is_node_visible,
                      int recursion_level = 0);
 
@@ -40,12 +95,23 @@ class CdlodQuadTreeNode {
   int level_;
   SpherizedAABBDivided bbox_;
   CdlodQuadTreeNode* parent_;
+  VirtualTextureCache* virtual_texture_cache_; // null if not used
+  const TileMetadata* metadata_; // null if not used
   std::unique_ptr<CdlodQuadTreeNode> children_[4];
   int last_used_ = 0;
-  bool is_enqued_for_async_load_ = false;
+  // set on the render thread, cleared by the loader (a decode worker, or the
+  // render thread if the job is cancelled)
+  std::atomic<bool> is_enqued_for_async_load_{false};
 
   TextureInfo texture_;
 
+  // The last complete texture selection of the node. The result of the walk
+  // can only change when one of its source tiles is evicted (the nodes
+  // closer to this one are too detailed for that texture), so it is reused
+  // as long as the residency generations of the sources don't change.
+  TextureSelection cached_selection_;
+  bool has_cached_selection_ = false;
+
   // If a node is not used for this much time (frames), it will be unloaded.
   static constexpr int kTimeToLiveInMemory = 1 << 12;
 
@@ -56,19 +122,49 @@ class CdlodQuadTreeNode {
 
   bool collidesWithSphere(const Silice3D::Sphere& sphere) const;
 
+  // The textures of a visible node for this frame, from the cached
+  // selection if it's still valid, otherwise from selectTexture.
+  const StreamedTextureInfo& resolveTextures(const glm::vec3& cam_pos,
+                                             const Silice3D::Frustum& frustum,
+                                             TileLoader& tile_loader);
+  void setSelectionSource(TextureSelection& selection, int index);
+
+  // The largest height error of the grid of this node, compared to the full
+  // resolution data (in model space units).
+  double geometricError() const;
+  bool isGeometricErrorVisible(const glm::vec3& cam_pos,
+                               double pixel_scale) const;
+
   void initChild(int i);
   std::string getHeightMapPath() const;
+  std::string getNormalMapPath() const;
   std::string getDiffuseMapPath() const;
 
   int elevationTextureLevel() const;
   int diffuseTextureLevel() const;
 
-  bool hasElevationTexture() const;
-  bool hasDiffuseTexture() const;
-
-  void loadTexture(bool synchronous_load);
-  void upload();
+  // The records of the tiles of this node in the metadata sidecar, or null
+  // if they aren't known.
+  const TileMetadataRecord::Height* heightMetadata() const;
+  const TileMetadataRecord::Diffuse* diffuseMetadata() const;
+
+  // The files that loadTexture reads (the constant tiles aren't read).
+  std::vector<std::string> texturePaths() const;
+  // The files that aren't prefetched, are read by the calling thread.
+  void loadTexture(bool synchronous_load, TileFiles files = TileFiles{});
+  void uploadToVirtualTexture();
+  void uploadTexture(TextureBaseInfo& texture, const TextureData& data,
+                     int size_with_borders);
+  // the heights and the normals
+  void loadElevation(TileFiles& files);
+  void loadNormals(TileFiles& files);
+  void loadDiffuse(TileFiles& files);
+  int memoryStatsLevel() const;
+  void updateDecodedMemory();
+  void updateResidentMemory(size_t resident_bytes);
   void calculateMinMax();
+  void calculateMinMaxFromTexels();
+  void setMinMax(GLushort min, GLushort max);
   void refreshMinMax();
 };
 
@@ -1,24 +1,54 @@
 // Copyright (c), Tamas Csala
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <unordered_set>
 #include <Silice3D/common/make_unique.hpp>
 
 #include "cdlod/cdlod_terrain.hpp"
 #include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/frame_profiler.hpp"
+#include "cdlod/memory_stats.hpp"
 
 namespace Cdlod {
 
+constexpr size_t CdlodTerrain::kWarmUpUploadsPerStep;
+
+static std::unique_ptr<VirtualTextureCache> CreateVirtualTextureCache() {
+  if (!CdlodTerrainSettings::virtual_texturing) {
+    return nullptr;
+  }
+
+  // the page arrays store every level of a tile, and the diffuse pages are BC1
+  if (!CdlodTerrainSettings::kPrecomputedMipmaps ||
+      !CdlodTerrainSettings::kCompressedDiffuse) {
+    throw std::logic_error("Cdlod::CdlodTerrain: virtual texturing requires "
+                           "the precomputed mipmaps and compressed diffuse "
+                           "textures.");
+  }
+
+  return Silice3D::make_unique<VirtualTextureCache>();
+}
+
 CdlodTerrain::CdlodTerrain(Silice3D::ShaderManager* manager)
-    : faces_{
-        {CdlodTerrainSettings::kFaceSize, CubeFace::kPosX},
-        {CdlodTerrainSettings::kFaceSize, CubeFace::kNegX},
-        {CdlodTerrainSettings::kFaceSize, CubeFace::kPosY},
-        {CdlodTerrainSettings::kFaceSize, CubeFace::kNegY},
-        {CdlodTerrainSettings::kFaceSize, CubeFace::kPosZ},
-        {CdlodTerrainSettings::kFaceSize, CubeFace::kNegZ}
+    : virtual_texture_cache_(CreateVirtualTextureCache())
+    , faces_{
+        {CdlodTerrainSettings::kFaceSize, CubeFace::kPosX, virtual_texture_cache_.get()},
+        {CdlodTerrainSettings::kFaceSize, CubeFace::kNegX, virtual_texture_cache_.get()},
+        {CdlodTerrainSettings::kFaceSize, CubeFace::kPosY, virtual_texture_cache_.get()},
+        {CdlodTerrainSettings::kFaceSize, CubeFace::kNegY, virtual_texture_cache_.get()},
+        {CdlodTerrainSettings::kFaceSize, CubeFace::kPosZ, virtual_texture_cache_.get()},
+        {CdlodTerrainSettings::kFaceSize, CubeFace::kNegZ, virtual_texture_cache_.get()}
       }
-    , thread_pool_{4}
+    , tile_loader_{CdlodTerrainSettings::loader_io_depth,
+                   CdlodTerrainSettings::loader_decode_threads}
 { }
 
+CdlodTerrain::~CdlodTerrain() {
+  glDeleteQueries(2, fragment_queries_);
+}
+
 void CdlodTerrain::Setup(const gl::Program& program) {
   program_ = &program;
 
@@ -27,6 +57,90 @@ void CdlodTerrain::Setup(const gl::Program& program) {
   mesh_.setupPositions(program | "Terrain_aPosition");
   mesh_.setupRenderData(program | "Terrain_aRenderData");
 
+  if (!virtual_texture_cache_) {
+    setupTextureAttribs(program);
+  }
+
+  uCamPos_ = Silice3D::make_unique<gl::LazyUniform<glm::vec3>>(
+      program, "Terrain_uCamPos");
+  uSmallestGeometryLodDistance_ = Silice3D::make_unique<gl::LazyUniform<GLfloat>>(
+      program, "Terrain_uSmallestGeometryLodDistance");
+  uSmallestTextureLodDistance_ = Silice3D::make_unique<gl::LazyUniform<GLfloat>>(
+      program, "Terrain_uSmallestTextureLodDistance");
+  uSkirtDepthScale_ = Silice3D::make_unique<gl::LazyUniform<GLfloat>>(
+      program, "Terrain_uSkirtDepthScale");
+
+  setupVertexUniforms(program);
+  setupFragmentUniforms(program);
+
+  glGenQueries(2, fragment_queries_);
+}
+
+void CdlodTerrain::SetupDepthPrepass(const gl::Program& program) {
+  depth_program_ = &program;
+
+  gl::Use(program);
+
+  uDepthPrepassCamPos_ = Silice3D::make_unique<gl::LazyUniform<glm::vec3>>(
+      program, "Terrain_uCamPos");
+  uDepthPrepassSmallestGeometryLodDistance_ =
+      Silice3D::make_unique<gl::LazyUniform<GLfloat>>(
+          program, "Terrain_uSmallestGeometryLodDistance");
+  uDepthPrepassSkirtDepthScale_ =
+      Silice3D::make_unique<gl::LazyUniform<GLfloat>>(
+          program, "Terrain_uSkirtDepthScale");
+
+  setupVertexUniforms(program);
+}
+
+void CdlodTerrain::setupVertexUniforms(const gl::Program& program) {
+  gl::Uniform<int>(program, "Terrain_uMaxHeight") =
+      int(CdlodTerrainSettings::kMaxHeight);
+
+  gl::Uniform<glm::ivec2>(program, "Terrain_uTexSize") =
+      glm::ivec2(CdlodTerrainSettings::kFaceSize, CdlodTerrainSettings::kFaceSize);
+
+  gl::Uniform<float>(program, "Terrain_uSmallestGeometryLodDistance") =
+      float(CdlodTerrainSettings::kSmallestGeometryLodDistance);
+
+  gl::Uniform<int>(program, "Terrain_uLevelOffset") =
+      int(CdlodTerrainSettings::kLevelOffset);
+
+  gl::Uniform<int>(program, "Terrain_uMaxLoadLevel") =
+      faces_[0].max_node_level();
+
+  gl::Uniform<int>(program, "Terrain_uTextureDimensionWBorders") =
+      int(CdlodTerrainSettings::kElevationTexSizeWithBorders);
+
+  if (virtual_texture_cache_) {
+    gl::UniformSampler(program, "Terrain_uElevationPages").set(kVirtualTextureUnit + 0);
+    gl::UniformSampler(program, "Terrain_uPageTable").set(kVirtualTextureUnit + 3);
+
+    gl::Uniform<int>(program, "Terrain_uTextureDimension") =
+        int(CdlodTerrainSettings::kTextureDimension);
+
+    gl::Uniform<int>(program, "Terrain_uMaxTextureLevel") =
+        int(CdlodTerrainSettings::kMaxTextureLevel);
+  }
+}
+
+void CdlodTerrain::setupFragmentUniforms(const gl::Program& program) {
+  gl::Uniform<float>(program, "Terrain_uSmallestTextureLodDistance") =
+      float(CdlodTerrainSettings::kSmallestTextureLodDistance);
+
+  gl::Uniform<int>(program, "Terrain_uTextureDimension") =
+      int(CdlodTerrainSettings::kTextureDimension);
+
+  if (virtual_texture_cache_) {
+    gl::UniformSampler(program, "Terrain_uNormalPages").set(kVirtualTextureUnit + 1);
+    gl::UniformSampler(program, "Terrain_uDiffusePages").set(kVirtualTextureUnit + 2);
+
+    gl::Uniform<int>(program, "Terrain_uDiffuseTextureDimensionWBorders") =
+        int(CdlodTerrainSettings::kDiffuseTexSizeWithBorders);
+  }
+}
+
+void CdlodTerrain::setupTextureAttribs(const gl::Program& program) {
   mesh_.setupCurrentGeometryTextureIds(
       program | "Terrain_aCurrentGeometryTextureId");
   mesh_.setupCurrentGeometryTexturePosAndSize(
@@ -53,33 +167,6 @@ void CdlodTerrain::Setup(const gl::Program& program) {
       program | "Terrain_aNextDiffuseTextureId");
   mesh_.setupNextDiffuseTexturePosAndSize(
       program | "Terrain_aNextDiffuseTexturePosAndSize");
-
-  uCamPos_ = Silice3D::make_unique<gl::LazyUniform<glm::vec3>>(
-      program, "Terrain_uCamPos");
-
-  gl::Uniform<int>(program, "Terrain_uMaxHeight") =
-      int(CdlodTerrainSettings::kMaxHeight);
-
-  gl::Uniform<glm::ivec2>(program, "Terrain_uTexSize") =
-      glm::ivec2(CdlodTerrainSettings::kFaceSize, CdlodTerrainSettings::kFaceSize);
-
-  gl::Uniform<float>(program, "Terrain_uSmallestGeometryLodDistance") =
-      float(CdlodTerrainSettings::kSmallestGeometryLodDistance);
-
-  gl::Uniform<float>(program, "Terrain_uSmallestTextureLodDistance") =
-      float(CdlodTerrainSettings::kSmallestTextureLodDistance);
-
-  gl::Uniform<int>(program, "Terrain_uLevelOffset") =
-      int(CdlodTerrainSettings::kLevelOffset);
-
-  gl::Uniform<int>(program, "Terrain_uMaxLoadLevel") =
-      faces_[0].max_node_level();
-
-  gl::Uniform<int>(program, "Terrain_uTextureDimension") =
-      int(CdlodTerrainSettings::kTextureDimension);
-
-  gl::Uniform<int>(program, "Terrain_uTextureDimensionWBorders") =
-      int(CdlodTerrainSettings::kElevationTexSizeWithBorders);
 }
 
 void CdlodTerrain::Render(const Silice3D::ICamera& cam) {
@@ -89,21 +176,223 @@ void CdlodTerrain::Render(const Silice3D::ICamera& cam) {
   }
 
   uCamPos_->set(cam.transform().pos());
+  updateLodDistances(cam);
 
   gl::FrontFace(gl::kCcw);
   gl::TemporaryEnable cullface{gl::kCullFace};
 
-  thread_pool_.clear();
+  double pixel_scale =
+      CdlodTerrainSettings::roughness_aware_lod ? pixel_scale_ : 0;
+
+  tile_loader_.clear();
+  MemoryAccounting::ClearQueue();
   CdlodTerrainSettings::geom_nodes_count = 0;
+  // The GPU time of the uploads is measured around the upload calls only
+  // (see CdlodQuadTreeNode::upload), not around the whole traversal.
   if (CdlodTerrainSettings::update) {
     mesh_.clearRenderList();
     for (int face = 0; face < 6; ++face) {
-      faces_[face].render(cam, mesh_, thread_pool_);
+      faces_[face].render(cam, geometry_lod_distance_, pixel_scale, mesh_,
+                          tile_loader_);
     }
   }
+  if (virtual_texture_cache_) {
+    FrameProfiler::ScopedCpuTimer cpu_timer{FrameStage::kUpload};
+    FrameProfiler::ScopedGpuSpan gpu_span{FrameStage::kUpload};
+    virtual_texture_cache_->update();
+  }
+  if (CdlodTerrainSettings::render && CdlodTerrainSettings::sort_front_to_back) {
+    FrameProfiler::ScopedCpuTimer cpu_timer{FrameStage::kSelection};
+    mesh_.sortFrontToBack(cam.transform().pos());
+  }
   if (CdlodTerrainSettings::render) {
+    FrameProfiler::ScopedCpuTimer cpu_timer{FrameStage::kTerrainDraw};
+    FrameProfiler::ScopedGpuTimer gpu_timer{FrameStage::kTerrainDraw};
+    if (virtual_texture_cache_) {
+      virtual_texture_cache_->bind(kVirtualTextureUnit);
+    }
+
+    bool depth_prepass = CdlodTerrainSettings::depth_prepass && depth_program_;
+    // the depth state of the other passes is restored after the terrain
+    GLint depth_func = GL_LESS;
+    GLboolean depth_mask = GL_TRUE;
+    if (depth_prepass) {
+      glGetIntegerv(GL_DEPTH_FUNC, &depth_func);
+      glGetBooleanv(GL_DEPTH_WRITEMASK, &depth_mask);
+      renderDepthPrepass(cam);
+    }
+
+    // The query of this slot was issued two frames ago. Its result is
+    // dropped if the GPU hasn't finished it yet, to avoid waiting for it.
+    GLuint query = fragment_queries_[current_query_];
+    if (fragment_query_issued_[current_query_]) {
+      GLint available = 0;
+      glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (available) {
+        GLuint fragments_count = 0;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &fragments_count);
+        CdlodTerrainSettings::fragments_count = fragments_count;
+      }
+      fragment_query_issued_[current_query_] = false;
+    }
+    glBeginQuery(GL_SAMPLES_PASSED, query);
     mesh_.render();
+    glEndQuery(GL_SAMPLES_PASSED);
+    fragment_query_issued_[current_query_] = true;
+    current_query_ = 1 - current_query_;
+
+    if (depth_prepass) {
+      gl::DepthMask(depth_mask == GL_TRUE);
+      glDepthFunc(depth_func);
+    }
+
+    if (virtual_texture_cache_) {
+      virtual_texture_cache_->unbind(kVirtualTextureUnit);
+    }
+  }
+}
+
+void CdlodTerrain::ScreenResized(size_t /*width*/, size_t height) {
+  screen_height_ = height;
+}
+
+TerrainMemoryStats CdlodTerrain::memoryStats() const {
+  return MemoryAccounting::Snapshot();
+}
+
+std::vector<SnapshotTile> CdlodTerrain::ResidentTiles() const {
+  std::vector<SnapshotTile> tiles;
+  for (const CdlodQuadTree& face : faces_) {
+    face.root().collectResidentTiles(tiles);
+  }
+  return tiles;
+}
+
+void CdlodTerrain::StartWarmUp(const std::vector<SnapshotTile>& snapshot_tiles) {
+  warm_up_nodes_.clear();
+  warm_up_uploaded_ = 0;
+
+  std::vector<CdlodQuadTreeNode*> level_nodes;
+  for (CdlodQuadTree& face : faces_) {
+    level_nodes.push_back(&face.root());
+  }
+  for (int level = 0; level < CdlodTerrainSettings::warm_up_levels; ++level) {
+    std::vector<CdlodQuadTreeNode*> next_level_nodes;
+    for (CdlodQuadTreeNode* node : level_nodes) {
+      if (!node->hasElevationTexture()) {
+        continue;
+      }
+      // the upper levels are loaded first, as the lower ones need their
+      // parents' data for the min/max heights
+      warm_up_nodes_.push_back(node);
+      node->enqueueLoad(tile_loader_, level);
+      for (int i = 0; i < 4; ++i) {
+        next_level_nodes.push_back(node->child(i));
+      }
+    }
+    std::swap(level_nodes, next_level_nodes);
+  }
+
+  std::unordered_set<CdlodQuadTreeNode*> warm_up_node_set{
+      warm_up_nodes_.begin(), warm_up_nodes_.end()};
+  for (const SnapshotTile& tile : snapshot_tiles) {
+    CdlodQuadTree& face = faces_[int(tile.id.face)];
+    CdlodQuadTreeNode* node = face.root().descendant(tile.id);
+    if (!node || !warm_up_node_set.insert(node).second) {
+      continue;
+    }
+    warm_up_nodes_.push_back(node);
+    node->enqueueLoad(tile_loader_, face.root().level() - node->level(),
+                      tile.files);
+  }
+  // parents first (the snapshot is in depth first order)
+  std::stable_sort(warm_up_nodes_.begin(), warm_up_nodes_.end(),
+                   [](CdlodQuadTreeNode* a, CdlodQuadTreeNode* b) {
+    return a->level() > b->level();
+  });
+}
+
+bool CdlodTerrain::WarmUpStep(WarmUpProgress* progress) {
+  // The nodes are uploaded in order, so the parents are already resident
+  // (the upload of a node would upload its parent too, without the budget).
+  size_t uploads = 0;
+  while (warm_up_uploaded_ < warm_up_nodes_.size() &&
+         uploads < kWarmUpUploadsPerStep) {
+    CdlodQuadTreeNode* node = warm_up_nodes_[warm_up_uploaded_];
+    if (!node->isLoadedToMemory()) {
+      break;
+    }
+    node->upload();
+    if (!node->isLoadedToGpu()) {
+      // every virtual texture page is in use, the rest is uploaded on demand
+      warm_up_nodes_.resize(warm_up_uploaded_);
+      break;
+    }
+    warm_up_uploaded_++;
+    uploads++;
   }
+
+  if (progress) {
+    progress->total = warm_up_nodes_.size();
+    progress->uploaded = warm_up_uploaded_;
+    progress->loaded = warm_up_uploaded_;
+    for (size_t i = warm_up_uploaded_; i < warm_up_nodes_.size(); ++i) {
+      progress->loaded += warm_up_nodes_[i]->isLoadedToMemory();
+    }
+  }
+
+  if (warm_up_uploaded_ == warm_up_nodes_.size()) {
+    warm_up_nodes_.clear();
+    warm_up_uploaded_ = 0;
+    return false;
+  }
+  if (uploads == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return true;
+}
+
+// A grid cell of a level L node is 2^L large, and it's used until
+// lod_distance * 2^L, so it's pixel_scale / lod_distance pixels large there,
+// independently of the level. The textures are selected by the geometry
+// nodes, so their LOD ranges are scaled by the same amount.
+void CdlodTerrain::updateLodDistances(const Silice3D::ICamera& cam) {
+  pixel_scale_ = cam.projectionMatrix()[1][1] * screen_height_ / 2.0;
+
+  geometry_lod_distance_ = CdlodTerrainSettings::kSmallestGeometryLodDistance;
+  if (CdlodTerrainSettings::screen_space_lod && pixel_scale_ > 0) {
+    geometry_lod_distance_ = glm::clamp(
+        pixel_scale_ / CdlodTerrainSettings::kTargetGridCellSizeInPixels,
+        CdlodTerrainSettings::kMinGeometryLodDistance,
+        CdlodTerrainSettings::kMaxGeometryLodDistance);
+  }
+  double texture_lod_distance = geometry_lod_distance_ *
+      CdlodTerrainSettings::kSmallestTextureLodDistance /
+      CdlodTerrainSettings::kSmallestGeometryLodDistance;
+
+  uSmallestGeometryLodDistance_->set(float(geometry_lod_distance_));
+  uSmallestTextureLodDistance_->set(float(texture_lod_distance));
+
+  skirt_depth_scale_ = pixel_scale_ > 0 ?
+      CdlodTerrainSettings::kSkirtDepthInPixels / pixel_scale_ : 0;
+  uSkirtDepthScale_->set(float(skirt_depth_scale_));
+}
+
+// Fills the depth buffer with a depth only program, then sets up the depth
+// test so the main pass only shades the fragments that are visible.
+void CdlodTerrain::renderDepthPrepass(const Silice3D::ICamera& cam) {
+  gl::Use(*depth_program_);
+  uDepthPrepassCamPos_->set(cam.transform().pos());
+  uDepthPrepassSmallestGeometryLodDistance_->set(float(geometry_lod_distance_));
+  uDepthPrepassSkirtDepthScale_->set(float(skirt_depth_scale_));
+
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  mesh_.render();
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+  gl::Use(*program_);
+  glDepthFunc(GL_LEQUAL);
+  gl::DepthMask(false);
 }
 
 } // namespace Cdlod
@@ -3,29 +3,89 @@
 #ifndef ENGINE_CDLOD_TERRAIN_H_
 #define ENGINE_CDLOD_TERRAIN_H_
 
+#include <vector>
 #include <glad/glad.h>
 #include <oglwrap/oglwrap.h>
 #include <Silice3D/shaders/shader_manager.hpp>
-#include <Silice3D/common/thread_pool.hpp>
 
 #include "cdlod/cdlod_quad_tree.hpp"
+#include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/memory_stats.hpp"
+#include "cdlod/residency_snapshot.hpp"
+#include "cdlod/tile_loader.hpp"
+#include "cdlod/virtual_texture_cache.hpp"
 
 namespace Cdlod {
 
+struct WarmUpProgress {
+  size_t loaded = 0, uploaded = 0, total = 0;
+};
+
 class CdlodTerrain {
  public:
   explicit CdlodTerrain(Silice3D::ShaderManager* manager);
+  ~CdlodTerrain();
   void Setup(const gl::Program& program);
+  // The program of the depth pre-pass has to use the same vertex shader as
+  // the main one (the vertex attributes have explicit locations).
+  void SetupDepthPrepass(const gl::Program& program);
   void Render(const Silice3D::ICamera& cam);
+  void ScreenResized(size_t width, size_t height);
+  TerrainMemoryStats memoryStats() const;
+
+  // The tiles that are loaded to the GPU, for a residency snapshot.
+  std::vector<SnapshotTile> ResidentTiles() const;
+
+  // Enqueues the tiles of the top warm_up_levels texture levels of every
+  // face (see CdlodTerrainSettings), starting from the roots, and the tiles
+  // of a residency snapshot (with their saved files, if there are any).
+  // WarmUpStep has to be called until it returns false, on the render
+  // thread, before the first Render call.
+  void StartWarmUp(const std::vector<SnapshotTile>& snapshot_tiles = {});
+  // Uploads the next loaded tiles (at most kWarmUpUploadsPerStep, parents
+  // first), or waits a bit for them if there isn't any. Returns false when
+  // every tile is uploaded.
+  bool WarmUpStep(WarmUpProgress* progress);
 
  private:
+  static constexpr GLuint kVirtualTextureUnit = 0;
+  // The uploads are spread over the frames of the loading screen.
+  static constexpr size_t kWarmUpUploadsPerStep = 8;
 
   QuadGridMesh mesh_;
+  std::unique_ptr<VirtualTextureCache> virtual_texture_cache_; // has to be inited before faces_
   CdlodQuadTree faces_[6];
-  Silice3D::ThreadPool thread_pool_;
+  TileLoader tile_loader_; // has to be destroyed before faces_
   const gl::Program* program_;
-  std::unique_ptr<gl::LazyUniform<glm::vec3>> uCamPos_;
+  const gl::Program* depth_program_ = nullptr;
+  std::unique_ptr<gl::LazyUniform<glm::vec3>> uCamPos_, uDepthPrepassCamPos_;
+  std::unique_ptr<gl::LazyUniform<GLfloat>> uSmallestGeometryLodDistance_,
+                                            uSmallestTextureLodDistance_,
+                                            uDepthPrepassSmallestGeometryLodDistance_;
+  std::unique_ptr<gl::LazyUniform<GLfloat>> uSkirtDepthScale_,
+                                            uDepthPrepassSkirtDepthScale_;
   std::unique_ptr<gl::LazyUniform<GLfloat>> uNodeDimension_;
+
+  GLuint fragment_queries_[2] = {};
+  bool fragment_query_issued_[2] = {};
+  int current_query_ = 0;
+
+  size_t screen_height_ = 0;
+  // the size of a unit long object from unit distance on the screen
+  double pixel_scale_ = 0;
+  double geometry_lod_distance_ = CdlodTerrainSettings::kSmallestGeometryLodDistance;
+  // the depth of the skirts at unit distance
+  double skirt_depth_scale_ = 0;
+
+  // the warmed up nodes of every face, the upper levels first
+  std::vector<CdlodQuadTreeNode*> warm_up_nodes_;
+  size_t warm_up_uploaded_ = 0;
+
+  void setupTextureAttribs(const gl::Program& program);
+  void setupVertexUniforms(const gl::Program& program);
+  void setupFragmentUniforms(const gl::Program& program);
+  void renderDepthPrepass(const Silice3D::ICamera& cam);
+  void updateLodDistances(const Silice3D::ICamera& cam);
 };
 
 } // namespace Cdlod
@@ -4,7 +4,19 @@
 
 bool CdlodTerrainSettings::render = true;
 bool CdlodTerrainSettings::update = true;
+bool CdlodTerrainSettings::virtual_texturing = false;
+int CdlodTerrainSettings::loader_io_depth = 0;
+int CdlodTerrainSettings::loader_decode_threads = 0;
+bool CdlodTerrainSettings::huge_page_tile_buffers = false;
+int CdlodTerrainSettings::warm_up_levels = 3;
+bool CdlodTerrainSettings::sort_front_to_back = false;
+bool CdlodTerrainSettings::depth_prepass = false;
+bool CdlodTerrainSettings::screen_space_lod = true;
+bool CdlodTerrainSettings::roughness_aware_lod = true;
 
 size_t CdlodTerrainSettings::geom_nodes_count = 0;
 size_t CdlodTerrainSettings::texture_nodes_count = 0;
+size_t CdlodTerrainSettings::fragments_count = 0;
+std::atomic<size_t> CdlodTerrainSettings::tile_loads_count{0};
+size_t CdlodTerrainSettings::tile_uploads_count = 0;
 
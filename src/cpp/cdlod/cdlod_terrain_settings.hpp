@@ -3,6 +3,7 @@
 #ifndef CDLOD_TERRAIN_SETTINGS_HPP_
 #define CDLOD_TERRAIN_SETTINGS_HPP_
 
+#include <atomic>
 #include <climits>
 #include <cstddef>
 
@@ -37,7 +38,11 @@ namespace CdlodTerrainSettings {
   static constexpr long kGeomDiv = 2;
 
   // The resolution of the heightmap
-  static constexpr long kFaceSize = 65536;
+  static constexpr int kFaceSizeExp = 16;
+  static constexpr long kFaceSize = 1 << kFaceSizeExp;
+
+  // The level of the elevation tile, that covers a whole face
+  static constexpr int kMaxTextureLevel = kFaceSizeExp - kTextureDimensionExp;
 
   // The radius of the sphere made of the heightmap
   static constexpr double kSphereRadius = kFaceSize / 2;
@@ -48,9 +53,87 @@ namespace CdlodTerrainSettings {
 
   static constexpr bool kWireFrame = false;
 
+  // Use the BC1 compressed diffuse tiles (with precomputed mipmaps) instead
+  // of the png ones. They take 6x less GPU memory and upload bandwidth.
+  static constexpr bool kCompressedDiffuse = true;
+
+  // Use the elevation and normal tiles with a precomputed mipmap chain (KTX),
+  // instead of generating the mipmaps on the render thread after each upload.
+  // The precomputed mipmaps also use the same (Catmull-Rom) filter as the
+  // preprocessor, while the drivers use a box filter.
+  static constexpr bool kPrecomputedMipmaps = true;
+
+  // The number of tiles the virtual texture's physical page cache can hold
+  // (every page has an elevation, a normal and a diffuse layer).
+  static constexpr int kVirtualTexturePageCount = 256;
+
+  // Sample the tiles through a page table from a fixed size page cache instead
+  // of using a bindless texture per tile. This doesn't need any extension, so
+  // it works with software GL too. It has to be set before the terrain is
+  // created, and it needs the tiles with precomputed mipmaps.
+  extern bool virtual_texturing;
+
+  // The number of tile reads in flight (0 means the default of the I/O
+  // backend, 16 for io_uring and 4 for blocking reads), and the number of the
+  // threads that decode the tiles (0 means a thread per core, except the
+  // render thread's).
+  // They have to be set before the terrain is created.
+  extern int loader_io_depth;
+  extern int loader_decode_threads;
+
+  // Back the pool of the tile buffers with huge pages (the reserved ones if
+  // there are any, otherwise the transparent ones), so that the streamed
+  // tiles cause fewer TLB misses. It has to be set before the first tile is
+  // loaded.
+  extern bool huge_page_tile_buffers;
+
+  // The number of the texture levels from the top, whose tiles are loaded
+  // (in parallel on the loader threads) and uploaded behind the loading
+  // screen, see CdlodTerrain::StartWarmUp. 0 disables the warm-up.
+  extern int warm_up_levels;
+
+  // Draw the instances ordered by their distance from the camera.
+  extern bool sort_front_to_back;
+
+  // Draw the terrain with a depth only shader first, so that the expensive
+  // terrain fragment shader only runs for the visible fragments.
+  extern bool depth_prepass;
+
+  // Derive the LOD ranges from the camera and the screen instead of using the
+  // fixed ones above: they are scaled so that a grid cell of a node is
+  // kTargetGridCellSizeInPixels large on the screen at the end of the LOD
+  // range of the node (and the textures are scaled with the geometry). The
+  // default target gives the fixed ranges on a 1080 pixel high screen, with a
+  // 60 degree vertical field of view.
+  extern bool screen_space_lod;
+  static constexpr double kTargetGridCellSizeInPixels = 14.6;
+  // the limits of the derived kSmallestGeometryLodDistance
+  static constexpr double kMinGeometryLodDistance = kNodeDimension;
+  static constexpr double kMaxGeometryLodDistance = 8*kSmallestGeometryLodDistance;
+
+  // Stop subdividing the nodes whose geometric error (the height error of
+  // their grid compared to the full resolution data, see the metadata
+  // sidecar) is smaller on the screen than kMaxGeometricErrorInPixels. Flat
+  // areas, like the oceans, are rendered with much fewer nodes then (but
+  // also with their coarser normal and diffuse tiles).
+  // The edges of such a node have T-junctions with its subdivided
+  // neighbours, the skirts of the nodes cover the gaps there (see GridMesh).
+  // It can be toggled with keypad 5.
+  extern bool roughness_aware_lod;
+  static constexpr double kMaxGeometricErrorInPixels = 0.5;
+  // The gap between two nodes is at most the sum of their errors, so under
+  // a pixel. The skirts are twice as deep, as the morphing of the nodes can
+  // move their edges a bit further apart.
+  static constexpr double kSkirtDepthInPixels = 4*kMaxGeometricErrorInPixels;
+
   // statistics
   extern bool render, update;
   extern size_t geom_nodes_count, texture_nodes_count;
+  // shaded by the terrain in the latest measured frame (usually two frames ago)
+  extern size_t fragments_count;
+  // since the start, the loads are counted on the loader threads
+  extern std::atomic<size_t> tile_loads_count;
+  extern size_t tile_uploads_count;
 
   static_assert(3 <= kNodeDimensionExp && kNodeDimensionExp <= 8, "");
   static_assert(kNodeDimension <= kSmallestGeometryLodDistance, "");
@@ -0,0 +1,207 @@
+// Copyright (c), Tamas Csala
+
+#include <cassert>
+#include <algorithm>
+
+#include "cdlod/frame_profiler.hpp"
+#include "cdlod/trace.hpp"
+
+namespace Cdlod {
+
+constexpr size_t FrameProfiler::kWindowSize;
+
+const char* FrameStageName(FrameStage stage) {
+  switch (stage) {
+    case FrameStage::kSelection: return "Selection";
+    case FrameStage::kAge: return "Age";
+    case FrameStage::kUpload: return "Upload";
+    case FrameStage::kTerrainDraw: return "Terrain draw";
+    case FrameStage::kPostProcess: return "Post-process";
+    default: return "";
+  }
+}
+
+FrameProfiler& FrameProfiler::Get() {
+  static FrameProfiler profiler;
+  return profiler;
+}
+
+void FrameProfiler::nextFrame() {
+  assert(cpu_stack_.empty());
+  for (int i = 0; i < kStageCount; ++i) {
+    cpu_samples_[i].add(
+        std::chrono::duration<double, std::milli>(cpu_frame_[i]).count());
+    cpu_frame_[i] = Clock::duration::zero();
+  }
+  frame_++;
+  collectGpuSpans();
+
+  if (Trace::enabled) {
+    if (frame_ > 1) {
+      Trace::End("Frame");
+    }
+    Trace::Begin("Frame");
+  }
+}
+
+StageTimings FrameProfiler::cpuTimings(FrameStage stage) const {
+  return cpu_samples_[int(stage)].timings();
+}
+
+StageTimings FrameProfiler::gpuTimings(FrameStage stage) const {
+  return gpu_samples_[int(stage)].timings();
+}
+
+void FrameProfiler::beginCpu(FrameStage stage) {
+  Clock::time_point now = Clock::now();
+  if (!cpu_stack_.empty()) {
+    cpu_frame_[int(cpu_stack_.back())] += now - cpu_start_;
+  }
+  cpu_stack_.push_back(stage);
+  cpu_start_ = now;
+
+  if (Trace::enabled) {
+    Trace::Begin(FrameStageName(stage));
+  }
+}
+
+void FrameProfiler::endCpu() {
+  assert(!cpu_stack_.empty());
+  if (Trace::enabled) {
+    Trace::End(FrameStageName(cpu_stack_.back()));
+  }
+
+  Clock::time_point now = Clock::now();
+  cpu_frame_[int(cpu_stack_.back())] += now - cpu_start_;
+  cpu_stack_.pop_back();
+  // the outer timer continues from here
+  cpu_start_ = now;
+}
+
+void FrameProfiler::beginGpu(FrameStage stage) {
+  assert(!gpu_timer_active_);
+  GpuQueries& queries = gpu_queries_[int(stage)];
+  if (queries.ids[0] == 0) {
+    glGenQueries(2, queries.ids);
+  }
+
+  // the query of this slot was issued two frames ago
+  int slot = frame_ % 2;
+  GLuint query = queries.ids[slot];
+  if (queries.issued[slot]) {
+    GLint available = 0;
+    glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint64 elapsed_ns = 0;
+      glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+      gpu_samples_[int(stage)].add(elapsed_ns / 1e6);
+    }
+    queries.issued[slot] = false;
+  }
+
+  glBeginQuery(GL_TIME_ELAPSED, query);
+  gpu_timer_active_ = true;
+}
+
+void FrameProfiler::endGpu(FrameStage stage) {
+  assert(gpu_timer_active_);
+  glEndQuery(GL_TIME_ELAPSED);
+  gpu_queries_[int(stage)].issued[frame_ % 2] = true;
+  gpu_timer_active_ = false;
+}
+
+void FrameProfiler::beginGpuSpan(FrameStage stage) {
+  assert(gpu_span_queries_[int(stage)].used[frame_ % 2] % 2 == 0);
+  issueTimestamp(stage);
+}
+
+void FrameProfiler::endGpuSpan(FrameStage stage) {
+  assert(gpu_span_queries_[int(stage)].used[frame_ % 2] % 2 == 1);
+  issueTimestamp(stage);
+}
+
+void FrameProfiler::issueTimestamp(FrameStage stage) {
+  GpuSpanQueries& queries = gpu_span_queries_[int(stage)];
+  int slot = frame_ % 2;
+  std::vector<GLuint>& ids = queries.ids[slot];
+  if (queries.used[slot] == ids.size()) {
+    // two at once, so that the pairs are never split
+    ids.resize(ids.size() + 2);
+    glGenQueries(2, &ids[ids.size() - 2]);
+  }
+  glQueryCounter(ids[queries.used[slot]++], GL_TIMESTAMP);
+  queries.enabled = true;
+}
+
+void FrameProfiler::collectGpuSpans() {
+  // the slot of the frame two frames ago, that is reused by this frame
+  int slot = frame_ % 2;
+  for (int i = 0; i < kStageCount; ++i) {
+    GpuSpanQueries& queries = gpu_span_queries_[i];
+    if (!queries.enabled) {
+      continue;
+    }
+    size_t used = queries.used[slot];
+    queries.used[slot] = 0;
+    if (frame_ < 2) {
+      continue;  // the slot wasn't used yet
+    }
+
+    bool available = true;
+    for (size_t j = 0; j < used && available; ++j) {
+      GLint result_available = 0;
+      glGetQueryObjectiv(queries.ids[slot][j], GL_QUERY_RESULT_AVAILABLE,
+                         &result_available);
+      available = result_available;
+    }
+    if (!available) {
+      continue;  // the sample of this frame is dropped
+    }
+
+    GLuint64 sum_ns = 0;
+    for (size_t j = 0; j + 1 < used; j += 2) {
+      GLuint64 begin_ns = 0, end_ns = 0;
+      glGetQueryObjectui64v(queries.ids[slot][j], GL_QUERY_RESULT, &begin_ns);
+      glGetQueryObjectui64v(queries.ids[slot][j+1], GL_QUERY_RESULT, &end_ns);
+      sum_ns += end_ns - begin_ns;
+    }
+    gpu_samples_[i].add(sum_ns / 1e6);
+  }
+}
+
+void FrameProfiler::Samples::add(double ms) {
+  if (window_.size() < kWindowSize) {
+    window_.push_back(ms);
+  } else {
+    window_[next_] = ms;
+  }
+  next_ = (next_ + 1) % kWindowSize;
+
+  sum_ += ms;
+  max_ = std::max(max_, ms);
+  last_ = ms;
+  count_++;
+}
+
+StageTimings FrameProfiler::Samples::timings() const {
+  StageTimings timings;
+  if (window_.empty()) {
+    return timings;
+  }
+
+  std::vector<float> sorted = window_;
+  std::sort(sorted.begin(), sorted.end());
+  auto percentile = [&sorted](double p) {
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+  };
+  timings.p50 = percentile(0.50);
+  timings.p95 = percentile(0.95);
+  timings.p99 = percentile(0.99);
+  timings.avg = sum_ / count_;
+  timings.max = max_;
+  timings.last = last_;
+  timings.valid = true;
+  return timings;
+}
+
+} // namespace Cdlod
@@ -0,0 +1,155 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_FRAME_PROFILER_H_
+#define ENGINE_CDLOD_FRAME_PROFILER_H_
+
+#include <chrono>
+#include <vector>
+#include <glad/glad.h>
+
+namespace Cdlod {
+
+enum class FrameStage {
+  kSelection,    // the node selection and the sorting of the instances
+                 // (without the uploads and the aging)
+  kAge,          // unloading the unused nodes
+  kUpload,       // the texture uploads and the page table update
+  kTerrainDraw,  // the depth pre-pass and the main pass of the terrain
+  kPostProcess,  // the scattering pass
+  kCount
+};
+
+const char* FrameStageName(FrameStage stage);
+
+// The timings of a stage in milliseconds. The percentiles are over the last
+// kWindowSize frames, the average and the maximum are over the whole run.
+struct StageTimings {
+  double p50 = 0, p95 = 0, p99 = 0;
+  double avg = 0, max = 0;
+  double last = 0;  // the latest sample
+  bool valid = false;  // false until the first sample
+};
+
+// Measures the CPU time of the stages of the frames with scoped timers, and
+// their GPU time with GL_TIME_ELAPSED queries (or with GL_TIMESTAMP pairs
+// around the parts of a stage, that are spread over other work). The queries are double
+// buffered: a query is read two frames after it was issued, and only if its
+// result is available, so it never stalls the pipeline (the results that
+// aren't ready are dropped). It should be used only from the render thread.
+// The CPU timers and the frames are recorded in the trace too, if it's enabled.
+class FrameProfiler {
+ public:
+  static constexpr size_t kWindowSize = 256;
+
+  static FrameProfiler& Get();
+
+  // Has to be called once per frame, it closes the CPU timings of the
+  // previous frame.
+  void nextFrame();
+
+  StageTimings cpuTimings(FrameStage stage) const;
+  StageTimings gpuTimings(FrameStage stage) const;
+
+  // The timers can be nested, the time of the inner one isn't counted in the
+  // outer one (for ex. the uploads during the node selection).
+  class ScopedCpuTimer {
+   public:
+    explicit ScopedCpuTimer(FrameStage stage) { Get().beginCpu(stage); }
+    ~ScopedCpuTimer() { Get().endCpu(); }
+    ScopedCpuTimer(const ScopedCpuTimer&) = delete;
+    ScopedCpuTimer& operator=(const ScopedCpuTimer&) = delete;
+  };
+
+  // GL_TIME_ELAPSED queries can't be nested, and a stage can be measured only
+  // once per frame.
+  class ScopedGpuTimer {
+   public:
+    explicit ScopedGpuTimer(FrameStage stage) : stage_(stage) {
+      Get().beginGpu(stage);
+    }
+    ~ScopedGpuTimer() { Get().endGpu(stage_); }
+    ScopedGpuTimer(const ScopedGpuTimer&) = delete;
+    ScopedGpuTimer& operator=(const ScopedGpuTimer&) = delete;
+
+   private:
+    FrameStage stage_;
+  };
+
+  // Measures a part of a stage with a pair of GL_TIMESTAMP queries, the
+  // parts are summed per frame. Unlike ScopedGpuTimer, it can be used any
+  // number of times per frame, and inside the ScopedGpuTimer of another
+  // stage, but the spans can't be nested. A stage should be measured either
+  // with spans or with ScopedGpuTimer. The frames without any span of the
+  // stage count as zero.
+  class ScopedGpuSpan {
+   public:
+    explicit ScopedGpuSpan(FrameStage stage) : stage_(stage) {
+      Get().beginGpuSpan(stage);
+    }
+    ~ScopedGpuSpan() { Get().endGpuSpan(stage_); }
+    ScopedGpuSpan(const ScopedGpuSpan&) = delete;
+    ScopedGpuSpan& operator=(const ScopedGpuSpan&) = delete;
+
+   private:
+    FrameStage stage_;
+  };
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  static constexpr int kStageCount = int(FrameStage::kCount);
+
+  class Samples {
+   public:
+    void add(double ms);
+    StageTimings timings() const;
+
+   private:
+    std::vector<float> window_;  // a ring buffer
+    size_t next_ = 0;
+    double sum_ = 0, max_ = 0, last_ = 0;
+    size_t count_ = 0;
+  };
+
+  struct GpuQueries {
+    GLuint ids[2] = {};
+    bool issued[2] = {};
+  };
+
+  // The begin and end timestamps of the spans, for the frames of the two
+  // slots. The queries are reused, they are only generated when there are
+  // more spans in a frame than before.
+  struct GpuSpanQueries {
+    std::vector<GLuint> ids[2];
+    size_t used[2] = {};  // the number of the queries issued in the frame
+    bool enabled = false;  // a span of the stage was measured already
+  };
+
+  Samples cpu_samples_[kStageCount], gpu_samples_[kStageCount];
+
+  // the CPU time of the stages in the current frame
+  Clock::duration cpu_frame_[kStageCount] = {};
+  std::vector<FrameStage> cpu_stack_;
+  Clock::time_point cpu_start_;
+
+  // The queries aren't deleted, the profiler outlives the GL context.
+  GpuQueries gpu_queries_[kStageCount];
+  GpuSpanQueries gpu_span_queries_[kStageCount];
+  int frame_ = 0;
+  bool gpu_timer_active_ = false;
+
+  FrameProfiler() = default;
+
+  void beginCpu(FrameStage stage);
+  void endCpu();
+  void beginGpu(FrameStage stage);
+  void endGpu(FrameStage stage);
+  void beginGpuSpan(FrameStage stage);
+  void endGpuSpan(FrameStage stage);
+  void issueTimestamp(FrameStage stage);
+  // Reads the spans of the frame that was two frames ago.
+  void collectGpuSpans();
+};
+
+} // namespace Cdlod
+
+#endif
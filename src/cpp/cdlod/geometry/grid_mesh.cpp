@@ -1,7 +1,11 @@
 // Copyright (c), Tamas Csala
 
+#include <cmath>
+#include <algorithm>
+
 #include "cdlod/geometry/grid_mesh.hpp"
 #include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/collision/cube2sphere.hpp"
 
 namespace Cdlod {
 
@@ -14,20 +18,19 @@ GLushort GridMesh::indexOf(int x, int y) {
 }
 
 void GridMesh::setupPositions(gl::VertexAttrib attrib) {
-  std::vector<svec2> positions;
-  positions.reserve((dimension_+1) * (dimension_+1));
+  std::vector<svec3> positions;
+  positions.reserve((dimension_+1) * (dimension_+5));
 
   GLubyte dim2 = dimension_/2;
 
   for (int y = -dim2; y <= dim2; ++y) {
     for (int x = -dim2; x <= dim2; ++x) {
-      positions.push_back(svec2(x, y));
+      positions.push_back(svec3(x, y, 0));
     }
   }
 
   std::vector<GLushort> indices;
-  index_count_ = 2*(dimension_+1)*(dimension_) + 2*dimension_;
-  indices.reserve(index_count_);
+  indices.reserve(2*(dimension_+1)*(dimension_+4) + dimension_ + 4);
 
   for (int y = -dim2; y < dim2; ++y) {
     for (int x = -dim2; x <= dim2; ++x) {
@@ -37,10 +40,29 @@ void GridMesh::setupPositions(gl::VertexAttrib attrib) {
     indices.push_back (kPrimitiveRestart);
   }
 
+  // The skirt of an edge, from (x, y) in the (dx, dy) direction. The order
+  // of the vertices in the strip is flipped on two of the edges, so that the
+  // front faces of the skirts look outwards.
+  auto add_skirt = [&](int x, int y, int dx, int dy, bool flip) {
+    for (int i = 0; i <= dimension_; ++i, x += dx, y += dy) {
+      GLushort border = indexOf(x, y);
+      GLushort skirt = positions.size();
+      positions.push_back(svec3(x, y, 1));
+      indices.push_back(flip ? skirt : border);
+      indices.push_back(flip ? border : skirt);
+    }
+    indices.push_back(kPrimitiveRestart);
+  };
+  add_skirt(-dim2, -dim2, 1, 0, true);
+  add_skirt(-dim2, dim2, 1, 0, false);
+  add_skirt(-dim2, -dim2, 0, 1, false);
+  add_skirt(dim2, -dim2, 0, 1, true);
+  index_count_ = indices.size();
+
   gl::Bind(vao_);
   gl::Bind(aPositions_);
   aPositions_.data(positions);
-  attrib.pointer(2, gl::DataType::kShort).enable();
+  attrib.pointer(3, gl::DataType::kShort).enable();
   gl::Unbind(aPositions_);
 
   gl::Bind(aIndices_);
@@ -121,6 +143,12 @@ void GridMesh::setupNextDiffuseTexturePosAndSize(gl::VertexAttrib attrib) {
 void GridMesh::addToRenderList(const glm::vec4& render_data,
                                const StreamedTextureInfo& texinfo) {
   render_data_.push_back(render_data);
+  CdlodTerrainSettings::geom_nodes_count++;
+
+  // the virtual texture's page table is used instead of per node textures
+  if (CdlodTerrainSettings::virtual_texturing) {
+    return;
+  }
 
   texture_ids_.push_back(texinfo.geometry_current->handle.bindless_handle());
   texture_ids_.push_back(texinfo.geometry_next->handle.bindless_handle());
@@ -141,8 +169,6 @@ void GridMesh::addToRenderList(const glm::vec4& render_data,
                                    texinfo.diffuse_current->size});
   texture_pos_and_size_.push_back(glm::vec3{texinfo.diffuse_next->position,
                                    texinfo.diffuse_next->size});
-
-  CdlodTerrainSettings::geom_nodes_count++;
 }
 
 void GridMesh::clearRenderList() {
@@ -151,6 +177,73 @@ void GridMesh::clearRenderList() {
   texture_pos_and_size_.clear();
 }
 
+// The instances are sorted by a 16 bit key, that is proportional to the
+// logarithm of their distance, so the precision is relative to the distance.
+static GLushort DistanceKey(double dist) {
+  constexpr double kKeyScale = 2048; // log2(dist) < 32
+  return static_cast<GLushort>(std::min(log2(1.0 + dist) * kKeyScale, 65535.0));
+}
+
+void GridMesh::sortFrontToBack(const glm::vec3& cam_pos) {
+  size_t count = render_data_.size();
+  if (count < 2) {
+    return;
+  }
+
+  sort_keys_.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    const glm::vec4& data = render_data_[i];
+    glm::dvec3 pos = Cube2Sphere(glm::dvec3(data.x, 0, data.y),
+                                 CubeFace(int(data.w)),
+                                 CdlodTerrainSettings::kFaceSize);
+    sort_keys_[i] = DistanceKey(glm::length(pos - glm::dvec3(cam_pos)));
+  }
+
+  // Stable LSD radix sort of the indices, one byte of the key per pass.
+  sort_order_.resize(count);
+  sort_temp_.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    sort_order_[i] = i;
+  }
+  for (int shift = 0; shift < 16; shift += 8) {
+    size_t offsets[257] = {};
+    for (unsigned index : sort_order_) {
+      offsets[((sort_keys_[index] >> shift) & 0xFF) + 1]++;
+    }
+    for (int digit = 0; digit < 256; ++digit) {
+      offsets[digit+1] += offsets[digit];
+    }
+    for (unsigned index : sort_order_) {
+      sort_temp_[offsets[(sort_keys_[index] >> shift) & 0xFF]++] = index;
+    }
+    std::swap(sort_order_, sort_temp_);
+  }
+
+  // Every instance has 6 texture ids and 6 texture positions (current and
+  // next geometry, normal and diffuse textures), if they are used at all.
+  bool has_textures = !texture_ids_.empty();
+  sorted_render_data_.resize(count);
+  if (has_textures) {
+    sorted_texture_ids_.resize(6*count);
+    sorted_texture_pos_and_size_.resize(6*count);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    unsigned index = sort_order_[i];
+    sorted_render_data_[i] = render_data_[index];
+    if (has_textures) {
+      std::copy_n(&texture_ids_[6*index], 6, &sorted_texture_ids_[6*i]);
+      std::copy_n(&texture_pos_and_size_[6*index], 6,
+                  &sorted_texture_pos_and_size_[6*i]);
+    }
+  }
+
+  std::swap(render_data_, sorted_render_data_);
+  if (has_textures) {
+    std::swap(texture_ids_, sorted_texture_ids_);
+    std::swap(texture_pos_and_size_, sorted_texture_pos_and_size_);
+  }
+}
+
 void GridMesh::render() {
   using gl::PrimType;
   using gl::IndexType;
@@ -159,11 +252,13 @@ void GridMesh::render() {
   gl::Bind(aRenderData_);
   aRenderData_.data(render_data_);
 
-  gl::Bind(aTextureIds_);
-  aTextureIds_.data(texture_ids_);
+  if (!CdlodTerrainSettings::virtual_texturing) {
+    gl::Bind(aTextureIds_);
+    aTextureIds_.data(texture_ids_);
 
-  gl::Bind(aTexturePosAndSize_);
-  aTexturePosAndSize_.data(texture_pos_and_size_);
+    gl::Bind(aTexturePosAndSize_);
+    aTexturePosAndSize_.data(texture_pos_and_size_);
+  }
 
   gl::PrimitiveRestartIndex(kPrimitiveRestart);
   gl::TemporaryEnable prim_restart(gl::kPrimitiveRestart);
@@ -23,6 +23,12 @@ struct svec2 {
   }
 };
 
+// A vertex of the GridMesh: its position, and 1 in z for the skirt vertices
+struct svec3 {
+  GLshort x, y, z;
+  svec3(GLshort a, GLshort b, GLshort c) : x(a), y(b), z(c) {}
+};
+
 // Renders a regular grid mesh, that is of (dimension+1) x (dimension+1) in size
 // so a GridMesh(16) will go from (-8, -8) to (8, 8). It is designed to render
 // a lots of this at the same time, with instanced rendering.
@@ -30,6 +36,10 @@ struct svec2 {
 // For performance reasons, GridMesh's maximum size is 255*255 (so that it can
 // use unsigned shorts instead of ints or floats), but for CDLOD, you need
 // pow2 sizes, so there 128*128 is the max
+//
+// The grid has a skirt around its edges: a strip of triangles that hangs down
+// from the border vertices (the shader lowers the vertices with z = 1). It
+// covers the gaps between neighbouring nodes whose edges don't match.
 class GridMesh {
  public:
   GridMesh(GLubyte dimension);
@@ -56,6 +66,10 @@ class GridMesh {
                        const StreamedTextureInfo& texinfo);
   void clearRenderList();
 
+  // Reorders the render list by the distance of the instances from the camera
+  // (nearest first), so that the early depth test can reject more fragments.
+  void sortFrontToBack(const glm::vec3& cam_pos);
+
   // render with vertex attrib divisor
   void render();
 
@@ -71,6 +85,13 @@ private:
   std::vector<uint64_t> texture_ids_;
   std::vector<glm::vec3> texture_pos_and_size_; // xy: pos, z: size
 
+  // scratch buffers for the sorting, kept to avoid reallocations
+  std::vector<GLushort> sort_keys_;
+  std::vector<unsigned> sort_order_, sort_temp_;
+  std::vector<glm::vec4> sorted_render_data_;
+  std::vector<uint64_t> sorted_texture_ids_;
+  std::vector<glm::vec3> sorted_texture_pos_and_size_;
+
   GLushort indexOf(int x, int y);
   GLushort kPrimitiveRestart = std::numeric_limits<GLushort>::max();
 
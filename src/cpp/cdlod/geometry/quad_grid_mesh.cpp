@@ -89,6 +89,10 @@ void QuadGridMesh::clearRenderList() {
   mesh_.clearRenderList();
 }
 
+void QuadGridMesh::sortFrontToBack(const glm::vec3& cam_pos) {
+  mesh_.sortFrontToBack(cam_pos);
+}
+
 void QuadGridMesh::render() {
   mesh_.render();
 }
@@ -44,6 +44,7 @@ class QuadGridMesh {
   void addToRenderList(float offset_x, float offset_y, int level, int face,
                        const StreamedTextureInfo& texinfo);
   void clearRenderList();
+  void sortFrontToBack(const glm::vec3& cam_pos);
   void render();
   size_t node_count() const;
 };
@@ -0,0 +1,216 @@
+// Copyright (c), Tamas Csala
+
+#ifdef USE_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cdlod/io_uring.hpp"
+
+namespace Cdlod {
+
+static int IoUringSetup(unsigned entries, io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int IoUringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                        unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+static int IoUringRegister(int fd, unsigned opcode, const void* arg,
+                           unsigned arg_count) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, arg_count);
+}
+
+// The kernel reads the tails of the submission queue, and writes the tail of
+// the completion queue from another thread.
+static unsigned LoadAcquire(const unsigned* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void StoreRelease(unsigned* p, unsigned value) {
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+template<typename T>
+static T* Offset(void* base, unsigned offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+// The kernels before 5.6 don't have IORING_OP_READ (nor the probe), they
+// fail every read of it with -EINVAL.
+static bool SupportsReads(int fd) {
+  constexpr unsigned kMaxOps = 256;
+  std::vector<char> storage(sizeof(io_uring_probe) +
+                            kMaxOps*sizeof(io_uring_probe_op));
+  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+  if (IoUringRegister(fd, IORING_REGISTER_PROBE, probe, kMaxOps) != 0) {
+    return false;
+  }
+  for (unsigned op : {IORING_OP_READ, IORING_OP_READ_FIXED}) {
+    if (op >= probe->ops_len ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void* MapRing(int fd, size_t size, off_t offset) {
+  void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, offset);
+  if (ring == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+  }
+  return ring;
+}
+
+IoUring::IoUring(unsigned buffer_count, size_t buffer_size)
+    : buffer_count_(buffer_count), buffer_size_(buffer_size) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd_ = IoUringSetup(buffer_count, &params);
+  if (ring_fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+  }
+
+  try {
+    if (!SupportsReads(ring_fd_)) {
+      throw std::system_error(EOPNOTSUPP, std::generic_category(),
+                              "io_uring doesn't support IORING_OP_READ");
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = MapRing(ring_fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = MapRing(ring_fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = MapRing(ring_fd_, sqes_size_, IORING_OFF_SQES);
+
+    sq_head_ = Offset<unsigned>(sq_ring_, params.sq_off.head);
+    sq_tail_ = Offset<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_mask_ = Offset<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = Offset<unsigned>(sq_ring_, params.sq_off.array);
+    cq_head_ = Offset<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = Offset<unsigned>(cq_ring_, params.cq_off.tail);
+    cq_mask_ = Offset<unsigned>(cq_ring_, params.cq_off.ring_mask);
+    cqes_ = Offset<void>(cq_ring_, params.cq_off.cqes);
+
+    // the registered buffers have to be page aligned
+    void* buffers = mmap(nullptr, buffer_count*buffer_size,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (buffers == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(),
+                              "io_uring buffers");
+    }
+    buffers_ = static_cast<unsigned char*>(buffers);
+  } catch (...) {
+    destroy();
+    throw;
+  }
+
+  std::vector<iovec> iovecs(buffer_count);
+  for (unsigned i = 0; i < buffer_count; ++i) {
+    iovecs[i].iov_base = buffer(i);
+    iovecs[i].iov_len = buffer_size;
+  }
+  registered_buffers_ = IoUringRegister(ring_fd_, IORING_REGISTER_BUFFERS,
+                                        iovecs.data(), buffer_count) == 0;
+}
+
+IoUring::~IoUring() {
+  destroy();
+}
+
+void IoUring::destroy() {
+  // closing the ring also unregisters the buffers
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+  if (buffers_) {
+    munmap(buffers_, buffer_count_*buffer_size_);
+    buffers_ = nullptr;
+  }
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (cq_ring_ && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = nullptr;
+  if (sq_ring_) {
+    munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = nullptr;
+  }
+}
+
+void IoUring::queueRead(int fd, unsigned buffer_index, size_t size,
+                        uint64_t offset, uint64_t user_data) {
+  // only this thread writes the tail
+  unsigned tail = *sq_tail_;
+  unsigned index = tail & *sq_mask_;
+  io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes_)[index];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = registered_buffers_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe.fd = fd;
+  sqe.off = offset;
+  sqe.addr = reinterpret_cast<uint64_t>(buffer(buffer_index));
+  sqe.len = size;
+  sqe.buf_index = registered_buffers_ ? buffer_index : 0;
+  sqe.user_data = user_data;
+  sq_array_[index] = index;
+  StoreRelease(sq_tail_, tail + 1);
+  queued_++;
+}
+
+void IoUring::submitAndWait(unsigned min_completions) {
+  while (true) {
+    int result = IoUringEnter(ring_fd_, queued_, min_completions,
+                              IORING_ENTER_GETEVENTS);
+    if (result >= 0) {
+      queued_ -= result;
+      if (queued_ == 0) {
+        return;
+      }
+      min_completions = 0;  // the rest just has to be submitted
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      throw std::system_error(errno, std::generic_category(),
+                              "io_uring_enter");
+    }
+  }
+}
+
+void IoUring::popCompletions(std::vector<Completion>& completions) {
+  // only this thread writes the head
+  unsigned head = *cq_head_;
+  unsigned tail = LoadAcquire(cq_tail_);
+  for (; head != tail; ++head) {
+    const io_uring_cqe& cqe =
+        static_cast<const io_uring_cqe*>(cqes_)[head & *cq_mask_];
+    completions.push_back(Completion{cqe.user_data, cqe.res});
+  }
+  StoreRelease(cq_head_, head);
+}
+
+} // namespace Cdlod
+
+#endif  // USE_IO_URING
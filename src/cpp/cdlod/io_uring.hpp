@@ -0,0 +1,77 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_IO_URING_H_
+#define ENGINE_CDLOD_IO_URING_H_
+
+#ifdef USE_IO_URING
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Cdlod {
+
+// A minimal io_uring wrapper for reading files into preallocated buffers,
+// with the raw syscalls (so it doesn't need liburing). Every buffer can have
+// one read in flight, so the submission queue never overflows. It isn't
+// thread safe, it's used by a single I/O thread.
+class IoUring {
+ public:
+  struct Completion {
+    uint64_t user_data;
+    int result;  // the bytes read, or -errno
+  };
+
+  // Throws std::system_error if io_uring isn't available (for ex. an old
+  // kernel, or a seccomp filter), or if the kernel doesn't support the read
+  // operations (before 5.6). If the buffers can't be registered (for
+  // ex. because of RLIMIT_MEMLOCK), the unregistered reads are used.
+  IoUring(unsigned buffer_count, size_t buffer_size);
+  ~IoUring();
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  unsigned bufferCount() const { return buffer_count_; }
+  size_t bufferSize() const { return buffer_size_; }
+  unsigned char* buffer(unsigned index) { return buffers_ + index*buffer_size_; }
+  bool registeredBuffers() const { return registered_buffers_; }
+
+  // Queues a read of the file into the beginning of the buffer, it's
+  // submitted by the next submitAndWait() call.
+  void queueRead(int fd, unsigned buffer_index, size_t size, uint64_t offset,
+                 uint64_t user_data);
+
+  // Submits the queued reads, and waits for at least min_completions
+  // completions.
+  void submitAndWait(unsigned min_completions);
+
+  // Appends the available completions, without waiting.
+  void popCompletions(std::vector<Completion>& completions);
+
+ private:
+  int ring_fd_ = -1;
+  unsigned buffer_count_;
+  size_t buffer_size_;
+  unsigned char* buffers_ = nullptr;
+  bool registered_buffers_ = false;
+
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0, cq_ring_size_ = 0;
+  void* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_, *cq_mask_;
+  void* cqes_;
+  unsigned queued_ = 0;  // not yet submitted
+
+  void destroy();
+};
+
+} // namespace Cdlod
+
+#endif  // USE_IO_URING
+
+#endif
@@ -0,0 +1,84 @@
+// Copyright (c), Tamas Csala
+
+#include <atomic>
+#include <cassert>
+#include <algorithm>
+
+#include "cdlod/memory_stats.hpp"
+
+namespace Cdlod {
+
+constexpr int TerrainMemoryStats::kLevelCount;
+constexpr int TerrainMemoryStats::kTierCount;
+
+namespace MemoryAccounting {
+
+namespace {
+
+struct Counter {
+  std::atomic<long> tiles{0};
+  std::atomic<long> bytes{0};
+};
+
+Counter counters[TerrainMemoryStats::kLevelCount][TerrainMemoryStats::kTierCount];
+std::atomic<unsigned> queue_generation{0};
+std::atomic<size_t> virtual_texture_bytes{0};
+
+Counter& GetCounter(int level, MemoryTier tier) {
+  assert(0 <= level && level < TerrainMemoryStats::kLevelCount);
+  return counters[level][int(tier)];
+}
+
+} // namespace
+
+void Update(int level, MemoryTier tier, size_t old_bytes, size_t new_bytes) {
+  if (old_bytes == new_bytes) {
+    return;
+  }
+  Counter& counter = GetCounter(level, tier);
+  counter.tiles += long(new_bytes != 0) - long(old_bytes != 0);
+  counter.bytes += long(new_bytes) - long(old_bytes);
+}
+
+unsigned Enqueued(int level) {
+  GetCounter(level, MemoryTier::kQueued).tiles++;
+  return queue_generation;
+}
+
+void Dequeued(int level, unsigned generation) {
+  // if the queue was cleared since, this isn't counted anymore
+  if (generation == queue_generation) {
+    GetCounter(level, MemoryTier::kQueued).tiles--;
+  }
+}
+
+void ClearQueue() {
+  queue_generation++;
+  for (auto& level : counters) {
+    level[int(MemoryTier::kQueued)].tiles = 0;
+  }
+}
+
+void SetVirtualTextureBytes(size_t bytes) {
+  virtual_texture_bytes = bytes;
+}
+
+TerrainMemoryStats Snapshot() {
+  TerrainMemoryStats stats;
+  for (int level = 0; level < TerrainMemoryStats::kLevelCount; ++level) {
+    for (int tier = 0; tier < TerrainMemoryStats::kTierCount; ++tier) {
+      const Counter& counter = counters[level][tier];
+      // the counters are read one by one, a tile might be in flight
+      TileMemoryStats& tile_stats = stats.levels[level][tier];
+      tile_stats.tiles = std::max(counter.tiles.load(), 0L);
+      tile_stats.bytes = std::max(counter.bytes.load(), 0L);
+      stats.total[tier].tiles += tile_stats.tiles;
+      stats.total[tier].bytes += tile_stats.bytes;
+    }
+  }
+  stats.virtual_texture_bytes = virtual_texture_bytes;
+  return stats;
+}
+
+} // namespace MemoryAccounting
+} // namespace Cdlod
@@ -0,0 +1,65 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_MEMORY_STATS_H_
+#define ENGINE_CDLOD_MEMORY_STATS_H_
+
+#include <cstddef>
+
+#include "cdlod/cdlod_terrain_settings.hpp"
+
+namespace Cdlod {
+
+enum class MemoryTier {
+  kQueued,    // waiting for an async load (nothing is allocated for it yet)
+  kDecoded,   // the decoded texels in the RAM
+  kResident,  // uploaded to the GPU
+  kCount
+};
+
+struct TileMemoryStats {
+  size_t tiles = 0;
+  size_t bytes = 0;
+};
+
+// The memory used by the tiles, per texture level and tier. A tile is counted
+// in every tier where it has some memory (for ex. the elevation texels stay
+// in the RAM after the upload, for the min/max of the descendants).
+struct TerrainMemoryStats {
+  static constexpr int kLevelCount = CdlodTerrainSettings::kMaxTextureLevel + 1;
+  static constexpr int kTierCount = int(MemoryTier::kCount);
+
+  TileMemoryStats levels[kLevelCount][kTierCount];
+  TileMemoryStats total[kTierCount];
+
+  // The page arrays and the page table of the virtual texture, or 0 if it
+  // isn't used. The resident tiles are stored in these pages then.
+  size_t virtual_texture_bytes = 0;
+
+  const TileMemoryStats& tier(MemoryTier tier) const { return total[int(tier)]; }
+  const TileMemoryStats& tier(int level, MemoryTier tier) const {
+    return levels[level][int(tier)];
+  }
+};
+
+// The counters behind TerrainMemoryStats, they can be updated from any thread.
+namespace MemoryAccounting {
+
+// Changes the bytes of a tile in a tier from old_bytes to new_bytes.
+void Update(int level, MemoryTier tier, size_t old_bytes, size_t new_bytes);
+
+// The queue of the loads is cleared every frame, the tiles that are queued
+// again have to be counted again. Returns the generation of the queue, that
+// Dequeued() expects.
+unsigned Enqueued(int level);
+void Dequeued(int level, unsigned generation);
+void ClearQueue();
+
+void SetVirtualTextureBytes(size_t bytes);
+
+TerrainMemoryStats Snapshot();
+
+} // namespace MemoryAccounting
+
+} // namespace Cdlod
+
+#endif
@@ -0,0 +1,240 @@
+// Copyright (c), Tamas Csala
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "cdlod/residency_snapshot.hpp"
+#include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/texture_data.hpp"
+
+namespace Cdlod {
+
+namespace {
+
+struct Header {
+  char magic[4];
+  uint32_t version;
+  // the settings that the tiles depend on
+  uint32_t texture_dimension, face_size_exp, format_flags;
+  uint32_t tile_count;
+  uint32_t has_payloads, padding;
+  double camera[9];  // pos, forward, up
+};
+
+struct TileRecord {
+  int32_t face, level;
+  double x, z;
+  uint32_t file_count, padding;
+};
+
+struct FileRecord {
+  uint32_t path_size, padding;
+  uint64_t size;
+  // the file on the disk when it was stored, the payload is dropped on load
+  // if it has been changed since then (for ex. by the preprocessor)
+  uint64_t file_size;
+  int64_t mtime;  // in nanoseconds
+};
+
+constexpr uint32_t kVersion = 2;
+constexpr uint32_t kMaxPathSize = 4096;
+constexpr uint64_t kMaxFileSize = 64 * 1024 * 1024;
+
+uint32_t FormatFlags() {
+  return (CdlodTerrainSettings::kCompressedDiffuse ? 1 : 0) |
+         (CdlodTerrainSettings::kPrecomputedMipmaps ? 2 : 0);
+}
+
+// Returns false if the file doesn't exist.
+bool FileStamp(const std::string& path, uint64_t& size, int64_t& mtime) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return false;
+  }
+  size = info.st_size;
+#ifdef _WIN32
+  mtime = int64_t(info.st_mtime) * 1000000000;
+#else
+  mtime = int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
+template<typename T>
+void Write(std::ofstream& file, const T& value) {
+  file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+bool Read(std::ifstream& file, T& value) {
+  return bool(file.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+} // namespace
+
+void SaveResidencySnapshot(const std::string& path,
+                           const ResidencySnapshot& snapshot,
+                           bool with_payloads) {
+  // written next to it first, so that an interrupted save doesn't leave a
+  // truncated snapshot behind
+  std::string temp_path = path + ".tmp";
+  {
+    std::ofstream file(temp_path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Can't write residency snapshot " + path);
+    }
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "RLRS", 4);
+    header.version = kVersion;
+    header.texture_dimension = CdlodTerrainSettings::kTextureDimension;
+    header.face_size_exp = CdlodTerrainSettings::kFaceSizeExp;
+    header.format_flags = FormatFlags();
+    header.tile_count = snapshot.tiles.size();
+    header.has_payloads = with_payloads;
+    const glm::dvec3* camera[3] = {&snapshot.camera_pos,
+                                   &snapshot.camera_forward,
+                                   &snapshot.camera_up};
+    for (int i = 0; i < 9; ++i) {
+      header.camera[i] = (*camera[i / 3])[i % 3];
+    }
+    Write(file, header);
+
+    TileBuffer bytes;
+    for (const SnapshotTile& tile : snapshot.tiles) {
+      TileRecord record;
+      std::memset(&record, 0, sizeof(record));
+      record.face = int(tile.id.face);
+      record.level = tile.id.level;
+      record.x = tile.id.x;
+      record.z = tile.id.z;
+      record.file_count = with_payloads ? tile.paths.size() : 0;
+      Write(file, record);
+
+      for (size_t i = 0; i < record.file_count; ++i) {
+        // a missing file is stored as empty, it's read (and reported) again
+        // when the tile is loaded
+        FileRecord file_record;
+        std::memset(&file_record, 0, sizeof(file_record));
+        // stamped before the read, so a change during the read isn't missed
+        bool exists = FileStamp(tile.paths[i], file_record.file_size,
+                                file_record.mtime);
+        try {
+          ReadFile(tile.paths[i], bytes);
+        } catch (const std::exception&) {
+          bytes.clear();
+        }
+        if (!exists) {
+          bytes.clear();
+        }
+        file_record.path_size = tile.paths[i].size();
+        file_record.size = bytes.size();
+        Write(file, file_record);
+        file.write(tile.paths[i].data(), tile.paths[i].size());
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+      }
+    }
+
+    if (!file) {
+      throw std::runtime_error("Failed to write residency snapshot " + path);
+    }
+  }
+
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    throw std::runtime_error("Can't replace residency snapshot " + path);
+  }
+}
+
+bool LoadResidencySnapshot(const std::string& path,
+                           ResidencySnapshot& snapshot) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  Header header;
+  bool valid = Read(file, header) &&
+               std::memcmp(header.magic, "RLRS", 4) == 0 &&
+               header.version == kVersion &&
+               header.texture_dimension == CdlodTerrainSettings::kTextureDimension &&
+               header.face_size_exp == CdlodTerrainSettings::kFaceSizeExp &&
+               header.format_flags == FormatFlags();
+  if (!valid) {
+    std::cerr << path << " doesn't match the settings, it's ignored"
+              << std::endl;
+    return false;
+  }
+
+  snapshot.camera_pos = glm::dvec3(header.camera[0], header.camera[1],
+                                   header.camera[2]);
+  snapshot.camera_forward = glm::dvec3(header.camera[3], header.camera[4],
+                                       header.camera[5]);
+  snapshot.camera_up = glm::dvec3(header.camera[6], header.camera[7],
+                                  header.camera[8]);
+
+  snapshot.tiles.clear();
+  size_t stale_count = 0;
+  for (uint32_t i = 0; i < header.tile_count; ++i) {
+    TileRecord record;
+    if (!Read(file, record) || record.face < 0 || record.face >= 6) {
+      valid = false;
+      break;
+    }
+
+    SnapshotTile tile;
+    tile.id = TileId{CubeFace(record.face), record.level, record.x, record.z};
+    if (record.file_count != 0) {
+      tile.files = std::make_shared<TileFiles>();
+    }
+    for (uint32_t j = 0; j < record.file_count && valid; ++j) {
+      FileRecord file_record;
+      valid = Read(file, file_record) &&
+              file_record.path_size <= kMaxPathSize &&
+              file_record.size <= kMaxFileSize;
+      if (!valid) {
+        break;
+      }
+      std::string file_path(file_record.path_size, '\0');
+      TileBuffer bytes(file_record.size);
+      valid = file.read(&file_path[0], file_path.size()) &&
+              file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+      tile.paths.push_back(file_path);
+      if (!valid || bytes.empty()) {
+        continue;
+      }
+      // a stale payload isn't used, the file is read from the disk instead
+      uint64_t file_size;
+      int64_t mtime;
+      if (!FileStamp(file_path, file_size, mtime) ||
+          file_size != file_record.file_size || mtime != file_record.mtime) {
+        stale_count++;
+        continue;
+      }
+      tile.files->add(std::move(file_path), std::move(bytes));
+    }
+    if (!valid) {
+      break;
+    }
+    snapshot.tiles.push_back(std::move(tile));
+  }
+
+  if (!valid) {
+    std::cerr << path << " is truncated, it's ignored" << std::endl;
+    snapshot.tiles.clear();
+    return false;
+  }
+  if (stale_count != 0) {
+    std::cerr << stale_count << " files changed since " << path
+              << " was saved, they are read again" << std::endl;
+  }
+  return true;
+}
+
+} // namespace Cdlod
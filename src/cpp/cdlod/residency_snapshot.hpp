@@ -0,0 +1,53 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_RESIDENCY_SNAPSHOT_H_
+#define ENGINE_CDLOD_RESIDENCY_SNAPSHOT_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "cdlod/collision/cube2sphere.hpp"
+#include "cdlod/tile_loader.hpp"
+
+namespace Cdlod {
+
+// A quad tree node, that has textures.
+struct TileId {
+  CubeFace face;
+  int level;
+  double x, z;  // the center of the node
+};
+
+struct SnapshotTile {
+  TileId id;
+  // On save: the files of the tile, that are stored if the payloads are
+  // saved. On load: the stored files (except the ones that changed on the
+  // disk since the save), or null if they weren't saved.
+  std::vector<std::string> paths;
+  std::shared_ptr<TileFiles> files;
+};
+
+// The tiles that were resident at the end of a session, and the camera's
+// pose then, so that the next session can start with the same working set.
+struct ResidencySnapshot {
+  glm::dvec3 camera_pos, camera_forward, camera_up;
+  std::vector<SnapshotTile> tiles;
+};
+
+// Saves the snapshot. If with_payloads is set, the files of the tiles are
+// read again, and stored too, so they can be restored with a single
+// sequential read. Throws std::runtime_error if the file can't be written.
+void SaveResidencySnapshot(const std::string& path,
+                           const ResidencySnapshot& snapshot,
+                           bool with_payloads);
+
+// Returns false if the file doesn't exist, or if it's invalid or it doesn't
+// match the settings (it's ignored then).
+bool LoadResidencySnapshot(const std::string& path,
+                           ResidencySnapshot& snapshot);
+
+} // namespace Cdlod
+
+#endif
@@ -0,0 +1,224 @@
+// Copyright (c), Tamas Csala
+
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "cdlod/texture_data.hpp"
+#include "cdlod/trace.hpp"
+
+namespace Cdlod {
+
+constexpr size_t TextureData::kMaxLevelCount;
+
+void TextureData::addLevel(const Level& level) {
+  if (level_count == kMaxLevelCount) {
+    throw std::runtime_error("Too many texture levels");
+  }
+  levels[level_count++] = level;
+}
+
+void ReadFile(const std::string& path, TileBuffer& bytes) {
+  TraceScope trace{"I/O"};
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    throw std::runtime_error("Can't open " + path);
+  }
+  bytes = TileBuffer(file.tellg());
+  file.seekg(0);
+  if (!file.read(reinterpret_cast<char*>(bytes.data()), bytes.size())) {
+    throw std::runtime_error("Can't read " + path);
+  }
+}
+
+void DecodePng(const TileBuffer& file, const std::string& path,
+               LodePNGColorType color_type, unsigned bit_depth, GLsizei size,
+               GLenum internal_format, GLenum format, GLenum type,
+               TextureData& data) {
+  data.clear();
+  unsigned width, height;
+  unsigned error;
+  {
+    TraceScope trace{"Decode"};
+    // lodepng decodes into a vector, it's copied into a pooled buffer (the
+    // vector is kept, so that it doesn't have to grow for every tile)
+    static thread_local std::vector<unsigned char> decoded;
+    decoded.clear();
+    error = lodepng::decode(decoded, width, height, file.data(), file.size(),
+                            color_type, bit_depth);
+    if (!error) {
+      data.bytes.resize(decoded.size());
+      std::memcpy(data.bytes.data(), decoded.data(), decoded.size());
+    }
+  }
+  if (error) {
+    std::cerr << path << ": image decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
+    throw std::runtime_error("Image decoder error");
+  }
+  assert(width == unsigned(size));
+  assert(height == unsigned(size));
+
+  if (bit_depth == 16) {
+    // Big endian decoding!
+    for (size_t i = 0; i+1 < data.bytes.size(); i += 2) {
+      uint16_t value = data.bytes[i]*256 + data.bytes[i+1];
+      std::memcpy(&data.bytes[i], &value, sizeof(value));
+    }
+  }
+
+  data.internal_format = internal_format;
+  data.format = format;
+  data.type = type;
+  data.addLevel(TextureData::Level{GLsizei(width), GLsizei(height),
+                                   0, data.bytes.size()});
+}
+
+static uint32_t ReadUint32(const TileBuffer& bytes, size_t offset) {
+  if (bytes.size() < offset + sizeof(uint32_t)) {
+    throw std::runtime_error("Unexpected end of KTX file");
+  }
+  uint32_t value;
+  std::memcpy(&value, &bytes[offset], sizeof(value));
+  return value;
+}
+
+void DecodeKtx(TileBuffer file, const std::string& path,
+               TextureData& data) {
+  data.clear();
+  data.bytes = std::move(file);
+
+  // the levels are used in place, only the header has to be parsed
+  TraceScope trace{"Decode"};
+
+  static const unsigned char kIdentifier[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+  };
+  if (data.bytes.size() < 64 ||
+      std::memcmp(data.bytes.data(), kIdentifier, sizeof(kIdentifier)) != 0) {
+    throw std::runtime_error(path + " is not a KTX file");
+  }
+  if (ReadUint32(data.bytes, 12) != 0x04030201) {
+    throw std::runtime_error(path + " has an unsupported byte order");
+  }
+
+  data.type = ReadUint32(data.bytes, 16);
+  data.format = ReadUint32(data.bytes, 24);
+  data.internal_format = ReadUint32(data.bytes, 28);
+  GLsizei width = ReadUint32(data.bytes, 36);
+  GLsizei height = ReadUint32(data.bytes, 40);
+  uint32_t level_count = std::max(ReadUint32(data.bytes, 56), 1u);
+  size_t offset = 64 + ReadUint32(data.bytes, 60);
+
+  for (uint32_t i = 0; i < level_count; ++i) {
+    uint32_t size = ReadUint32(data.bytes, offset);
+    offset += sizeof(uint32_t);
+    if (data.bytes.size() < offset + size) {
+      throw std::runtime_error("Unexpected end of KTX file");
+    }
+    data.addLevel(TextureData::Level{width, height, offset, size});
+    offset += (size + 3) / 4 * 4;
+    width = std::max(width/2, 1);
+    height = std::max(height/2, 1);
+  }
+}
+
+void CreateConstantTexture(const void* texel, size_t texel_size, GLsizei size,
+                           GLenum internal_format, GLenum format, GLenum type,
+                           bool mipmapped, TextureData& data) {
+  data.clear();
+  data.internal_format = internal_format;
+  data.format = format;
+  data.type = type;
+
+  // the rows are 4 byte aligned, like in the KTX files
+  size_t total_size = 0;
+  for (GLsizei level_size = size; level_size > 0; level_size /= 2) {
+    size_t row_size = (level_size*texel_size + 3) / 4 * 4;
+    data.addLevel(TextureData::Level{level_size, level_size, total_size,
+                                     row_size*level_size});
+    total_size += row_size*level_size;
+    if (!mipmapped) {
+      break;
+    }
+  }
+
+  data.bytes.resize(total_size);
+  auto texel_bytes = static_cast<const unsigned char*>(texel);
+  for (size_t i = 0; i < data.level_count; ++i) {
+    const TextureData::Level& level = data.levels[i];
+    size_t row_size = level.size / level.height;
+    for (GLsizei y = 0; y < level.height; ++y) {
+      unsigned char* row = &data.bytes[level.offset + y*row_size];
+      for (GLsizei x = 0; x < level.width; ++x) {
+        std::memcpy(row + x*texel_size, texel_bytes, texel_size);
+      }
+    }
+  }
+}
+
+void CreateConstantBC1Texture(const unsigned char block[8], GLsizei size,
+                              TextureData& data) {
+  data.clear();
+  data.internal_format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+  size_t total_size = 0;
+  for (GLsizei level_size = size; level_size > 0; level_size /= 2) {
+    size_t block_count = size_t((level_size+3) / 4) * ((level_size+3) / 4);
+    data.addLevel(TextureData::Level{level_size, level_size, total_size,
+                                     block_count * 8});
+    total_size += block_count * 8;
+  }
+
+  // the blocks of the levels are contiguous
+  data.bytes.resize(total_size);
+  for (size_t offset = 0; offset < total_size; offset += 8) {
+    std::memcpy(&data.bytes[offset], block, 8);
+  }
+}
+
+void UploadTextureData(gl::Texture2D& texture, const TextureData& data) {
+  for (size_t i = 0; i < data.level_count; ++i) {
+    const TextureData::Level& level = data.levels[i];
+    if (data.compressed()) {
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, data.internal_format,
+                             level.width, level.height, 0, level.size,
+                             data.bytes.data() + level.offset);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, i, data.internal_format,
+                   level.width, level.height, 0, data.format, data.type,
+                   data.bytes.data() + level.offset);
+    }
+  }
+
+  if (data.level_count == 1) {
+    texture.generateMipmap();
+  } else {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, data.level_count - 1);
+  }
+}
+
+size_t GpuMemorySize(const TextureData& data) {
+  size_t size = 0;
+  for (size_t i = 0; i < data.level_count; ++i) {
+    size += data.levels[i].size;
+  }
+  if (data.level_count != 1 || data.compressed()) {
+    return size;
+  }
+
+  // the rest of the mipmap chain is generated on upload
+  const TextureData::Level& level0 = data.levels[0];
+  double texel_size = double(level0.size) / (level0.width * level0.height);
+  for (GLsizei w = level0.width / 2, h = level0.height / 2; w > 0 || h > 0;
+       w /= 2, h /= 2) {
+    size += size_t(std::max(w, 1) * std::max(h, 1) * texel_size);
+  }
+  return size;
+}
+
+} // namespace Cdlod
@@ -0,0 +1,88 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_TEXTURE_DATA_H_
+#define ENGINE_CDLOD_TEXTURE_DATA_H_
+
+#include <string>
+#include <lodepng.h>
+#include <glad/glad.h>
+#include <oglwrap/oglwrap.h>
+
+#include "cdlod/tile_buffer_pool.hpp"
+
+namespace Cdlod {
+
+// The texels of a texture that is loaded to the memory, but is not yet
+// uploaded to the GPU. It either has a single level (and the mipmaps are
+// generated on upload), or a precomputed mipmap chain.
+struct TextureData {
+  struct Level {
+    GLsizei width, height;
+    size_t offset, size; // in bytes, inside the bytes buffer
+  };
+  // enough for a 32768 x 32768 texture
+  static constexpr size_t kMaxLevelCount = 16;
+
+  // format and type are 0 for compressed textures
+  GLenum internal_format = 0, format = 0, type = 0;
+  TileBuffer bytes;
+  Level levels[kMaxLevelCount];
+  size_t level_count = 0;
+
+  bool empty() const { return level_count == 0; }
+  bool compressed() const { return type == 0; }
+  // returns the buffer to the pool
+  void clear() {
+    bytes.clear();
+    level_count = 0;
+  }
+  // the borrowed RAM
+  size_t memory_size() const { return bytes.capacity(); }
+
+  // Throws std::runtime_error if there are too many levels.
+  void addLevel(const Level& level);
+
+  template<typename T>
+  const T* level0() const {
+    return reinterpret_cast<const T*>(bytes.data() + levels[0].offset);
+  }
+};
+
+// Reads a whole file, throws std::runtime_error if it can't.
+void ReadFile(const std::string& path, TileBuffer& bytes);
+
+// Decodes a png file, that is expected to be size x size large. 16 bit images
+// are converted to the native byte order. The path is only used in the
+// error messages.
+void DecodePng(const TileBuffer& file, const std::string& path,
+               LodePNGColorType color_type, unsigned bit_depth, GLsizei size,
+               GLenum internal_format, GLenum format, GLenum type,
+               TextureData& data);
+
+// Decodes a KTX 1.1 file, with all of its mipmap levels. The levels are used
+// in place, so the file's buffer is moved into the data.
+void DecodeKtx(TileBuffer file, const std::string& path,
+               TextureData& data);
+
+// Creates a texture, whose every texel is the given one, instead of loading a
+// tile that is known to be constant. It has a full mipmap chain if mipmapped
+// is set (like the KTX tiles), otherwise only a single level.
+void CreateConstantTexture(const void* texel, size_t texel_size, GLsizei size,
+                           GLenum internal_format, GLenum format, GLenum type,
+                           bool mipmapped, TextureData& data);
+
+// The same for BC1 compressed textures, the block is repeated on every level.
+void CreateConstantBC1Texture(const unsigned char block[8], GLsizei size,
+                              TextureData& data);
+
+// Uploads all levels of the data to the currently bound GL_TEXTURE_2D. If the
+// data doesn't have a precomputed mipmap chain, it is generated.
+void UploadTextureData(gl::Texture2D& texture, const TextureData& data);
+
+// The size of the texels of the texture on the GPU, after UploadTextureData
+// (with the generated mipmaps).
+size_t GpuMemorySize(const TextureData& data);
+
+} // namespace Cdlod
+
+#endif
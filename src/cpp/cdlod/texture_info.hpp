@@ -3,19 +3,17 @@
 #ifndef ENGINE_CDLOD_TEXTURE_INFO_H_
 #define ENGINE_CDLOD_TEXTURE_INFO_H_
 
+#include <atomic>
 #include <mutex>
 #include <limits>
 #include <glad/glad.h>
 #include <oglwrap/oglwrap.h>
 
+#include "cdlod/texture_data.hpp"
 #include "cdlod/cdlod_terrain_settings.hpp"
 
 namespace Cdlod {
 
-struct RGBPixel {
-  unsigned char r = 0, g = 0, b = 0;
-};
-
 struct TextureBaseInfo {
   glm::dvec2 position {0.0, 0.0}; // top-left
   double size = 0;
@@ -26,7 +24,7 @@ struct TextureBaseInfo {
 class CdlodQuadTreeNode;
 
 struct TextureInfo {
-  TextureBaseInfo elevation, diffuse;
+  TextureBaseInfo elevation, normal, diffuse;
 
   GLushort min = std::numeric_limits<GLushort>::max();
   GLushort max = std::numeric_limits<GLushort>::min();
@@ -35,16 +33,29 @@ struct TextureInfo {
 
   CdlodQuadTreeNode* min_max_src = nullptr;
 
-  std::vector<GLushort> elevation_data;
-  std::vector<RGBPixel> diffuse_data;
+  // elevation: R16, normal: RG8 (the x and z components of an upward normal),
+  // diffuse: RGB8 or BC1
+  TextureData elevation_data, normal_data, diffuse_data;
   bool is_loaded_to_gpu = false;
+  int page = -1; // the virtual texture page, if virtual texturing is used
+  // incremented whenever the tile is uploaded or evicted
+  unsigned residency_generation = 0;
+
+  // the memory of the tile in the RAM and on the GPU (see MemoryAccounting)
+  size_t decoded_bytes = 0, resident_bytes = 0;
 
   std::mutex load_mutex;
-  bool is_loaded_to_memory = false;
+  // set by the loader threads, read by the render thread
+  std::atomic<bool> is_loaded_to_memory{false};
+  // The virtual texture evicted the tile: its elevation data is still in
+  // the memory (the descendants may read it for their min/max heights), only
+  // the normal and the diffuse layers have to be loaded again.
+  std::atomic<bool> is_evicted{false};
 
   TextureInfo() = default;
   TextureInfo(TextureInfo&& other)
     : elevation(std::move(other.elevation))
+    , normal(std::move(other.normal))
     , diffuse(std::move(other.diffuse))
     , min(other.min)
     , max(other.max)
@@ -52,10 +63,18 @@ struct TextureInfo {
     , max_h(other.max_h)
     , min_max_src(other.min_max_src)
     , elevation_data(std::move(other.elevation_data))
+    , normal_data(std::move(other.normal_data))
     , diffuse_data(std::move(other.diffuse_data))
     , is_loaded_to_gpu(other.is_loaded_to_gpu)
-    , is_loaded_to_memory (other.is_loaded_to_memory)
-  {}
+    , page(other.page)
+    , residency_generation(other.residency_generation)
+    , decoded_bytes(other.decoded_bytes)
+    , resident_bytes(other.resident_bytes)
+    , is_loaded_to_memory(other.is_loaded_to_memory.load())
+    , is_evicted(other.is_evicted.load())
+  {
+    other.decoded_bytes = other.resident_bytes = 0;
+  }
 };
 
 struct StreamedTextureInfo {
@@ -0,0 +1,240 @@
+// Copyright (c), Tamas Csala
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifdef __linux__
+  #include <sys/mman.h>
+#endif
+
+#include "cdlod/tile_buffer_pool.hpp"
+#include "cdlod/cdlod_terrain_settings.hpp"
+
+namespace Cdlod {
+
+constexpr int TileBufferPoolStats::kClassCount;
+constexpr int TileBuffer::kHeapClass;
+
+namespace {
+
+constexpr size_t kPageSize = 4096;
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+size_t RoundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// The size of a KTX file with a full mipmap chain, as the preprocessor writes
+// them (4 byte aligned rows, no key/value data).
+size_t KtxFileSize(size_t size, size_t texel_size) {
+  size_t file_size = 64;
+  for (; size > 0; size /= 2) {
+    file_size += sizeof(uint32_t) + RoundUp(size*texel_size, 4) * size;
+  }
+  return file_size;
+}
+
+size_t Bc1KtxFileSize(size_t size) {
+  size_t file_size = 64;
+  for (; size > 0; size /= 2) {
+    file_size += sizeof(uint32_t) + (size+3)/4 * ((size+3)/4) * 8;
+  }
+  return file_size;
+}
+
+size_t ElevationBufferSize() {
+  // the heights are 16 bit, the normals have two 8 bit components
+  size_t size = CdlodTerrainSettings::kElevationTexSizeWithBorders;
+  return std::max(KtxFileSize(size, 2), size*size*2);
+}
+
+size_t DiffuseBufferSize() {
+  size_t size = CdlodTerrainSettings::kDiffuseTexSizeWithBorders;
+  return CdlodTerrainSettings::kCompressedDiffuse ? Bc1KtxFileSize(size)
+                                                  : size*size*3;
+}
+
+// The buffers are carved from 2 MB slabs (a huge page each, if enabled), that
+// are never freed: the pool keeps its peak size.
+class Pool {
+ public:
+  Pool() {
+    classes_[int(TileBufferClass::kElevation)].buffer_size =
+        RoundUp(ElevationBufferSize(), kPageSize);
+    classes_[int(TileBufferClass::kDiffuse)].buffer_size =
+        RoundUp(DiffuseBufferSize(), kPageSize);
+  }
+
+  // Returns the class of the buffer, or -1 if the size doesn't fit any.
+  int borrow(size_t size, unsigned char*& data, size_t& capacity) {
+    int class_index = -1;
+    for (int i = 0; i < TileBufferPoolStats::kClassCount; ++i) {
+      if (size <= classes_[i].buffer_size &&
+          (class_index == -1 ||
+           classes_[i].buffer_size < classes_[class_index].buffer_size)) {
+        class_index = i;
+      }
+    }
+    if (class_index == -1) {
+      heap_allocations_++;
+      data = new unsigned char[size];
+      capacity = size;
+      return class_index;
+    }
+
+    SizeClass& size_class = classes_[class_index];
+    std::lock_guard<std::mutex> lock{size_class.mutex};
+    if (size_class.free_buffers.empty()) {
+      grow(size_class);
+    }
+    data = size_class.free_buffers.back();
+    size_class.free_buffers.pop_back();
+    capacity = size_class.buffer_size;
+    return class_index;
+  }
+
+  void giveBack(unsigned char* data, int class_index) {
+    SizeClass& size_class = classes_[class_index];
+    std::lock_guard<std::mutex> lock{size_class.mutex};
+    // doesn't allocate, the capacity is reserved by grow()
+    size_class.free_buffers.push_back(data);
+  }
+
+  TileBufferPoolStats stats() {
+    TileBufferPoolStats stats;
+    for (int i = 0; i < TileBufferPoolStats::kClassCount; ++i) {
+      SizeClass& size_class = classes_[i];
+      std::lock_guard<std::mutex> lock{size_class.mutex};
+      TileBufferClassStats& class_stats = stats.classes[i];
+      class_stats.buffer_size = size_class.buffer_size;
+      class_stats.buffer_count = size_class.buffer_count;
+      class_stats.borrowed_count =
+          size_class.buffer_count - size_class.free_buffers.size();
+      stats.reserved_bytes += size_class.reserved_bytes;
+      stats.huge_pages = stats.huge_pages || size_class.huge_pages;
+    }
+    stats.heap_allocations = heap_allocations_;
+    return stats;
+  }
+
+ private:
+  struct SizeClass {
+    std::mutex mutex;
+    size_t buffer_size = 0;
+    size_t buffer_count = 0;
+    size_t reserved_bytes = 0;
+    bool huge_pages = false;
+    std::vector<unsigned char*> free_buffers;
+  };
+
+  SizeClass classes_[TileBufferPoolStats::kClassCount];
+  std::atomic<size_t> heap_allocations_{0};
+
+  void grow(SizeClass& size_class) {
+    size_t slab_size = RoundUp(size_class.buffer_size, kHugePageSize);
+    bool huge_pages = false;
+    unsigned char* slab = allocateSlab(slab_size, huge_pages);
+    heap_allocations_++;
+
+    size_t count = slab_size / size_class.buffer_size;
+    size_class.buffer_count += count;
+    size_class.reserved_bytes += slab_size;
+    size_class.huge_pages = size_class.huge_pages || huge_pages;
+    size_class.free_buffers.reserve(size_class.buffer_count);
+    for (size_t i = 0; i < count; ++i) {
+      size_class.free_buffers.push_back(slab + i*size_class.buffer_size);
+    }
+  }
+
+  static unsigned char* allocateSlab(size_t size, bool& huge_pages) {
+#ifdef __linux__
+    if (CdlodTerrainSettings::huge_page_tile_buffers) {
+      // the reserved huge pages (vm.nr_hugepages)
+      void* slab = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (slab != MAP_FAILED) {
+        huge_pages = true;
+        return static_cast<unsigned char*>(slab);
+      }
+      // the transparent huge pages, if they are enabled in madvise mode
+      if (posix_memalign(&slab, kHugePageSize, size) == 0) {
+        huge_pages = madvise(slab, size, MADV_HUGEPAGE) == 0;
+        return static_cast<unsigned char*>(slab);
+      }
+    }
+#endif
+    return static_cast<unsigned char*>(::operator new(size));
+  }
+};
+
+// Never destroyed, so that the buffers that outlive it (for ex. in other
+// static objects) can still be returned at exit.
+Pool& GetPool() {
+  static Pool* pool = new Pool{};
+  return *pool;
+}
+
+} // namespace
+
+TileBuffer::TileBuffer(TileBuffer&& other)
+    : data_(other.data_)
+    , size_(other.size_)
+    , capacity_(other.capacity_)
+    , class_index_(other.class_index_) {
+  other.data_ = nullptr;
+  other.size_ = other.capacity_ = 0;
+}
+
+TileBuffer& TileBuffer::operator=(TileBuffer&& other) {
+  if (this != &other) {
+    clear();
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(class_index_, other.class_index_);
+  }
+  return *this;
+}
+
+void TileBuffer::resize(size_t size) {
+  if (size <= capacity_) {
+    size_ = size;
+    return;
+  }
+
+  TileBuffer larger;
+  larger.class_index_ = GetPool().borrow(size, larger.data_, larger.capacity_);
+  if (size_ != 0) {
+    std::memcpy(larger.data_, data_, size_);
+  }
+  larger.size_ = size;
+  *this = std::move(larger);
+}
+
+void TileBuffer::clear() {
+  if (data_) {
+    if (class_index_ == kHeapClass) {
+      delete[] data_;
+    } else {
+      GetPool().giveBack(data_, class_index_);
+    }
+  }
+  data_ = nullptr;
+  size_ = capacity_ = 0;
+}
+
+namespace TileBufferPool {
+
+TileBufferPoolStats Stats() {
+  return GetPool().stats();
+}
+
+}
+
+} // namespace Cdlod
@@ -0,0 +1,84 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_TILE_BUFFER_POOL_H_
+#define ENGINE_CDLOD_TILE_BUFFER_POOL_H_
+
+#include <cstddef>
+
+namespace Cdlod {
+
+// The size classes of the pooled buffers. The elevation class fits the
+// elevation and normal tiles, the diffuse class fits the diffuse tiles (with
+// the current file formats, see CdlodTerrainSettings), both the read files
+// and the decoded data.
+enum class TileBufferClass {
+  kElevation,
+  kDiffuse,
+  kCount
+};
+
+struct TileBufferClassStats {
+  size_t buffer_size = 0;
+  size_t buffer_count = 0;  // allocated, borrowed or free
+  size_t borrowed_count = 0;
+};
+
+struct TileBufferPoolStats {
+  static constexpr int kClassCount = int(TileBufferClass::kCount);
+
+  TileBufferClassStats classes[kClassCount];
+  size_t reserved_bytes = 0;  // by the slabs
+  bool huge_pages = false;  // if any slab is backed by huge pages
+  // since the start: the slabs, and the buffers that didn't fit any class
+  size_t heap_allocations = 0;
+};
+
+// The bytes of a tile (a file, or the decoded texels), in a fixed size buffer
+// that is borrowed from a pool, and returned to it when it's cleared or
+// destroyed. So the tiles that are streamed in and out don't allocate from
+// the heap, once the pool has grown to the peak number of tiles in the
+// memory. Data that doesn't fit any class gets a buffer from the heap.
+class TileBuffer {
+ public:
+  TileBuffer() = default;
+  explicit TileBuffer(size_t size) { resize(size); }
+  ~TileBuffer() { clear(); }
+
+  TileBuffer(TileBuffer&& other);
+  TileBuffer& operator=(TileBuffer&& other);
+  TileBuffer(const TileBuffer&) = delete;
+  TileBuffer& operator=(const TileBuffer&) = delete;
+
+  unsigned char* data() { return data_; }
+  const unsigned char* data() const { return data_; }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+
+  unsigned char& operator[](size_t i) { return data_[i]; }
+  const unsigned char& operator[](size_t i) const { return data_[i]; }
+
+  // Keeps the contents, and borrows a larger buffer if it doesn't fit.
+  void resize(size_t size);
+
+  // Returns the buffer to the pool.
+  void clear();
+
+ private:
+  static constexpr int kHeapClass = -1;
+
+  unsigned char* data_ = nullptr;
+  size_t size_ = 0, capacity_ = 0;
+  int class_index_ = kHeapClass;
+};
+
+namespace TileBufferPool {
+
+// Can be called from any thread.
+TileBufferPoolStats Stats();
+
+}
+
+} // namespace Cdlod
+
+#endif
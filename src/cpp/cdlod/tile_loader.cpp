@@ -0,0 +1,532 @@
+// Copyright (c), Tamas Csala
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <Silice3D/common/make_unique.hpp>
+
+#ifdef USE_IO_URING
+  #include <unordered_set>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "cdlod/tile_loader.hpp"
+#include "cdlod/texture_data.hpp"
+
+namespace Cdlod {
+
+constexpr int TileLoader::kDefaultBlockingIoDepth;
+constexpr int TileLoader::kDefaultIoUringDepth;
+constexpr size_t TileLoader::kIoUringBufferSize;
+
+namespace {
+
+// Tracks the reads in flight for TileIoStats. The reads are much slower than
+// the lock.
+class IoStatsRecorder {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  Clock::time_point beginRead() {
+    std::lock_guard<std::mutex> lock{mutex_};
+    Clock::time_point now = Clock::now();
+    if (in_flight_++ == 0) {
+      busy_start_ = now;
+    }
+    return now;
+  }
+
+  void endRead(Clock::time_point start, size_t bytes) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    Clock::time_point now = Clock::now();
+    stats_.files++;
+    stats_.bytes += bytes;
+    stats_.read_seconds += Seconds(now - start);
+    if (--in_flight_ == 0) {
+      stats_.busy_seconds += Seconds(now - busy_start_);
+    }
+  }
+
+  void tileRead() {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stats_.tiles++;
+  }
+
+  TileIoStats snapshot() {
+    std::lock_guard<std::mutex> lock{mutex_};
+    TileIoStats stats = stats_;
+    if (in_flight_ != 0) {
+      stats.busy_seconds += Seconds(Clock::now() - busy_start_);
+    }
+    return stats;
+  }
+
+ private:
+  std::mutex mutex_;
+  TileIoStats stats_;
+  size_t in_flight_ = 0;
+  Clock::time_point busy_start_;
+
+  static double Seconds(Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+  }
+};
+
+IoStatsRecorder io_stats;
+
+} // namespace
+
+void TileFiles::add(std::string path, TileBuffer bytes) {
+  files_.emplace_back(std::move(path), std::move(bytes));
+}
+
+TileBuffer TileFiles::take(const std::string& path) {
+  for (auto& file : files_) {
+    if (file.first == path) {
+      return std::move(file.second);
+    }
+  }
+
+  TileBuffer bytes;
+  ReadFile(path, bytes);
+  return bytes;
+}
+
+TileLoader::TileLoader(int io_depth, int decode_thread_count) {
+  if (decode_thread_count <= 0) {
+    decode_thread_count = std::max<int>(std::thread::hardware_concurrency() - 1, 1);
+  }
+
+#ifdef USE_IO_URING
+  try {
+    io_uring_ = Silice3D::make_unique<IoUring>(
+        io_depth > 0 ? io_depth : kDefaultIoUringDepth, kIoUringBufferSize);
+    if (!io_uring_->registeredBuffers()) {
+      std::cerr << "Can't register the io_uring buffers, using unregistered "
+                << "ones" << std::endl;
+    }
+  } catch (const std::exception& ex) {
+    std::cerr << ex.what() << ", using blocking reads" << std::endl;
+  }
+  if (io_uring_) {
+    io_depth = io_uring_->bufferCount();
+  }
+#endif
+  if (io_depth <= 0) {
+    io_depth = kDefaultBlockingIoDepth;
+  }
+  max_decode_backlog_ = io_depth + 2*decode_thread_count;
+
+  for (int i = 0; i < decode_thread_count; ++i) {
+    decode_queues_.emplace_back(new DecodeQueue{});
+  }
+  for (int i = 0; i < decode_thread_count; ++i) {
+    decode_threads_.emplace_back(&TileLoader::decodeThread, this, i);
+  }
+
+#ifdef USE_IO_URING
+  if (io_uring_) {
+    io_threads_.emplace_back(&TileLoader::ioUringThread, this);
+    return;
+  }
+#endif
+  for (int i = 0; i < io_depth; ++i) {
+    io_threads_.emplace_back(&TileLoader::ioThread, this);
+  }
+}
+
+TileLoader::~TileLoader() {
+  // The locks make sure that no thread is between checking stopping_ and
+  // starting to wait.
+  stopping_ = true;
+  {
+    std::lock_guard<std::mutex> lock{io_mutex_};
+    io_condition_.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock{idle_mutex_};
+    idle_condition_.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock{backlog_mutex_};
+    backlog_condition_.notify_all();
+  }
+
+  for (std::thread& thread : io_threads_) {
+    thread.join();
+  }
+  for (std::thread& thread : decode_threads_) {
+    thread.join();
+  }
+}
+
+void TileLoader::enqueue(Job job) {
+  {
+    std::lock_guard<std::mutex> lock{io_mutex_};
+    io_queue_.push_back(QueuedJob{std::move(job), next_sequence_number_++});
+    std::push_heap(io_queue_.begin(), io_queue_.end(), RunsLater{});
+  }
+  io_condition_.notify_one();
+}
+
+void TileLoader::clear() {
+  std::vector<QueuedJob> cancelled_jobs;
+  {
+    std::lock_guard<std::mutex> lock{io_mutex_};
+    std::swap(cancelled_jobs, io_queue_);
+  }
+  for (QueuedJob& queued_job : cancelled_jobs) {
+    if (queued_job.job.cancel) {
+      queued_job.job.cancel();
+    }
+  }
+}
+
+TileIoStats TileLoader::IoStats() {
+  return io_stats.snapshot();
+}
+
+// The backlog slot is reserved first, so the job is taken only when it can
+// be read right away (until then it can be cancelled, or a more important
+// job might come).
+bool TileLoader::takeJob(bool wait, Job& job) {
+  {
+    std::unique_lock<std::mutex> lock{backlog_mutex_};
+    if (wait) {
+      backlog_condition_.wait(lock, [this]() {
+        return stopping_ || decode_backlog_ < max_decode_backlog_;
+      });
+    }
+    if (stopping_ || decode_backlog_ >= max_decode_backlog_) {
+      return false;
+    }
+    decode_backlog_++;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock{io_mutex_};
+    if (wait) {
+      io_condition_.wait(lock, [this]() {
+        return stopping_ || !io_queue_.empty();
+      });
+    }
+    if (!stopping_ && !io_queue_.empty()) {
+      std::pop_heap(io_queue_.begin(), io_queue_.end(), RunsLater{});
+      job = std::move(io_queue_.back().job);
+      io_queue_.pop_back();
+      return true;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock{backlog_mutex_};
+  decode_backlog_--;
+  return false;
+}
+
+void TileLoader::pushDecode(ReadJob read_job) {
+  io_stats.tileRead();
+  DecodeQueue& queue =
+      *decode_queues_[next_decode_queue_++ % decode_queues_.size()];
+  queued_decodes_++;
+  {
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    queue.jobs.push_back(std::move(read_job));
+  }
+  // A worker that is about to park either sees the job in queued_decodes_,
+  // or it's already counted as idle here (both are sequentially consistent).
+  if (idle_decoders_ > 0) {
+    {
+      std::lock_guard<std::mutex> lock{idle_mutex_};
+    }
+    idle_condition_.notify_one();
+  }
+}
+
+void TileLoader::ioThread() {
+  ReadJob read_job;
+  while (takeJob(true, read_job.job)) {
+    for (const std::string& path : read_job.job.paths) {
+      TileBuffer bytes;
+      IoStatsRecorder::Clock::time_point start = io_stats.beginRead();
+      try {
+        ReadFile(path, bytes);
+      } catch (const std::exception&) {
+        io_stats.endRead(start, 0);
+        continue;  // the decode stage tries again, and reports the error
+      }
+      io_stats.endRead(start, bytes.size());
+      read_job.files.add(path, std::move(bytes));
+    }
+    pushDecode(std::move(read_job));
+    read_job = ReadJob{};
+  }
+}
+
+#ifdef USE_IO_URING
+// The reads of the jobs are submitted as long as there are free buffers, and
+// the completed tiles are passed to the decode stage one by one. The files
+// are copied out of the ring's buffers into pooled tile buffers, as the
+// decoded KTX tiles keep the files' bytes until they are uploaded.
+// If the ring fails, the thread continues with blocking reads.
+void TileLoader::ioUringThread() {
+  struct InFlightJob {
+    ReadJob read_job;
+    std::vector<TileBuffer> contents;
+    size_t pending_files = 0;
+  };
+  struct FileRead {
+    InFlightJob* job;
+    size_t file_index;
+    int fd;
+    size_t size, done;
+    IoStatsRecorder::Clock::time_point start;
+  };
+
+  IoUring& ring = *io_uring_;
+  std::vector<FileRead> reads(ring.bufferCount());
+  std::vector<unsigned> free_buffers;
+  for (unsigned i = 0; i < ring.bufferCount(); ++i) {
+    free_buffers.push_back(ring.bufferCount() - 1 - i);
+  }
+  std::deque<FileRead> waiting_reads;  // for a free buffer
+  std::vector<IoUring::Completion> completions;
+  std::unordered_set<InFlightJob*> jobs;
+
+  auto push_job = [this](InFlightJob* job) {
+    for (size_t i = 0; i < job->contents.size(); ++i) {
+      // the failed reads are tried again by the decode stage
+      if (!job->contents[i].empty()) {
+        job->read_job.files.add(job->read_job.job.paths[i],
+                                std::move(job->contents[i]));
+      }
+    }
+    pushDecode(std::move(job->read_job));
+  };
+
+  auto finish_file = [&push_job, &jobs](InFlightJob* job) {
+    if (--job->pending_files == 0) {
+      push_job(job);
+      jobs.erase(job);
+      delete job;
+    }
+  };
+
+  auto start_job = [&](Job&& job) {
+    InFlightJob* in_flight_job = new InFlightJob{};
+    jobs.insert(in_flight_job);
+    in_flight_job->read_job.job = std::move(job);
+    const std::vector<std::string>& paths = in_flight_job->read_job.job.paths;
+    in_flight_job->contents.resize(paths.size());
+    in_flight_job->pending_files = paths.size() + 1;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      int fd = open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+      struct stat file_stat;
+      if (fd < 0 || fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        // counted as an empty read, like the failed blocking reads
+        io_stats.endRead(io_stats.beginRead(), 0);
+        finish_file(in_flight_job);
+        continue;
+      }
+      in_flight_job->contents[i].resize(file_stat.st_size);
+      waiting_reads.push_back(FileRead{in_flight_job, i, fd,
+                                       size_t(file_stat.st_size), 0, {}});
+    }
+    finish_file(in_flight_job);  // for the + 1 above
+  };
+
+  size_t in_flight = 0;
+  try {
+    while (!stopping_) {
+      // New jobs are taken while their files can get a buffer right away. It
+      // waits for a job only if there isn't anything else to do.
+      Job job;
+      while (free_buffers.size() > waiting_reads.size() &&
+             takeJob(in_flight == 0 && waiting_reads.empty(), job)) {
+        start_job(std::move(job));
+      }
+      if (stopping_) {
+        break;
+      }
+
+      while (!waiting_reads.empty() && !free_buffers.empty()) {
+        FileRead read = waiting_reads.front();
+        waiting_reads.pop_front();
+        unsigned buffer = free_buffers.back();
+        free_buffers.pop_back();
+        read.start = io_stats.beginRead();
+        reads[buffer] = read;
+        ring.queueRead(read.fd, buffer,
+                       std::min(read.size, ring.bufferSize()), 0, buffer);
+        in_flight++;
+      }
+      if (in_flight == 0) {
+        continue;
+      }
+
+      // no job can be started until a buffer is freed
+      ring.submitAndWait(1);
+      completions.clear();
+      ring.popCompletions(completions);
+      for (const IoUring::Completion& completion : completions) {
+        unsigned buffer = completion.user_data;
+        FileRead& read = reads[buffer];
+        InFlightJob* job = read.job;
+        TileBuffer& content = job->contents[read.file_index];
+        in_flight--;
+
+        if (completion.result == -EINTR || completion.result == -EAGAIN) {
+          ring.queueRead(read.fd, buffer,
+                         std::min(read.size - read.done, ring.bufferSize()),
+                         read.done, buffer);
+          in_flight++;
+          continue;
+        }
+
+        if (completion.result > 0) {
+          std::memcpy(content.data() + read.done, ring.buffer(buffer),
+                      completion.result);
+          read.done += completion.result;
+          if (read.done < read.size) {
+            // a short read, or a file larger than the buffer
+            ring.queueRead(read.fd, buffer,
+                           std::min(read.size - read.done, ring.bufferSize()),
+                           read.done, buffer);
+            in_flight++;
+            continue;
+          }
+        } else {
+          content.clear();  // an error, or the file was truncated
+        }
+
+        io_stats.endRead(read.start, read.done);
+        close(read.fd);
+        free_buffers.push_back(buffer);
+        finish_file(job);
+      }
+    }
+
+    // the reads in flight have to finish, before the buffers can be freed
+    while (in_flight != 0) {
+      ring.submitAndWait(1);
+      completions.clear();
+      ring.popCompletions(completions);
+      for (const IoUring::Completion& completion : completions) {
+        const FileRead& read = reads[completion.user_data];
+        io_stats.endRead(read.start, 0);
+        close(read.fd);
+        in_flight--;
+      }
+    }
+  } catch (const std::exception& ex) {
+    std::cerr << ex.what() << ", using blocking reads" << std::endl;
+
+    // The reads in flight are abandoned (the ring's buffers are only freed
+    // with the loader, after the kernel is done with them), and the
+    // unfinished files are read again by the decode stage.
+    std::vector<bool> is_free(ring.bufferCount(), false);
+    for (unsigned buffer : free_buffers) {
+      is_free[buffer] = true;
+    }
+    for (unsigned buffer = 0; buffer < ring.bufferCount(); ++buffer) {
+      if (!is_free[buffer]) {
+        waiting_reads.push_back(reads[buffer]);
+        io_stats.endRead(reads[buffer].start, 0);
+      }
+    }
+    for (const FileRead& read : waiting_reads) {
+      read.job->contents[read.file_index].clear();
+      close(read.fd);
+    }
+    waiting_reads.clear();
+    for (InFlightJob* job : jobs) {
+      push_job(job);
+      delete job;
+    }
+    jobs.clear();
+
+    // this thread is one of the readers
+    std::vector<std::thread> readers;
+    for (int i = 1; i < kDefaultBlockingIoDepth; ++i) {
+      readers.emplace_back(&TileLoader::ioThread, this);
+    }
+    ioThread();
+    for (std::thread& reader : readers) {
+      reader.join();
+    }
+    return;
+  }
+
+  for (const FileRead& read : waiting_reads) {
+    close(read.fd);
+  }
+  // the jobs are dropped at exit, like the not yet decoded ones
+  for (InFlightJob* job : jobs) {
+    delete job;
+  }
+}
+#endif
+
+void TileLoader::decodeThread(size_t index) {
+  ReadJob read_job;
+  while (takeDecodeJob(index, read_job)) {
+    read_job.job.decode(read_job.files);
+    read_job = ReadJob{};
+
+    {
+      std::lock_guard<std::mutex> lock{backlog_mutex_};
+      decode_backlog_--;
+    }
+    backlog_condition_.notify_one();
+  }
+}
+
+bool TileLoader::takeDecodeJob(size_t index, ReadJob& read_job) {
+  while (!stopping_) {
+    if (popDecodeJob(index, read_job)) {
+      return true;
+    }
+
+    // nothing to do or to steal, the worker parks until a job is pushed
+    idle_decoders_++;
+    {
+      std::unique_lock<std::mutex> lock{idle_mutex_};
+      idle_condition_.wait(lock, [this]() {
+        return stopping_ || queued_decodes_ > 0;
+      });
+    }
+    idle_decoders_--;
+  }
+  return false;
+}
+
+// The worker takes the oldest job of its own queue, and only if it's empty,
+// it steals the newest one of another.
+bool TileLoader::popDecodeJob(size_t index, ReadJob& read_job) {
+  size_t queue_count = decode_queues_.size();
+  for (size_t i = 0; i < queue_count; ++i) {
+    DecodeQueue& queue = *decode_queues_[(index + i) % queue_count];
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    if (queue.jobs.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      read_job = std::move(queue.jobs.front());
+      queue.jobs.pop_front();
+    } else {
+      read_job = std::move(queue.jobs.back());
+      queue.jobs.pop_back();
+    }
+    queued_decodes_--;
+    return true;
+  }
+  return false;
+}
+
+} // namespace Cdlod
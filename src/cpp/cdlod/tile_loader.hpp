@@ -0,0 +1,173 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_TILE_LOADER_H_
+#define ENGINE_CDLOD_TILE_LOADER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cdlod/io_uring.hpp"
+#include "cdlod/tile_buffer_pool.hpp"
+
+namespace Cdlod {
+
+// The statistics of the I/O stage since the start. The reads of the files
+// that weren't prefetched aren't counted.
+struct TileIoStats {
+  size_t tiles = 0, files = 0, bytes = 0;
+  double busy_seconds = 0;  // while at least one read was in flight
+  double read_seconds = 0;  // the sum of the durations of the reads
+
+  // the average number of reads in flight, while there was any
+  double averageQueueDepth() const {
+    return busy_seconds > 0 ? read_seconds / busy_seconds : 0;
+  }
+  double tilesPerBusySecond() const {
+    return busy_seconds > 0 ? tiles / busy_seconds : 0;
+  }
+};
+
+// The contents of the files of a tile, that were read by the I/O stage.
+class TileFiles {
+ public:
+  void add(std::string path, TileBuffer bytes);
+
+  // Returns the content of the file, and reads it if it wasn't prefetched
+  // (or its read failed, so the error is reported by the caller).
+  TileBuffer take(const std::string& path);
+
+ private:
+  std::vector<std::pair<std::string, TileBuffer>> files_;
+};
+
+// Loads the tiles on a pipeline of two stages with separate threads: the I/O
+// stage reads the files of the tiles, with io_depth reads in flight, in the
+// order of the priorities. The read tiles are distributed between the decode
+// workers, that steal from each other when they run out of work. So the slow
+// reads don't block the decoding, and the other way around. The I/O stage
+// waits if the decode workers are too far behind, so the read but not
+// decoded files don't pile up in the memory.
+//
+// The jobs are read in priority order, but they are only roughly decoded in
+// that order: a worker decodes its own jobs in the order they were read, and
+// it steals the latest one of another worker.
+//
+// If io_uring is available, a single I/O thread submits the reads in batches
+// into io_depth preallocated (registered) buffers. Otherwise io_depth threads
+// do blocking reads. If the ring fails later, the I/O thread reports it, and
+// continues with kDefaultBlockingIoDepth blocking readers.
+class TileLoader {
+ public:
+  struct Job {
+    int priority = 0;  // the smaller, the sooner it's read
+    std::vector<std::string> paths;
+    std::function<void(TileFiles& files)> decode;  // on a decode worker
+    // Called instead of decode, if the job is cleared before its files are
+    // read (on the thread that calls clear).
+    std::function<void()> cancel;
+  };
+
+  // If io_depth isn't positive, a default is used for the backend. If
+  // decode_thread_count isn't positive, a worker is started for every core,
+  // except for the render thread's one.
+  TileLoader(int io_depth, int decode_thread_count);
+  ~TileLoader();
+
+  TileLoader(const TileLoader&) = delete;
+  TileLoader& operator=(const TileLoader&) = delete;
+
+  void enqueue(Job job);
+
+  // Cancels the jobs that aren't read yet. The read ones are decoded anyway,
+  // as their I/O is already done.
+  void clear();
+
+  // of all the loaders, it can be called from any thread
+  static TileIoStats IoStats();
+
+ private:
+  static constexpr int kDefaultBlockingIoDepth = 4;
+  static constexpr int kDefaultIoUringDepth = 16;
+  // The size of an io_uring buffer, the larger files are read in more parts.
+  // The tiles are usually less than 200 KB.
+  static constexpr size_t kIoUringBufferSize = 256 * 1024;
+
+  struct QueuedJob {
+    Job job;
+    size_t sequence_number;  // the jobs with the same priority are FIFO
+  };
+  struct RunsLater {
+    bool operator()(const QueuedJob& a, const QueuedJob& b) const {
+      return a.job.priority != b.job.priority
+          ? a.job.priority > b.job.priority
+          : a.sequence_number > b.sequence_number;
+    }
+  };
+
+  struct ReadJob {
+    Job job;
+    TileFiles files;
+  };
+  // The own deque of a decode worker, the others steal from its back. Only
+  // the owner and the thieves lock it, there isn't a global lock for
+  // claiming the jobs.
+  struct DecodeQueue {
+    std::mutex mutex;
+    std::deque<ReadJob> jobs;
+  };
+
+  // the I/O stage, a heap ordered by RunsLater
+  std::mutex io_mutex_;
+  std::condition_variable io_condition_;
+  std::vector<QueuedJob> io_queue_;
+  size_t next_sequence_number_ = 0;
+
+  // the decode stage
+  std::vector<std::unique_ptr<DecodeQueue>> decode_queues_;
+  std::atomic<size_t> next_decode_queue_{0};
+  // in the deques (it's incremented before the push, so it can be larger
+  // for a moment)
+  std::atomic<size_t> queued_decodes_{0};
+  // the idle workers park here, until a job is pushed
+  std::atomic<size_t> idle_decoders_{0};
+  std::mutex idle_mutex_;
+  std::condition_variable idle_condition_;
+
+  std::mutex backlog_mutex_;
+  std::condition_variable backlog_condition_;  // a job was decoded
+  size_t decode_backlog_ = 0;  // taken by the I/O stage, and not yet decoded
+  size_t max_decode_backlog_;
+
+  std::atomic<bool> stopping_{false};
+  std::vector<std::thread> io_threads_, decode_threads_;
+
+  // Reserves a place in the decode backlog, and takes the most important
+  // job. Returns false if there isn't any (if wait is false), or if the
+  // loader is stopping.
+  bool takeJob(bool wait, Job& job);
+  void pushDecode(ReadJob read_job);
+  void ioThread();
+  void decodeThread(size_t index);
+  // Returns false if the loader is stopping.
+  bool takeDecodeJob(size_t index, ReadJob& read_job);
+  // Pops a job from the worker's own deque, or steals one. Doesn't wait.
+  bool popDecodeJob(size_t index, ReadJob& read_job);
+
+#ifdef USE_IO_URING
+  std::unique_ptr<IoUring> io_uring_;
+  void ioUringThread();
+#endif
+};
+
+} // namespace Cdlod
+
+#endif
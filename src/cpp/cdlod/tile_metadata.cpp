@@ -0,0 +1,200 @@
+// Copyright (c), Tamas Csala
+
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#include "cdlod/tile_metadata.hpp"
+
+namespace Cdlod {
+
+constexpr int TileMetadata::kLevelCount;
+constexpr uint16_t TileMetadata::kUnknownError;
+
+namespace {
+
+struct Header {
+  char magic[4];
+  uint32_t version, face, level_count, record_size, padding;
+};
+
+constexpr uint32_t kVersion = 1;
+
+} // namespace
+
+TileMetadata::TileMetadata(const std::string& path, CubeFace face) {
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping != MAP_FAILED) {
+      data_ = static_cast<const unsigned char*>(mapping);
+      size_ = info.st_size;
+    }
+  }
+  close(fd);
+#else
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (file) {
+    buffer_.resize(file.tellg());
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(buffer_.data()), buffer_.size());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+  }
+#endif
+  if (!data_) {
+    return;
+  }
+
+  Header header;
+  size_t header_size = sizeof(header) + sizeof(level_offsets_);
+  if (size_ < header_size) {
+    std::cerr << path << " is truncated, it's ignored" << std::endl;
+    return;
+  }
+  std::memcpy(&header, data_, sizeof(header));
+  std::memcpy(level_offsets_, data_ + sizeof(header), sizeof(level_offsets_));
+
+  bool valid = std::memcmp(header.magic, "RLMD", 4) == 0 &&
+               header.version == kVersion &&
+               header.face == uint32_t(face) &&
+               header.level_count == kLevelCount &&
+               header.record_size == sizeof(TileMetadataRecord);
+  // level 0 is the last one
+  long tiles_per_row = 1L << CdlodTerrainSettings::kMaxTextureLevel;
+  valid = valid && level_offsets_[0] + tiles_per_row * tiles_per_row *
+                       sizeof(TileMetadataRecord) <= size_;
+  if (!valid) {
+    std::cerr << path << " doesn't match the terrain settings, it's ignored"
+              << std::endl;
+    return;
+  }
+
+  records_ = data_;
+  calculateGeometricErrors();
+}
+
+TileMetadata::~TileMetadata() {
+#ifndef _WIN32
+  if (data_) {
+    munmap(const_cast<unsigned char*>(data_), size_);
+  }
+#endif
+}
+
+long TileMetadata::tilesPerRow(int level) const {
+  return 1L << (CdlodTerrainSettings::kMaxTextureLevel - level);
+}
+
+const TileMetadataRecord* TileMetadata::record(int level, long x,
+                                               long z) const {
+  if (!records_ || level < 0 || kLevelCount <= level) {
+    return nullptr;
+  }
+
+  long tile_size = long(CdlodTerrainSettings::kTextureDimension) << level;
+  return recordAt(level, x / tile_size, z / tile_size);
+}
+
+const TileMetadataRecord* TileMetadata::recordAt(int level, long tx,
+                                                 long tz) const {
+  return reinterpret_cast<const TileMetadataRecord*>(
+      records_ + level_offsets_[level] +
+      (tz * tilesPerRow(level) + tx) * sizeof(TileMetadataRecord));
+}
+
+const TileMetadataRecord::Height* TileMetadata::height(int level, long x,
+                                                       long z) const {
+  const TileMetadataRecord* result = record(level, x, z);
+  if (!result || !(result->height.flags & kTileMetadataPresent)) {
+    return nullptr;
+  }
+  return &result->height;
+}
+
+const TileMetadataRecord::Diffuse* TileMetadata::diffuse(int level, long x,
+                                                         long z) const {
+  const TileMetadataRecord* result = record(level, x, z);
+  if (!result || !(result->diffuse.flags & kTileMetadataPresent)) {
+    return nullptr;
+  }
+  return &result->diffuse;
+}
+
+int TileMetadata::geometricError(int level, long x, long z) const {
+  if (!records_ || level < 0 || kLevelCount <= level) {
+    return -1;
+  }
+
+  long tile_size = long(CdlodTerrainSettings::kTextureDimension) << level;
+  uint16_t error = geometric_errors_[level][(z / tile_size) * tilesPerRow(level)
+                                           + (x / tile_size)];
+  return error == kUnknownError ? -1 : error;
+}
+
+// The roughness of a tile is its error at the resolution of its parent, so
+// the error of a tile is at most the largest error + roughness of its
+// children. Level 0 is the full resolution data, it has no error.
+void TileMetadata::calculateGeometricErrors() {
+  for (int level = 0; level < kLevelCount; ++level) {
+    long tiles_per_row = tilesPerRow(level);
+    std::vector<uint16_t>& errors = geometric_errors_[level];
+    errors.assign(tiles_per_row * tiles_per_row, kUnknownError);
+
+    for (long tz = 0; tz < tiles_per_row; ++tz) {
+      for (long tx = 0; tx < tiles_per_row; ++tx) {
+        const TileMetadataRecord::Height& tile = recordAt(level, tx, tz)->height;
+        if (!(tile.flags & kTileMetadataPresent)) {
+          continue;
+        }
+
+        // the range is an upper bound, even if the children aren't known
+        int error = tile.max - tile.min;
+        if (level > 0) {
+          int children_error = 0;
+          for (int i = 0; i < 4 && children_error < error; ++i) {
+            long cx = 2*tx + (i & 1), cz = 2*tz + (i >> 1);
+            const TileMetadataRecord::Height& child =
+                recordAt(level - 1, cx, cz)->height;
+            uint16_t child_error =
+                geometric_errors_[level - 1][cz * 2*tiles_per_row + cx];
+            if (child_error == kUnknownError) {
+              children_error = error;
+            } else {
+              children_error = std::max(children_error,
+                                        child_error + child.roughness);
+            }
+          }
+          error = std::min(error, children_error);
+        } else {
+          error = 0;
+        }
+        errors[tz * tiles_per_row + tx] =
+            uint16_t(std::min<int>(error, kUnknownError - 1));
+      }
+    }
+  }
+}
+
+uint32_t TileChecksum(const unsigned char* bytes, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+} // namespace Cdlod
@@ -0,0 +1,95 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_TILE_METADATA_H_
+#define ENGINE_CDLOD_TILE_METADATA_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/collision/cube2sphere.hpp"
+
+namespace Cdlod {
+
+enum TileMetadataFlags : uint8_t {
+  kTileMetadataPresent = 1 << 0,
+  kTileMetadataConstant = 1 << 1  // every texel (with the border) is the same
+};
+
+// The record of a node of the tile grid in the metadata sidecar, that the
+// preprocessor writes for every face (see
+// scripts/image_preprocess/preproc_metadata.h, the layouts have to match).
+struct TileMetadataRecord {
+  struct Height {
+    // the range of the texels of the tile (without the border)
+    uint16_t min, max;
+    // The largest error of the tile (in texel values), if it was sampled at
+    // half of its resolution.
+    uint16_t roughness;
+    uint8_t flags;
+    uint8_t padding;
+    // FNV-1a of the level 0 texels, with the border
+    uint32_t checksum;
+  } height;
+
+  struct Diffuse {
+    uint8_t flags;
+    uint8_t color[3];  // RGB, if it's constant
+    uint8_t bc1_block[8];  // the color as a BC1 block, if it's constant
+  } diffuse;
+};
+
+static_assert(sizeof(TileMetadataRecord) == 24, "Unexpected padding");
+
+// The metadata sidecar of a face, memory mapped, so that the tight bounding
+// boxes are known without loading the tiles, and the constant tiles (like the
+// ones of the oceans) can be created without any I/O.
+class TileMetadata {
+ public:
+  // If the file doesn't exist or it doesn't match the settings, every lookup
+  // returns nullptr (and the tiles are loaded as if there was no sidecar).
+  TileMetadata(const std::string& path, CubeFace face);
+  ~TileMetadata();
+
+  TileMetadata(const TileMetadata&) = delete;
+  TileMetadata& operator=(const TileMetadata&) = delete;
+
+  // The records of the elevation tile at the texture level, whose center is
+  // at (x, z), or nullptr, if it wasn't generated with the sidecar.
+  const TileMetadataRecord::Height* height(int level, long x, long z) const;
+  const TileMetadataRecord::Diffuse* diffuse(int level, long x, long z) const;
+
+  // The largest error (in texel values) of the tile at the texture level,
+  // compared to the full resolution data, or -1 if it isn't known. It's
+  // accumulated from the roughness of the descendants, and it's never more
+  // than the range of the tile.
+  int geometricError(int level, long x, long z) const;
+
+  bool valid() const { return records_ != nullptr; }
+
+ private:
+  static constexpr int kLevelCount = CdlodTerrainSettings::kMaxTextureLevel + 1;
+
+  const unsigned char* data_ = nullptr;
+  size_t size_ = 0;
+  std::vector<unsigned char> buffer_;  // if the file isn't mapped
+  const unsigned char* records_ = nullptr;
+  uint64_t level_offsets_[kLevelCount] = {};
+  // per level, in the same order as the records
+  std::vector<uint16_t> geometric_errors_[kLevelCount];
+
+  static constexpr uint16_t kUnknownError = UINT16_MAX;
+
+  long tilesPerRow(int level) const;
+  const TileMetadataRecord* record(int level, long x, long z) const;
+  const TileMetadataRecord* recordAt(int level, long tx, long tz) const;
+  void calculateGeometricErrors();
+};
+
+// Checksum of the texels, the same as TileMetadataRecord::Height::checksum.
+uint32_t TileChecksum(const unsigned char* bytes, size_t size);
+
+} // namespace Cdlod
+
+#endif
@@ -0,0 +1,135 @@
+// Copyright (c), Tamas Csala
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cdlod/trace.hpp"
+
+namespace Cdlod {
+namespace Trace {
+
+bool enabled = false;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Event {
+  const char* name;
+  Clock::time_point time;
+  char phase;  // 'B' or 'E'
+};
+
+// Written only by its thread, and read by Dump(): an event is published by
+// the release store of the size, after the event (and its chunk) is written.
+class ThreadBuffer {
+ public:
+  static constexpr size_t kChunkSize = 1 << 14;
+  static constexpr size_t kMaxChunkCount = 1 << 10;
+
+  ThreadBuffer(int id, std::string name) : id_(id), name_(std::move(name)) {}
+
+  void push(const Event& event) {
+    size_t size = size_.load(std::memory_order_relaxed);
+    if (size == kChunkSize * kMaxChunkCount) {
+      return;  // full, the rest of the events are dropped
+    }
+    std::unique_ptr<Event[]>& chunk = chunks_[size / kChunkSize];
+    if (!chunk) {
+      chunk.reset(new Event[kChunkSize]);
+    }
+    chunk[size % kChunkSize] = event;
+    size_.store(size + 1, std::memory_order_release);
+  }
+
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+  const Event& operator[](size_t i) const {
+    return chunks_[i / kChunkSize][i % kChunkSize];
+  }
+
+  int id() const { return id_; }
+  const std::string& name() const { return name_; }
+
+ private:
+  int id_;
+  std::string name_;
+  std::unique_ptr<Event[]> chunks_[kMaxChunkCount];
+  std::atomic<size_t> size_{0};
+};
+
+constexpr size_t ThreadBuffer::kChunkSize;
+constexpr size_t ThreadBuffer::kMaxChunkCount;
+
+// The buffers are never freed, the pool's threads might exit before Dump().
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<ThreadBuffer>> registry;
+std::thread::id render_thread;
+int loader_count = 0;
+Clock::time_point start_time;
+
+thread_local ThreadBuffer* thread_buffer = nullptr;
+
+ThreadBuffer& GetThreadBuffer() {
+  if (!thread_buffer) {
+    std::lock_guard<std::mutex> lock{registry_mutex};
+    int id = registry.size();
+    std::string name = std::this_thread::get_id() == render_thread
+                       ? "render" : "loader " + std::to_string(loader_count++);
+    registry.emplace_back(new ThreadBuffer{id, std::move(name)});
+    thread_buffer = registry.back().get();
+  }
+  return *thread_buffer;
+}
+
+} // namespace
+
+void Start() {
+  render_thread = std::this_thread::get_id();
+  start_time = Clock::now();
+  enabled = true;
+}
+
+void Begin(const char* name) {
+  GetThreadBuffer().push(Event{name, Clock::now(), 'B'});
+}
+
+void End(const char* name) {
+  GetThreadBuffer().push(Event{name, Clock::now(), 'E'});
+}
+
+bool Dump(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock{registry_mutex};
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  bool first = true;
+  for (const auto& buffer : registry) {
+    fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",\n", buffer->id(), buffer->name().c_str());
+    first = false;
+
+    size_t size = buffer->size();
+    for (size_t i = 0; i < size; ++i) {
+      const Event& event = (*buffer)[i];
+      double ts = std::chrono::duration<double, std::micro>(
+          event.time - start_time).count();
+      fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+              "\"pid\": 1, \"tid\": %d}",
+              event.name, event.phase, ts, buffer->id());
+    }
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
+
+} // namespace Trace
+} // namespace Cdlod
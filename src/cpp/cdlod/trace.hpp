@@ -0,0 +1,57 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_TRACE_H_
+#define ENGINE_CDLOD_TRACE_H_
+
+#include <string>
+
+namespace Cdlod {
+
+// Opt-in recording of begin / end events on the render thread and on the
+// loader threads, that can be saved in the Chrome trace event format (for
+// chrome://tracing or ui.perfetto.dev). Every thread writes its own buffer
+// without any locks, and if tracing isn't enabled, a TraceScope is a single
+// branch.
+namespace Trace {
+
+// Set by Start(), it must not change while other threads are running.
+extern bool enabled;
+
+// Enables the tracing, the calling thread is named as the render thread.
+void Start();
+
+// The name has to be a string literal (or live until Dump()).
+void Begin(const char* name);
+void End(const char* name);
+
+// Writes the events recorded so far, the other threads can still record
+// while this is running. Returns false if the file can't be written.
+bool Dump(const std::string& path);
+
+} // namespace Trace
+
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : name_(Trace::enabled ? name : nullptr) {
+    if (name_) {
+      Trace::Begin(name_);
+    }
+  }
+
+  ~TraceScope() {
+    if (name_) {
+      Trace::End(name_);
+    }
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  const char* name_;
+};
+
+} // namespace Cdlod
+
+#endif
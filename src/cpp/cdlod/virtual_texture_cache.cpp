@@ -0,0 +1,303 @@
+// Copyright (c), Tamas Csala
+
+#include <cassert>
+#include <algorithm>
+
+#include "cdlod/virtual_texture_cache.hpp"
+#include "cdlod/memory_stats.hpp"
+
+namespace Cdlod {
+
+constexpr int VirtualTextureCache::kLevelCount;
+constexpr GLushort VirtualTextureCache::kNoPage;
+
+static GLuint CreatePageArray(GLenum internal_format, GLenum format,
+                              GLenum type, int size, int layer_count) {
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+
+  int level_count = 0;
+  for (int level_size = size; level_size > 0; level_size /= 2) {
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, level_count++, internal_format,
+                 level_size, level_size, layer_count, 0, format, type, nullptr);
+  }
+
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  return texture;
+}
+
+// The size of the mipmap chain of a page array created by CreatePageArray.
+static size_t PageArrayBytes(double texel_size, int size, int layer_count) {
+  double bytes = 0;
+  for (int level_size = size; level_size > 0; level_size /= 2) {
+    // the compressed formats are stored in 4x4 blocks
+    int stored_size = texel_size < 1 ? std::max(level_size, 4) : level_size;
+    bytes += texel_size * stored_size * stored_size * layer_count;
+  }
+  return size_t(bytes);
+}
+
+VirtualTextureCache::VirtualTextureCache(int page_count) : pages_(page_count) {
+  assert(0 < page_count && page_count < 4096);
+
+  elevation_pages_ = CreatePageArray(
+      GL_R16, GL_RED, GL_UNSIGNED_SHORT,
+      CdlodTerrainSettings::kElevationTexSizeWithBorders, page_count);
+  normal_pages_ = CreatePageArray(
+      GL_RG8, GL_RG, GL_UNSIGNED_BYTE,
+      CdlodTerrainSettings::kElevationTexSizeWithBorders, page_count);
+  diffuse_pages_ = CreatePageArray(
+      CdlodTerrainSettings::kCompressedDiffuse
+          ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_RGB8,
+      GL_RGB, GL_UNSIGNED_BYTE,
+      CdlodTerrainSettings::kDiffuseTexSizeWithBorders, page_count);
+
+  glGenTextures(1, &page_table_);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, page_table_);
+  for (int level = 0; level < kLevelCount; ++level) {
+    int n = tileCount(level);
+    page_table_data_[level].resize(6*n*n, kNoPage);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_R16UI, n, n, 6, 0,
+                 GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+                 page_table_data_[level].data());
+    for (auto& dirty : dirty_[level]) {
+      dirty = DirtyRect{0, 0, 0, 0};
+    }
+  }
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, kLevelCount - 1);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  size_t bytes =
+      PageArrayBytes(2, CdlodTerrainSettings::kElevationTexSizeWithBorders,
+                     page_count) +
+      PageArrayBytes(2, CdlodTerrainSettings::kElevationTexSizeWithBorders,
+                     page_count) +
+      PageArrayBytes(CdlodTerrainSettings::kCompressedDiffuse ? 0.5 : 3,
+                     CdlodTerrainSettings::kDiffuseTexSizeWithBorders,
+                     page_count);
+  for (const auto& level : page_table_data_) {
+    bytes += level.size() * sizeof(GLushort);
+  }
+  MemoryAccounting::SetVirtualTextureBytes(bytes);
+}
+
+VirtualTextureCache::~VirtualTextureCache() {
+  GLuint textures[] = {elevation_pages_, normal_pages_, diffuse_pages_, page_table_};
+  glDeleteTextures(4, textures);
+  MemoryAccounting::SetVirtualTextureBytes(0);
+}
+
+GLushort& VirtualTextureCache::entry(int face, int level, int x, int z) {
+  int n = tileCount(level);
+  return page_table_data_[level][(face*n + z)*n + x];
+}
+
+void VirtualTextureCache::markDirty(int face, int level, int min_x, int min_z,
+                                    int max_x, int max_z) {
+  DirtyRect& dirty = dirty_[level][face];
+  if (dirty.empty()) {
+    dirty = DirtyRect{min_x, min_z, max_x, max_z};
+  } else {
+    dirty.min_x = std::min(dirty.min_x, min_x);
+    dirty.min_z = std::min(dirty.min_z, min_z);
+    dirty.max_x = std::max(dirty.max_x, max_x);
+    dirty.max_z = std::max(dirty.max_z, max_z);
+  }
+}
+
+int VirtualTextureCache::findPage() {
+  int lru = -1;
+  for (int i = 0; i < page_count(); ++i) {
+    const Page& page = pages_[i];
+    if (page.owner == nullptr) {
+      return i;
+    }
+    if (!page.pinned && page.last_used < frame_ &&
+        (lru == -1 || page.last_used < pages_[lru].last_used)) {
+      lru = i;
+    }
+  }
+  return lru;
+}
+
+void VirtualTextureCache::evict(int index) {
+  Page& page = pages_[index];
+  unmap(page);
+
+  // The owner has to load the normal and the diffuse layers from the disk
+  // again, if it needs them. The elevation data is kept, it can't be
+  // replaced while the descendants might be reading it.
+  page.owner->is_loaded_to_gpu = false;
+  page.owner->is_evicted = true;
+  page.owner->is_loaded_to_memory = false;
+  page.owner->page = -1;
+  page.owner->residency_generation++;
+  CdlodTerrainSettings::texture_nodes_count--;
+  MemoryAccounting::Update(page.level, MemoryTier::kResident,
+                           page.owner->resident_bytes, 0);
+  page.owner->resident_bytes = 0;
+
+  page = Page{};
+}
+
+// Every entry in the tile's subtree, that points to a less detailed tile
+// should now point to this page.
+void VirtualTextureCache::map(const Page& page, int index) {
+  GLushort new_entry = packEntry(index, page.level);
+  for (int level = page.level; level >= 0; --level) {
+    int shift = page.level - level;
+    int min_x = page.x << shift, min_z = page.z << shift, n = 1 << shift;
+    for (int z = min_z; z < min_z + n; ++z) {
+      for (int x = min_x; x < min_x + n; ++x) {
+        GLushort& e = entry(page.face, level, x, z);
+        if (entryLevel(e) > page.level) {
+          e = new_entry;
+        }
+      }
+    }
+    markDirty(page.face, level, min_x, min_z, min_x + n, min_z + n);
+  }
+}
+
+// Every entry in the tile's subtree, that points to this page should fall
+// back to what the parent tile's entry points to.
+void VirtualTextureCache::unmap(const Page& page) {
+  GLushort fallback = kNoPage;
+  if (page.level + 1 < kLevelCount) {
+    fallback = entry(page.face, page.level + 1, page.x >> 1, page.z >> 1);
+  }
+
+  for (int level = page.level; level >= 0; --level) {
+    int shift = page.level - level;
+    int min_x = page.x << shift, min_z = page.z << shift, n = 1 << shift;
+    for (int z = min_z; z < min_z + n; ++z) {
+      for (int x = min_x; x < min_x + n; ++x) {
+        GLushort& e = entry(page.face, level, x, z);
+        if (entryLevel(e) == page.level) {
+          e = fallback;
+        }
+      }
+    }
+    markDirty(page.face, level, min_x, min_z, min_x + n, min_z + n);
+  }
+}
+
+void VirtualTextureCache::uploadLayer(GLuint texture, int layer,
+                                      const TextureData& data) {
+  glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+  for (size_t i = 0; i < data.level_count; ++i) {
+    const TextureData::Level& level = data.levels[i];
+    if (data.compressed()) {
+      glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer,
+                                level.width, level.height, 1,
+                                data.internal_format, level.size,
+                                data.bytes.data() + level.offset);
+    } else {
+      glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer,
+                      level.width, level.height, 1, data.format, data.type,
+                      data.bytes.data() + level.offset);
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+bool VirtualTextureCache::upload(CubeFace face, int level, int x, int z,
+                                 TextureInfo& texture, bool pinned) {
+  assert(texture.page == -1);
+  int index = findPage();
+  if (index == -1) {
+    return false;
+  }
+  if (pages_[index].owner) {
+    evict(index);
+  }
+
+  if (!texture.elevation_data.empty()) {
+    uploadLayer(elevation_pages_, index, texture.elevation_data);
+  }
+  if (!texture.normal_data.empty()) {
+    uploadLayer(normal_pages_, index, texture.normal_data);
+  }
+  if (!texture.diffuse_data.empty()) {
+    uploadLayer(diffuse_pages_, index, texture.diffuse_data);
+  }
+
+  Page& page = pages_[index];
+  page.owner = &texture;
+  page.face = int(face);
+  page.level = level;
+  page.x = x;
+  page.z = z;
+  page.last_used = frame_;
+  page.pinned = pinned;
+  texture.page = index;
+  map(page, index);
+
+  return true;
+}
+
+void VirtualTextureCache::release(TextureInfo& texture) {
+  if (texture.page != -1) {
+    unmap(pages_[texture.page]);
+    pages_[texture.page] = Page{};
+    texture.page = -1;
+  }
+}
+
+void VirtualTextureCache::touch(const TextureInfo& texture) {
+  if (texture.page != -1) {
+    pages_[texture.page].last_used = frame_;
+  }
+}
+
+void VirtualTextureCache::update() {
+  glBindTexture(GL_TEXTURE_2D_ARRAY, page_table_);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int level = 0; level < kLevelCount; ++level) {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, tileCount(level));
+    for (int face = 0; face < 6; ++face) {
+      DirtyRect& dirty = dirty_[level][face];
+      if (!dirty.empty()) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, dirty.min_x, dirty.min_z,
+                        face, dirty.max_x - dirty.min_x,
+                        dirty.max_z - dirty.min_z, 1, GL_RED_INTEGER,
+                        GL_UNSIGNED_SHORT,
+                        &entry(face, level, dirty.min_x, dirty.min_z));
+        dirty = DirtyRect{0, 0, 0, 0};
+      }
+    }
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  frame_++;
+}
+
+void VirtualTextureCache::bind(GLuint first_unit) const {
+  GLuint textures[] = {elevation_pages_, normal_pages_, diffuse_pages_, page_table_};
+  for (GLuint i = 0; i < 4; ++i) {
+    glActiveTexture(GL_TEXTURE0 + first_unit + i);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textures[i]);
+  }
+  glActiveTexture(GL_TEXTURE0);
+}
+
+void VirtualTextureCache::unbind(GLuint first_unit) const {
+  for (GLuint i = 0; i < 4; ++i) {
+    glActiveTexture(GL_TEXTURE0 + first_unit + i);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  }
+  glActiveTexture(GL_TEXTURE0);
+}
+
+} // namespace Cdlod
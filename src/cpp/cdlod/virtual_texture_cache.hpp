@@ -0,0 +1,94 @@
+// Copyright (c), Tamas Csala
+
+#ifndef ENGINE_CDLOD_VIRTUAL_TEXTURE_CACHE_H_
+#define ENGINE_CDLOD_VIRTUAL_TEXTURE_CACHE_H_
+
+#include <vector>
+#include <glad/glad.h>
+#include <oglwrap/oglwrap.h>
+
+#include "cdlod/texture_info.hpp"
+#include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/collision/cube2sphere.hpp"
+
+namespace Cdlod {
+
+// A software virtual texture for the whole terrain. The elevation, normal and
+// diffuse tiles are stored in the layers of three texture arrays (the
+// physical pages), and a page table maps every (face, level, x, z) tile to
+// the page of the most detailed resident tile that covers it, so the shaders
+// fall back to the coarser tiles automatically.
+//
+// The page table is a 2D texture array (one layer per face), whose mipmap
+// levels correspond to the texture levels. Every entry is a 16 bit unsigned
+// integer, the lower 12 bits are the page, the upper 4 bits are the level of
+// the tile stored in that page.
+class VirtualTextureCache {
+ public:
+  explicit VirtualTextureCache(
+      int page_count = CdlodTerrainSettings::kVirtualTexturePageCount);
+  ~VirtualTextureCache();
+
+  // Uploads the texture data of a tile into a page, evicting the least
+  // recently used one if needed. Pinned pages are never evicted. Returns false
+  // if every page was used in the current frame.
+  bool upload(CubeFace face, int level, int x, int z,
+              TextureInfo& texture, bool pinned);
+
+  // Frees the page of the texture, without notifying its owner.
+  void release(TextureInfo& texture);
+
+  // Marks the page of the texture as used in the current frame.
+  void touch(const TextureInfo& texture);
+
+  // Uploads the modified parts of the page table and starts a new frame.
+  void update();
+
+  void bind(GLuint first_unit) const;
+  void unbind(GLuint first_unit) const;
+
+  int page_count() const { return pages_.size(); }
+
+ private:
+  static constexpr int kLevelCount = CdlodTerrainSettings::kMaxTextureLevel + 1;
+  static constexpr GLushort kNoPage = 0xFFFF;
+
+  struct Page {
+    TextureInfo* owner = nullptr;
+    int face = 0, level = 0, x = 0, z = 0;
+    unsigned last_used = 0;
+    bool pinned = false;
+  };
+
+  struct DirtyRect {
+    int min_x, min_z, max_x, max_z; // max is exclusive
+    bool empty() const { return max_x <= min_x; }
+  };
+
+  std::vector<Page> pages_;
+  unsigned frame_ = 1;
+
+  GLuint elevation_pages_ = 0, normal_pages_ = 0, diffuse_pages_ = 0;
+  GLuint page_table_ = 0;
+
+  // The CPU side copy of the page table, per level: [face][z][x]
+  std::vector<GLushort> page_table_data_[kLevelCount];
+  DirtyRect dirty_[kLevelCount][6];
+
+  static GLushort packEntry(int page, int level) { return (level << 12) | page; }
+  static int entryLevel(GLushort entry) { return entry >> 12; }
+  static int tileCount(int level) { return 1 << (kLevelCount - 1 - level); }
+
+  GLushort& entry(int face, int level, int x, int z);
+  void markDirty(int face, int level, int min_x, int min_z, int max_x, int max_z);
+
+  int findPage();
+  void evict(int page);
+  void map(const Page& page, int index);
+  void unmap(const Page& page);
+  void uploadLayer(GLuint texture, int layer, const TextureData& data);
+};
+
+} // namespace Cdlod
+
+#endif
@@ -1,9 +1,13 @@
 // Copyright (c), Tamas Csala
 
+#include <cstdio>
 #include <Silice3D/core/scene.hpp>
 
 #include "fps_display.hpp"
 #include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/frame_profiler.hpp"
+#include "cdlod/memory_stats.hpp"
+#include "cdlod/tile_buffer_pool.hpp"
 
 FpsDisplay::FpsDisplay(Silice3D::GameObject* parent)
     : Silice3D::GameObject(parent) {
@@ -30,6 +34,80 @@ FpsDisplay::FpsDisplay(Silice3D::GameObject* parent)
   memory_usage_ = AddComponent<Silice3D::Label>(
              "GPU memory usage:", glm::vec2{0.98f, 0.195f}, 1.5f, glm::vec4(1));
   memory_usage_->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+
+  decoded_memory_ = AddComponent<Silice3D::Label>(
+             "Decoded in RAM:", glm::vec2{0.98f, 0.22f}, 1.5f, glm::vec4(1));
+  decoded_memory_->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+
+  queued_tiles_ = AddComponent<Silice3D::Label>(
+             "Queued tiles:", glm::vec2{0.98f, 0.245f}, 1.5f, glm::vec4(1));
+  queued_tiles_->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+
+  tile_reads_ = AddComponent<Silice3D::Label>(
+             "Tile reads:", glm::vec2{0.98f, 0.27f}, 1.5f, glm::vec4(1));
+  tile_reads_->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+
+  level_memory_ = AddComponent<Silice3D::Label>(
+             "GPU MB per level:", glm::vec2{0.98f, 0.295f}, 1.5f, glm::vec4(1));
+  level_memory_->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+
+  fragments_ = AddComponent<Silice3D::Label>(
+             "Terrain fragments:", glm::vec2{0.98f, 0.335f}, 1.5f, glm::vec4(1));
+  fragments_->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+
+  overdraw_ = AddComponent<Silice3D::Label>(
+             "Overdraw:", glm::vec2{0.98f, 0.36f}, 1.5f, glm::vec4(1));
+  overdraw_->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+
+  stage_timings_header_ = AddComponent<Silice3D::Label>(
+             "Frame stages (p50 / p95 / p99):", glm::vec2{0.98f, 0.40f}, 1.5f,
+             glm::vec4(1));
+  stage_timings_header_->set_horizontal_alignment(
+      Silice3D::HorizontalAlignment::kRight);
+
+  for (int i = 0; i < int(Cdlod::FrameStage::kCount); ++i) {
+    Silice3D::Label* label = AddComponent<Silice3D::Label>(
+        std::string{Cdlod::FrameStageName(Cdlod::FrameStage(i))} + ":",
+        glm::vec2{0.98f, 0.425f + i*0.025f}, 1.5f, glm::vec4(1));
+    label->set_horizontal_alignment(Silice3D::HorizontalAlignment::kRight);
+    stage_timings_.push_back(label);
+  }
+}
+
+static double ToMB(size_t bytes) {
+  return bytes / (1024.0 * 1024.0);
+}
+
+static std::string FormatMB(size_t bytes) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.1f", ToMB(bytes));
+  return buffer;
+}
+
+static std::string FormatMs(double ms) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.2f", ms);
+  return buffer;
+}
+
+// p50 / p95 / p99 in milliseconds
+static std::string FormatPercentiles(const Cdlod::StageTimings& timings) {
+  return FormatMs(timings.p50) + " / " + FormatMs(timings.p95) + " / " +
+         FormatMs(timings.p99);
+}
+
+static void PrintStageTimings(const char* name, const char* clock,
+                              const Cdlod::StageTimings& timings) {
+  if (!timings.valid) {
+    return;
+  }
+  std::cout << name << " " << clock << " time: "
+    << FormatMs(timings.p50) << "ms p50, "
+    << FormatMs(timings.p95) << "ms p95, "
+    << FormatMs(timings.p99) << "ms p99 (last "
+    << Cdlod::FrameProfiler::kWindowSize << " frames), "
+    << FormatMs(timings.avg) << "ms avg, "
+    << FormatMs(timings.max) << "ms max" << std::endl;
 }
 
 FpsDisplay::~FpsDisplay() {
@@ -47,9 +125,67 @@ FpsDisplay::~FpsDisplay() {
     << min_memu_ << "MB min, "
     << sum_mem_usage_ / sum_calls_ << "MB avg, "
     << max_memu_ << "MB max" << std::endl;
+
+  Cdlod::TerrainMemoryStats memory_stats = Cdlod::MemoryAccounting::Snapshot();
+  std::cout << "Terrain tile memory at exit: "
+    << FormatMB(memory_stats.tier(Cdlod::MemoryTier::kResident).bytes)
+    << "MB resident, "
+    << FormatMB(memory_stats.tier(Cdlod::MemoryTier::kDecoded).bytes)
+    << "MB decoded" << std::endl;
+  for (int level = 0; level < Cdlod::TerrainMemoryStats::kLevelCount; ++level) {
+    const Cdlod::TileMemoryStats& resident =
+        memory_stats.tier(level, Cdlod::MemoryTier::kResident);
+    const Cdlod::TileMemoryStats& decoded =
+        memory_stats.tier(level, Cdlod::MemoryTier::kDecoded);
+    if (resident.tiles == 0 && decoded.tiles == 0) {
+      continue;
+    }
+    std::cout << "  Level " << level << ": "
+      << resident.tiles << " tiles, " << FormatMB(resident.bytes)
+      << "MB resident, "
+      << decoded.tiles << " tiles, " << FormatMB(decoded.bytes)
+      << "MB decoded" << std::endl;
+  }
+
+  std::cout << "Terrain overdraw: "
+    << min_overdraw_ << " min, "
+    << sum_overdraw_ / sum_calls_ << " avg, "
+    << max_overdraw_ << " max" << std::endl;
+
+  // sustained: while the I/O stage was busy
+  Cdlod::TileIoStats io_stats = Cdlod::TileLoader::IoStats();
+  std::cout << "Tile reads: " << io_stats.tiles << " tiles, "
+    << FormatMB(io_stats.bytes) << "MB, "
+    << static_cast<int>(io_stats.tilesPerBusySecond()) << " tiles/s sustained, "
+    << io_stats.averageQueueDepth() << " avg queue depth" << std::endl;
+
+  // the heap allocations only grow the pool, or are for oversized tiles
+  Cdlod::TileBufferPoolStats pool_stats = Cdlod::TileBufferPool::Stats();
+  std::cout << "Tile buffer pool: " << FormatMB(pool_stats.reserved_bytes)
+    << "MB" << (pool_stats.huge_pages ? " (huge pages), " : ", ");
+  const char* class_names[] = {"elevation", "diffuse"};
+  for (int i = 0; i < Cdlod::TileBufferPoolStats::kClassCount; ++i) {
+    const Cdlod::TileBufferClassStats& class_stats = pool_stats.classes[i];
+    std::cout << class_stats.buffer_count << " " << class_names[i] << " ("
+      << class_stats.buffer_size / 1024 << "KB), ";
+  }
+  std::cout << pool_stats.heap_allocations << " heap allocations" << std::endl;
+
+  const Cdlod::FrameProfiler& profiler = Cdlod::FrameProfiler::Get();
+  for (int i = 0; i < int(Cdlod::FrameStage::kCount); ++i) {
+    Cdlod::FrameStage stage = Cdlod::FrameStage(i);
+    PrintStageTimings(Cdlod::FrameStageName(stage), "CPU",
+                      profiler.cpuTimings(stage));
+    PrintStageTimings(Cdlod::FrameStageName(stage), "GPU",
+                      profiler.gpuTimings(stage));
+  }
 }
 
 void FpsDisplay::Update() {
+  // The stages of the previous frame have finished by now.
+  Cdlod::FrameProfiler& profiler = Cdlod::FrameProfiler::Get();
+  profiler.nextFrame();
+
   sum_time_ += scene_->camera_time().dt();
   if (sum_time_ < 0.0) {
     return;
@@ -63,8 +199,19 @@ void FpsDisplay::Update() {
   size_t triangle_count = (geom_nodes_count
         << (2*(CdlodTerrainSettings::kNodeDimensionExp-1))) / 1000;
   size_t triangles_per_sec = triangle_count * fps / 1000;
-  size_t gpu_mem_usage = CdlodTerrainSettings::texture_nodes_count
-                         *(262*262*2 + 260*260*3)/1024/1024;
+  // The virtual texture's pages are allocated upfront, so the whole pool is
+  // used regardless of how many of them are resident.
+  Cdlod::TerrainMemoryStats memory_stats = Cdlod::MemoryAccounting::Snapshot();
+  const Cdlod::TileMemoryStats& resident =
+      memory_stats.tier(Cdlod::MemoryTier::kResident);
+  const Cdlod::TileMemoryStats& decoded =
+      memory_stats.tier(Cdlod::MemoryTier::kDecoded);
+  double gpu_mem_usage = ToMB(memory_stats.virtual_texture_bytes != 0
+                              ? memory_stats.virtual_texture_bytes
+                              : resident.bytes);
+  // the fragments that passed the depth test in the terrain's main pass
+  size_t fragments_count = CdlodTerrainSettings::fragments_count;
+  double overdraw = double(fragments_count) / screen_pixels_;
 
   sum_frame_num_ += 1;
   min_fps_ = std::min(min_fps_, fps);
@@ -75,6 +222,9 @@ void FpsDisplay::Update() {
   sum_mem_usage_ += gpu_mem_usage;
   min_memu_ = std::min<double>(min_memu_, gpu_mem_usage);
   max_memu_ = std::max<double>(max_memu_, gpu_mem_usage);
+  sum_overdraw_ += overdraw;
+  min_overdraw_ = std::min(min_overdraw_, overdraw);
+  max_overdraw_ = std::max(max_overdraw_, overdraw);
 
   if (accum_time_ > kRefreshInterval) {
     fps_->set_text("FPS: " + std::to_string(static_cast<int>(fps)));
@@ -91,14 +241,60 @@ void FpsDisplay::Update() {
     texture_nodes_->set_text("Texture nodes: " +
       std::to_string(CdlodTerrainSettings::texture_nodes_count));
 
-    memory_usage_->set_text("GPU memory usage: " +
-      std::to_string(gpu_mem_usage) + "MB");
+    std::string memory_usage = "GPU memory usage: " +
+      FormatMB(resident.bytes) + "MB";
+    if (memory_stats.virtual_texture_bytes != 0) {
+      memory_usage += " in a " + FormatMB(memory_stats.virtual_texture_bytes) +
+                      "MB pool";
+    }
+    memory_usage_->set_text(memory_usage);
+
+    decoded_memory_->set_text("Decoded in RAM: " + FormatMB(decoded.bytes) +
+      "MB (" + std::to_string(decoded.tiles) + " tiles)");
+
+    queued_tiles_->set_text("Queued tiles: " + std::to_string(
+      memory_stats.tier(Cdlod::MemoryTier::kQueued).tiles));
+
+    Cdlod::TileIoStats io_stats = Cdlod::TileLoader::IoStats();
+    double busy_seconds = io_stats.busy_seconds - last_io_stats_.busy_seconds;
+    double queue_depth = busy_seconds > 0
+        ? (io_stats.read_seconds - last_io_stats_.read_seconds) / busy_seconds
+        : 0;
+    tile_reads_->set_text("Tile reads: " + std::to_string(static_cast<int>(
+      (io_stats.tiles - last_io_stats_.tiles) / accum_time_)) + "/s, queue depth " +
+      std::to_string(queue_depth).substr(0, 4));
+    last_io_stats_ = io_stats;
+
+    std::string level_memory = "GPU MB per level:";
+    for (int level = 0; level < Cdlod::TerrainMemoryStats::kLevelCount; ++level) {
+      level_memory += " " + FormatMB(
+        memory_stats.tier(level, Cdlod::MemoryTier::kResident).bytes);
+    }
+    level_memory_->set_text(level_memory);
+
+    fragments_->set_text("Terrain fragments: " +
+      std::to_string(fragments_count / 1000) + "K");
+
+    overdraw_->set_text("Overdraw: " +
+      std::to_string(overdraw).substr(0, 4) + "x");
+
+    for (int i = 0; i < int(Cdlod::FrameStage::kCount); ++i) {
+      Cdlod::FrameStage stage = Cdlod::FrameStage(i);
+      std::string text = std::string{Cdlod::FrameStageName(stage)} + ": " +
+                         FormatPercentiles(profiler.cpuTimings(stage)) + "ms";
+      Cdlod::StageTimings gpu_timings = profiler.gpuTimings(stage);
+      if (gpu_timings.valid) {
+        text += ", GPU " + FormatPercentiles(gpu_timings) + "ms";
+      }
+      stage_timings_[i]->set_text(text);
+    }
 
     accum_time_ = accum_calls_ = 0;
   }
 }
 
-void FpsDisplay::ScreenResized(size_t /*width*/, size_t height) {
+void FpsDisplay::ScreenResized(size_t width, size_t height) {
+  screen_pixels_ = std::max<size_t>(width * height, 1);
   float scale = 0.5 + (height / 1080.0);
   fps_->set_scale(scale);
   geom_nodes_->set_scale(scale);
@@ -106,5 +302,15 @@ void FpsDisplay::ScreenResized(size_t /*width*/, size_t height) {
   triangle_per_sec_->set_scale(scale);
   texture_nodes_->set_scale(scale);
   memory_usage_->set_scale(scale);
+  decoded_memory_->set_scale(scale);
+  queued_tiles_->set_scale(scale);
+  level_memory_->set_scale(scale);
+  tile_reads_->set_scale(scale);
+  fragments_->set_scale(scale);
+  overdraw_->set_scale(scale);
+  stage_timings_header_->set_scale(scale);
+  for (Silice3D::Label* label : stage_timings_) {
+    label->set_scale(scale);
+  }
 }
 
@@ -3,9 +3,12 @@
 #ifndef LOE_FPS_DISPLAY_H_
 #define LOE_FPS_DISPLAY_H_
 
+#include <vector>
 #include <Silice3D/core/game_object.hpp>
 #include <Silice3D/gui/label.hpp>
 
+#include "cdlod/tile_loader.hpp"
+
 class FpsDisplay : public Silice3D::GameObject {
  public:
   FpsDisplay(Silice3D::GameObject* parent);
@@ -15,12 +18,20 @@ class FpsDisplay : public Silice3D::GameObject {
   Silice3D::Label *fps_;
   Silice3D::Label *geom_nodes_, *triangle_count_, *triangle_per_sec_;
   Silice3D::Label *texture_nodes_, *memory_usage_;
+  Silice3D::Label *decoded_memory_, *queued_tiles_, *level_memory_;
+  Silice3D::Label *tile_reads_;
+  Silice3D::Label *fragments_, *overdraw_;
+  Silice3D::Label *stage_timings_header_;
+  std::vector<Silice3D::Label*> stage_timings_;  // per Cdlod::FrameStage
 
   constexpr static const float kRefreshInterval = 0.1;
   double sum_frame_num_ = 0, min_fps_ = 1.0/0.0, max_fps_ = 0;
   double sum_triangle_num_ = 0, min_triangles_ = 1.0/0.0, max_triangles_ = 0;
   double sum_mem_usage_ = 0, min_memu_ = 1.0/0.0, max_memu_ = 0;
+  double sum_overdraw_ = 0, min_overdraw_ = 1.0/0.0, max_overdraw_ = 0;
   double sum_time_ = -0.1, sum_calls_ = 0, accum_time_ = 0, accum_calls_ = 0;
+  size_t screen_pixels_ = 1;
+  Cdlod::TileIoStats last_io_stats_;
 
   virtual void Update() override;
   virtual void ScreenResized(size_t width, size_t height) override;
@@ -0,0 +1,72 @@
+// Copyright (c), Tamas Csala
+
+#include <string>
+#include <stdexcept>
+
+#include "launch_options.hpp"
+#include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/trace.hpp"
+
+LaunchOptions ParseLaunchOptions(int argc, char* argv[]) {
+  LaunchOptions options;
+  bool has_replay_output = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--virtual-texturing") {
+      options.virtual_texturing = true;
+    } else if (arg == "--io-depth" && i+1 < argc) {
+      options.io_depth = std::stoi(argv[++i]);
+    } else if (arg == "--decode-threads" && i+1 < argc) {
+      options.decode_threads = std::stoi(argv[++i]);
+    } else if (arg == "--huge-pages") {
+      options.huge_pages = true;
+    } else if (arg == "--warm-up-levels" && i+1 < argc) {
+      options.warm_up_levels = std::stoi(argv[++i]);
+    } else if (arg == "--residency-cache" && i+1 < argc) {
+      options.residency_cache_path = argv[++i];
+    } else if (arg == "--residency-cache-payloads") {
+      options.residency_cache_payloads = true;
+    } else if (arg == "--trace" && i+1 < argc) {
+      options.trace_path = argv[++i];
+    } else if (arg == "--record" && i+1 < argc) {
+      options.record_path = argv[++i];
+    } else if (arg == "--replay" && i+1 < argc) {
+      options.replay_path = argv[++i];
+    } else if (arg == "--replay-output" && i+1 < argc) {
+      options.replay_output_path = argv[++i];
+      has_replay_output = true;
+    } else {
+      throw std::invalid_argument("Unknown argument: " + arg + "\n"
+                                  "Usage: " + argv[0] + " [--virtual-texturing]"
+                                  " [--io-depth <n>] [--decode-threads <n>]"
+                                  " [--huge-pages] [--warm-up-levels <n>]"
+                                  " [--residency-cache <file>"
+                                  " [--residency-cache-payloads]]"
+                                  " [--trace <file.json>]"
+                                  " [--record <path.txt> | --replay <path.txt>"
+                                  " [--replay-output <stats.csv>]]");
+    }
+  }
+  if (!options.record_path.empty() && !options.replay_path.empty()) {
+    throw std::invalid_argument("--record and --replay can't be used together");
+  }
+  if (has_replay_output && options.replay_path.empty()) {
+    throw std::invalid_argument("--replay-output requires --replay");
+  }
+  if (options.residency_cache_payloads && options.residency_cache_path.empty()) {
+    throw std::invalid_argument("--residency-cache-payloads requires "
+                                "--residency-cache");
+  }
+  return options;
+}
+
+void ApplyLaunchOptions(const LaunchOptions& options) {
+  CdlodTerrainSettings::virtual_texturing = options.virtual_texturing;
+  CdlodTerrainSettings::loader_io_depth = options.io_depth;
+  CdlodTerrainSettings::loader_decode_threads = options.decode_threads;
+  CdlodTerrainSettings::huge_page_tile_buffers = options.huge_pages;
+  CdlodTerrainSettings::warm_up_levels = options.warm_up_levels;
+  if (!options.trace_path.empty()) {
+    Cdlod::Trace::Start();
+  }
+}
@@ -0,0 +1,43 @@
+// Copyright (c), Tamas Csala
+
+#ifndef LOE_LAUNCH_OPTIONS_H_
+#define LOE_LAUNCH_OPTIONS_H_
+
+#include <string>
+
+struct LaunchOptions {
+  // Use the page table based virtual texture instead of bindless textures.
+  bool virtual_texturing = false;
+  // The tile reads in flight (0: the default of the I/O backend), and the
+  // tile decoder threads (0: one per core).
+  int io_depth = 0;
+  int decode_threads = 0;
+  // Back the tile buffers with huge pages.
+  bool huge_pages = false;
+  // The texture levels that are loaded behind the loading screen.
+  int warm_up_levels = 3;
+  // Save the resident tiles and the camera's pose here at exit, and warm up
+  // with them at the next start (see ResidencySnapshot). Empty if disabled.
+  std::string residency_cache_path;
+  // Save the files of the tiles into the residency snapshot too.
+  bool residency_cache_payloads = false;
+  // Record a trace of the render and loader threads, and save it here (in
+  // the Chrome trace event format) at exit. Empty if tracing is disabled.
+  std::string trace_path;
+  // Record the camera's path to this file (see CameraPathRecorder).
+  std::string record_path;
+  // Replay a recorded camera path, write the statistics of the frames to
+  // replay_output_path, and exit (see CameraPathPlayer).
+  std::string replay_path;
+  std::string replay_output_path = "replay_stats.csv";
+};
+
+// Parses the command line arguments, throws std::invalid_argument on an
+// unknown argument.
+LaunchOptions ParseLaunchOptions(int argc, char* argv[]);
+
+// Applies the options to the global settings, has to be called before the
+// scene is loaded.
+void ApplyLaunchOptions(const LaunchOptions& options);
+
+#endif  // LOE_LAUNCH_OPTIONS_H_
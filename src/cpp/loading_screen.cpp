@@ -4,7 +4,9 @@
 #include <oglwrap/oglwrap.h>
 #include <Silice3D/gui/label.hpp>
 
-void ShowLoadingScreen(Silice3D::Scene* scene) {
+#include "loading_screen.hpp"
+
+void ShowLoadingScreen(Silice3D::Scene* scene, const std::string& status) {
   glm::vec2 window_size = scene->engine()->window_size();
 
   Silice3D::Label label{
@@ -15,7 +17,7 @@ void ShowLoadingScreen(Silice3D::Scene* scene) {
   label.ScreenResized(window_size.x, window_size.y);
 
   Silice3D::Label label2{
-    nullptr, "Loading please wait...", glm::vec2{0.5, 0.54}, 1.5
+    nullptr, status, glm::vec2{0.5, 0.54}, 1.5
   };
   label2.set_vertical_alignment(Silice3D::VerticalAlignment::kCenter);
   label2.set_horizontal_alignment(Silice3D::HorizontalAlignment::kCenter);
@@ -25,6 +27,8 @@ void ShowLoadingScreen(Silice3D::Scene* scene) {
                                  {gl::kCullFace, false},
                                  {gl::kDepthTest, false}}};
   gl::BlendFunc(gl::kSrcAlpha, gl::kOneMinusSrcAlpha);
+  // it's drawn again for every step of the warm-up
+  glClear(GL_COLOR_BUFFER_BIT);
   label.Render2D();
   label2.Render2D();
 }
@@ -3,10 +3,14 @@
 #ifndef LOE_LOADING_SCREEN_H_
 #define LOE_LOADING_SCREEN_H_
 
+#include <string>
+
 namespace Silice3D {
   class Scene;
 }
 
-void ShowLoadingScreen(Silice3D::Scene* scene);
+// Draws the loading screen, with the status below the title.
+void ShowLoadingScreen(Silice3D::Scene* scene,
+                       const std::string& status = "Loading please wait...");
 
 #endif  // LOE_LOADING_SCREEN_H_
@@ -9,12 +9,26 @@
  */
 
 #include "main_scene.hpp"
+#include "launch_options.hpp"
+#include "cdlod/trace.hpp"
 
 int main(int argc, char* argv[]) {
   try {
+    LaunchOptions options = ParseLaunchOptions(argc, argv);
+    ApplyLaunchOptions(options);
+
     Silice3D::GameEngine engine;
-    engine.LoadScene(std::unique_ptr<Silice3D::Scene>{new MainScene{&engine, engine.window()}});
+    engine.LoadScene(std::unique_ptr<Silice3D::Scene>{
+        new MainScene{&engine, engine.window(), options}});
     engine.Run();
+
+    if (!options.trace_path.empty()) {
+      if (Cdlod::Trace::Dump(options.trace_path)) {
+        std::cout << "Trace saved to " << options.trace_path << std::endl;
+      } else {
+        std::cerr << "Can't write " << options.trace_path << std::endl;
+      }
+    }
   } catch(const std::exception& err) {
     std::cerr << err.what();
   }
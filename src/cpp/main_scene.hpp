@@ -1,6 +1,8 @@
 #ifndef SCENES_MAIN_SCENE_H_
 #define SCENES_MAIN_SCENE_H_
 
+#include <iostream>
+#include <stdexcept>
 #include <Silice3D/core/scene.hpp>
 #include <Silice3D/camera/third_personal_camera.hpp>
 #include <Silice3D/camera/free_fly_camera.hpp>
@@ -10,11 +12,16 @@
 #include "terrain.hpp"
 #include "fps_display.hpp"
 #include "scattering.hpp"
+#include "camera_path.hpp"
+#include "launch_options.hpp"
 
 class MainScene : public Silice3D::Scene {
  public:
-  MainScene(Silice3D::GameEngine* engine, GLFWwindow* window)
-      : Scene(engine, window) {
+  MainScene(Silice3D::GameEngine* engine, GLFWwindow* window,
+            const LaunchOptions& options)
+      : Scene(engine, window)
+      , residency_cache_path_(options.residency_cache_path)
+      , residency_cache_payloads_(options.residency_cache_payloads) {
     #if !SILICE3D_NO_FULLSCREEN
       glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     #endif
@@ -22,8 +29,20 @@ class MainScene : public Silice3D::Scene {
     ShowLoadingScreen(scene());
     glfwSwapBuffers(window);
 
-    AddComponent<Skybox>();
-    AddComponent<Terrain>();
+    Skybox* skybox = AddComponent<Skybox>();
+    terrain_ = AddComponent<Terrain>();
+    Cdlod::ResidencySnapshot snapshot;
+    bool has_snapshot = !residency_cache_path_.empty() &&
+        Cdlod::LoadResidencySnapshot(residency_cache_path_, snapshot);
+    terrain_->WarmUp(snapshot.tiles,
+                     [this, window](const Cdlod::WarmUpProgress& progress) {
+      ShowLoadingScreen(scene(), "Loading tiles " +
+                        std::to_string(progress.loaded) + "/" +
+                        std::to_string(progress.total) + ", uploaded " +
+                        std::to_string(progress.uploaded));
+      glfwSwapBuffers(window);
+      glfwPollEvents();
+    });
 
     int radius = CdlodTerrainSettings::kSphereRadius;
     tp_camera_ = AddComponent<Silice3D::ThirdPersonalCamera>(
@@ -31,17 +50,71 @@ class MainScene : public Silice3D::Scene {
         5, 1, 0.005, 4, radius, radius);
     set_camera(tp_camera_);
 
+    if (has_snapshot && options.replay_path.empty()) {
+      // continue from where the last session ended
+      RemoveComponent(tp_camera_);
+      tp_camera_ = nullptr;
+      free_fly_camera_ = AddComponent<Silice3D::FreeFlyCamera>(
+          M_PI/3, 2, 3*radius, snapshot.camera_pos,
+          snapshot.camera_pos + snapshot.camera_forward, 10, 5);
+      free_fly_camera_->transform().set_up(snapshot.camera_up);
+      set_camera(free_fly_camera_);
+    }
+    // the saved files aren't needed anymore
+    snapshot.tiles.clear();
+
     AddComponent<Scattering>();
     AddComponent<FpsDisplay>();
+
+    if (!options.record_path.empty()) {
+      AddComponent<CameraPathRecorder>(options.record_path);
+    } else if (!options.replay_path.empty()) {
+      // The player moves a free fly camera that doesn't react to the input.
+      auto player = AddComponent<CameraPathPlayer>(
+          window, options.replay_path, options.replay_output_path);
+      const CameraPathSample& sample = player->firstSample();
+      RemoveComponent(tp_camera_);
+      tp_camera_ = nullptr;
+      free_fly_camera_ = AddComponent<Silice3D::FreeFlyCamera>(
+          M_PI/3, 2, 3*radius, sample.pos, sample.pos + sample.forward, 0, 0);
+      set_camera(free_fly_camera_);
+      // the lighting is stepped with the camera
+      skybox->set_fixed_timestep(kCameraPathTimestep);
+      replaying_ = true;
+    }
+  }
+
+  ~MainScene() {
+    if (residency_cache_path_.empty()) {
+      return;
+    }
+    const Silice3D::Transform& transform = camera()->transform();
+    Cdlod::ResidencySnapshot snapshot;
+    snapshot.camera_pos = transform.pos();
+    snapshot.camera_forward = transform.forward();
+    snapshot.camera_up = transform.up();
+    snapshot.tiles = terrain_->ResidentTiles();
+    try {
+      Cdlod::SaveResidencySnapshot(residency_cache_path_, snapshot,
+                                   residency_cache_payloads_);
+      std::cout << "Residency snapshot: " << snapshot.tiles.size()
+                << " tiles saved to " << residency_cache_path_ << std::endl;
+    } catch (const std::exception& ex) {
+      std::cerr << ex.what() << std::endl;
+    }
   }
 
   private:
+    Terrain* terrain_ = nullptr;
+    std::string residency_cache_path_;
+    bool residency_cache_payloads_ = false;
     Silice3D::FreeFlyCamera* free_fly_camera_ = nullptr;
     Silice3D::ThirdPersonalCamera* tp_camera_ = nullptr;
+    bool replaying_ = false;
 
   virtual void KeyAction(int key, int scancode, int action, int mods) override {
     int radius = CdlodTerrainSettings::kSphereRadius;
-    if (action == GLFW_PRESS) {
+    if (action == GLFW_PRESS && !replaying_) {
       if (key == GLFW_KEY_SPACE) {
         if (free_fly_camera_) {
           glm::dvec3 pos = free_fly_camera_->transform().pos();
@@ -93,6 +166,17 @@ class MainScene : public Silice3D::Scene {
         CdlodTerrainSettings::render = !CdlodTerrainSettings::render;
       } else if (key == GLFW_KEY_KP_2) {
         CdlodTerrainSettings::update = !CdlodTerrainSettings::update;
+      } else if (key == GLFW_KEY_KP_3) {
+        CdlodTerrainSettings::sort_front_to_back =
+            !CdlodTerrainSettings::sort_front_to_back;
+      } else if (key == GLFW_KEY_KP_4) {
+        CdlodTerrainSettings::depth_prepass = !CdlodTerrainSettings::depth_prepass;
+      } else if (key == GLFW_KEY_KP_5) {
+        CdlodTerrainSettings::roughness_aware_lod =
+            !CdlodTerrainSettings::roughness_aware_lod;
+      } else if (key == GLFW_KEY_KP_6) {
+        CdlodTerrainSettings::screen_space_lod =
+            !CdlodTerrainSettings::screen_space_lod;
       }
     }
   }
@@ -103,7 +187,8 @@ class MainScene : public Silice3D::Scene {
     double z_far = 1000 * height, z_near = 1;
     cam->set_z_far(z_far);
     cam->set_z_near(z_near);
-    if (free_fly_camera_) {
+    // the recorded up vector is used in the replay
+    if (free_fly_camera_ && !replaying_) {
       auto t = free_fly_camera_->transform();
       glm::vec3 new_up = glm::normalize(t.pos());
       t.set_up(new_up);
@@ -5,6 +5,7 @@
 
 #include "scattering.hpp"
 #include "cdlod/cdlod_terrain_settings.hpp"
+#include "cdlod/frame_profiler.hpp"
 
 Scattering::Scattering(Silice3D::GameObject* parent)
     : Silice3D::GameObject(parent)
@@ -78,6 +79,8 @@ void Scattering::Update() {
 }
 
 void Scattering::Render2D() {
+  Cdlod::FrameProfiler::ScopedCpuTimer cpu_timer{Cdlod::FrameStage::kPostProcess};
+  Cdlod::FrameProfiler::ScopedGpuTimer gpu_timer{Cdlod::FrameStage::kPostProcess};
   gl::Unbind(gl::kFramebuffer);
 
   gl::BindToTexUnit(color_tex_, 0);
@@ -37,7 +37,11 @@ glm::vec3 Skybox::GetLightSourcePos() const {
 }
 
 void Skybox::Update() {
-  time_ += scene_->environment_time().dt() * mult_;
+  if (fixed_timestep_ > 0) {
+    time_ += fixed_timestep_;
+  } else {
+    time_ += scene_->environment_time().dt() * mult_;
+  }
 }
 
 void Skybox::KeyAction(int key, int scancode, int action, int mods) {
@@ -22,9 +22,15 @@ class Skybox : public Silice3D::GameObject {
   virtual void Update() override;
   virtual void KeyAction(int key, int scancode, int action, int mods) override;
 
+  // Advances the time of the day by dt per frame instead of the elapsed time
+  // (and ignores the time lapse keys), so the sun is at the same position in
+  // the same frame of a replay. 0 disables it.
+  void set_fixed_timestep(double dt) { fixed_timestep_ = dt; }
+
  private:
   float time_;
   float mult_ = 1.0;
+  double fixed_timestep_ = 0;
   gl::CubeShape cube_;
 
   Silice3D::ShaderProgram prog_;
@@ -1,29 +1,75 @@
 // Copyright (c), Tamas Csala
 
+#include <chrono>
+#include <iostream>
 #include <string>
 #include <Silice3D/core/scene.hpp>
 #include <Silice3D/camera/perspective_camera.hpp>
 
 #include "terrain.hpp"
+#include "cdlod/cdlod_terrain_settings.hpp"
+
+static const char* VertexShader() {
+  return CdlodTerrainSettings::virtual_texturing ? "terrain_vt.vert" : "terrain.vert";
+}
+
+static const char* FragmentShader() {
+  return CdlodTerrainSettings::virtual_texturing ? "terrain_vt.frag" : "terrain.frag";
+}
 
 Terrain::Terrain(Silice3D::GameObject* parent)
     : Silice3D::GameObject(parent)
     , mesh_(scene_->shader_manager())
-    , prog_(scene_->shader_manager()->get("terrain.vert"),
-            scene_->shader_manager()->get("terrain.frag"))
+    , prog_(scene_->shader_manager()->get(VertexShader()),
+            scene_->shader_manager()->get(FragmentShader()))
+    , depth_prog_(scene_->shader_manager()->get(VertexShader()),
+                  scene_->shader_manager()->get("terrain_depth.frag"))
     , uDepthCoef_(prog_, "uDepthCoef")
     , uProjectionMatrix_(prog_, "uProjectionMatrix")
     , uCameraMatrix_(prog_, "uCameraMatrix")
-    , uModelMatrix_(prog_, "uModelMatrix") {
+    , uModelMatrix_(prog_, "uModelMatrix")
+    , uDepthPrepassDepthCoef_(depth_prog_, "uDepthCoef")
+    , uDepthPrepassProjectionMatrix_(depth_prog_, "uProjectionMatrix")
+    , uDepthPrepassCameraMatrix_(depth_prog_, "uCameraMatrix")
+    , uDepthPrepassModelMatrix_(depth_prog_, "uModelMatrix") {
+  gl::Use(depth_prog_);
+  mesh_.SetupDepthPrepass(depth_prog_);
+  depth_prog_.validate();
+
   gl::Use(prog_);
   mesh_.Setup(prog_);
 
   prog_.validate();
 }
 
+void Terrain::WarmUp(const std::vector<Cdlod::SnapshotTile>& snapshot_tiles,
+                     const std::function<void(const Cdlod::WarmUpProgress&)>&
+                         show_progress) {
+  auto start = std::chrono::steady_clock::now();
+  mesh_.StartWarmUp(snapshot_tiles);
+  Cdlod::WarmUpProgress progress;
+  while (mesh_.WarmUpStep(&progress)) {
+    show_progress(progress);
+  }
+  if (progress.total != 0) {
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    std::cout << "Warm-up: " << progress.total << " tiles in " << time.count()
+              << "s" << std::endl;
+  }
+}
+
 void Terrain::Render() {
   auto cam = dynamic_cast<Silice3D::PerspectiveCamera*>(scene_->camera());
 
+  if (CdlodTerrainSettings::depth_prepass) {
+    gl::Use(depth_prog_);
+    depth_prog_.update();
+    uDepthPrepassCameraMatrix_ = cam->cameraMatrix();
+    uDepthPrepassProjectionMatrix_ = cam->projectionMatrix();
+    uDepthPrepassModelMatrix_ = transform().matrix();
+    uDepthPrepassDepthCoef_ = 2.0 / log2(cam->z_far() + 1.0);
+  }
+
   gl::Use(prog_);
   prog_.update();
   uCameraMatrix_ = cam->cameraMatrix();
@@ -34,4 +80,8 @@ void Terrain::Render() {
   mesh_.Render(*cam);
 }
 
+void Terrain::ScreenResized(size_t width, size_t height) {
+  mesh_.ScreenResized(width, height);
+}
+
 
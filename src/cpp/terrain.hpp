@@ -3,6 +3,8 @@
 #ifndef LOE_TERRAIN_H_
 #define LOE_TERRAIN_H_
 
+#include <functional>
+#include <vector>
 #include <glad/glad.h>
 #include <oglwrap/oglwrap.h>
 #include <Silice3D/core/game_object.hpp>
@@ -15,14 +17,32 @@ class Terrain : public Silice3D::GameObject {
   explicit Terrain(Silice3D::GameObject* parent);
   virtual ~Terrain() {}
 
+  // Loads and uploads the top levels of the terrain and the tiles of a
+  // residency snapshot (see CdlodTerrain::StartWarmUp), and calls
+  // show_progress after every step.
+  void WarmUp(const std::vector<Cdlod::SnapshotTile>& snapshot_tiles,
+              const std::function<void(const Cdlod::WarmUpProgress&)>&
+                  show_progress);
+
+  std::vector<Cdlod::SnapshotTile> ResidentTiles() const {
+    return mesh_.ResidentTiles();
+  }
+
  private:
   Cdlod::CdlodTerrain mesh_;
   Silice3D::ShaderProgram prog_;  // has to be inited after mesh_
+  Silice3D::ShaderProgram depth_prog_;
 
   gl::LazyUniform<float> uDepthCoef_;
   gl::LazyUniform<glm::mat4> uProjectionMatrix_, uCameraMatrix_, uModelMatrix_;
 
+  gl::LazyUniform<float> uDepthPrepassDepthCoef_;
+  gl::LazyUniform<glm::mat4> uDepthPrepassProjectionMatrix_,
+                             uDepthPrepassCameraMatrix_,
+                             uDepthPrepassModelMatrix_;
+
   virtual void Render() override;
+  virtual void ScreenResized(size_t width, size_t height) override;
 };
 
 #endif  // LOE_TERRAIN_H_
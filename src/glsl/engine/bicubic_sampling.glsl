@@ -3,6 +3,7 @@
 #version 330
 
 #export vec4 textureBicubic(sampler2D tex, vec2 texCoords);
+#export vec4 textureBicubic(sampler2DArray tex, vec3 texCoords);
 
 vec4 cubic(float v) {
   vec4 n = vec4(1.0, 2.0, 3.0, 4.0) - v;
@@ -42,3 +43,33 @@ vec4 textureBicubic(sampler2D tex, vec2 texCoords) {
 
   return mix(mix(sample3, sample2, sx), mix(sample1, sample0, sx), sy);
 }
+
+vec4 textureBicubic(sampler2DArray tex, vec3 texCoords) {
+  vec2 texSize = textureSize(tex, 0).xy;
+  vec2 invTexSize = 1.0 / texSize;
+
+  vec2 coords = texCoords.xy * texSize - 0.5;
+  vec2 fxy = fract(coords);
+  coords -= fxy;
+
+  vec4 xcubic = cubic(fxy.x);
+  vec4 ycubic = cubic(fxy.y);
+
+  vec4 c = coords.xxyy + vec2(-0.5, +1.5).xyxy;
+
+  vec4 s = vec4(xcubic.xz + xcubic.yw, ycubic.xz + ycubic.yw);
+  vec4 offset = c + vec4(xcubic.yw, ycubic.yw) / s;
+
+  offset *= invTexSize.xxyy;
+
+  float layer = texCoords.z;
+  vec4 sample0 = texture(tex, vec3(offset.xz, layer));
+  vec4 sample1 = texture(tex, vec3(offset.yz, layer));
+  vec4 sample2 = texture(tex, vec3(offset.xw, layer));
+  vec4 sample3 = texture(tex, vec3(offset.yw, layer));
+
+  float sx = s.x / (s.x + s.y);
+  float sy = s.z / (s.z + s.w);
+
+  return mix(mix(sample3, sample2, sx), mix(sample1, sample0, sx), sy);
+}
@@ -6,22 +6,26 @@
 #include "engine/bicubic_sampling.glsl"
 #include "engine/cube2sphere.glsl"
 
-#export vec4 Terrain_modelPos(vec2 m_pos);
+#export vec4 Terrain_modelPos(vec2 m_pos, float skirt);
 #export int Terrain_face();
 
-in vec4 Terrain_aRenderData;
+layout(location = 1) in vec4 Terrain_aRenderData;
 in vec2 Terrain_aMinMax;
 
-in uvec2 Terrain_aCurrentGeometryTextureId;
-in vec3 Terrain_aCurrentGeometryTexturePosAndSize;
-in uvec2 Terrain_aNextGeometryTextureId;
-in vec3 Terrain_aNextGeometryTexturePosAndSize;
+layout(location = 2) in uvec2 Terrain_aCurrentGeometryTextureId;
+layout(location = 3) in vec3 Terrain_aCurrentGeometryTexturePosAndSize;
+layout(location = 4) in uvec2 Terrain_aNextGeometryTextureId;
+layout(location = 5) in vec3 Terrain_aNextGeometryTexturePosAndSize;
 
 uniform int Terrain_uLevelOffset;
 uniform int Terrain_uMaxLoadLevel;
 uniform int Terrain_uTextureDimensionWBorders;
 uniform vec3 Terrain_uCamPos;
 uniform float Terrain_uSmallestGeometryLodDistance;
+// The depth of the skirts at unit distance. They are a constant size on the
+// screen, which is enough to cover the gaps between the neighbouring nodes,
+// as those are smaller than a pixel.
+uniform float Terrain_uSkirtDepthScale;
 
 uniform int Terrain_uMaxHeight;
 
@@ -79,7 +83,7 @@ float Terrain_estimateDistance(vec2 geom_pos) {
   return length(est_diff);
 }
 
-vec4 Terrain_modelPos(vec2 m_pos) {
+vec4 Terrain_modelPos(vec2 m_pos, float skirt) {
   vec2 pos = Terrain_nodeLocal2Global(m_pos);
   float dist = Terrain_estimateDistance(pos);
   float morph = 0;
@@ -96,6 +100,7 @@ vec4 Terrain_modelPos(vec2 m_pos) {
   }
 
   float height = Terrain_getHeight(pos, morph);
+  height -= skirt * dist * Terrain_uSkirtDepthScale;
   return vec4(pos.x, height, pos.y, morph);
 }
 
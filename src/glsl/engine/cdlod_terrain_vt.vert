@@ -0,0 +1,102 @@
+// Copyright (c) 2015, Tamas Csala
+
+#version 330
+
+#include "engine/bicubic_sampling.glsl"
+#include "engine/cube2sphere.glsl"
+#include "engine/virtual_texture.glsl"
+
+#export vec4 Terrain_modelPos(vec2 m_pos, float skirt);
+#export int Terrain_face();
+
+layout(location = 1) in vec4 Terrain_aRenderData;
+
+uniform int Terrain_uLevelOffset;
+uniform int Terrain_uMaxLoadLevel;
+uniform int Terrain_uTextureDimensionWBorders;
+uniform vec3 Terrain_uCamPos;
+uniform float Terrain_uSmallestGeometryLodDistance;
+// The depth of the skirts at unit distance. They are a constant size on the
+// screen, which is enough to cover the gaps between the neighbouring nodes,
+// as those are smaller than a pixel.
+uniform float Terrain_uSkirtDepthScale;
+uniform sampler2DArray Terrain_uElevationPages;
+
+uniform int Terrain_uMaxHeight;
+
+const float kMorphEnd = 0.95, kMorphStart = 0.65;
+vec2 Terrain_offset = Terrain_aRenderData.xy;
+float Terrain_level = Terrain_aRenderData.z;
+float Terrain_scale = pow(2, Terrain_level);
+
+// A geometry node uses the elevation texture of the same level (one texel
+// per vertex), and morphs into the next one.
+int Terrain_geometryTextureLevel = max(int(Terrain_level), 0);
+
+vec2 Terrain_morphVertex(vec2 vertex, float morph) {
+  vec2 frac_part = fract(vertex * 0.5) * 2.0;
+  return (vertex - frac_part * morph);
+}
+
+vec2 Terrain_nodeLocal2Global(vec2 node_coord) {
+  return Terrain_offset + Terrain_scale * node_coord;
+}
+
+float Terrain_getHeightFast(vec2 pos) {
+  vec4 coord = Terrain_virtualTexCoord(pos, Terrain_face(),
+                                       Terrain_geometryTextureLevel,
+                                       Terrain_uTextureDimensionWBorders);
+  float normalized_height =
+      textureLod(Terrain_uElevationPages, coord.xyz, 0).r;
+  return normalized_height * Terrain_uMaxHeight;
+}
+
+float Terrain_getHeightInternal(vec2 pos, int level) {
+  vec4 coord = Terrain_virtualTexCoord(pos, Terrain_face(), level,
+                                       Terrain_uTextureDimensionWBorders);
+  float normalized_height = textureBicubic(Terrain_uElevationPages, coord.xyz).r;
+  return normalized_height * Terrain_uMaxHeight;
+}
+
+float Terrain_getHeight(vec2 pos, float morph) {
+  float height0 = Terrain_getHeightInternal(pos, Terrain_geometryTextureLevel);
+  if (morph == 0.0 || Terrain_level < Terrain_uLevelOffset) {
+    return height0;
+  }
+
+  float height1 = Terrain_getHeightInternal(pos, Terrain_geometryTextureLevel + 1);
+
+  return mix(height0, height1, morph);
+}
+
+float Terrain_estimateDistance(vec2 geom_pos) {
+  float est_height = Terrain_getHeightFast(geom_pos);
+  vec3 est_pos = vec3(geom_pos.x, est_height, geom_pos.y);
+  vec3 est_diff = Terrain_uCamPos - Terrain_worldPos(est_pos, Terrain_face());
+  return length(est_diff);
+}
+
+vec4 Terrain_modelPos(vec2 m_pos, float skirt) {
+  vec2 pos = Terrain_nodeLocal2Global(m_pos);
+  float dist = Terrain_estimateDistance(pos);
+  float morph = 0;
+
+  if (Terrain_level < Terrain_uMaxLoadLevel) {
+    float next_level_size =
+        2 * Terrain_scale * Terrain_uSmallestGeometryLodDistance;
+    float max_dist = kMorphEnd * next_level_size;
+    float start_dist = kMorphStart * next_level_size;
+    morph = smoothstep(start_dist, max_dist, dist);
+
+    vec2 morphed_pos = Terrain_morphVertex(m_pos, morph);
+    pos = Terrain_nodeLocal2Global(morphed_pos);
+  }
+
+  float height = Terrain_getHeight(pos, morph);
+  height -= skirt * dist * Terrain_uSkirtDepthScale;
+  return vec4(pos.x, height, pos.y, morph);
+}
+
+int Terrain_face() {
+  return int(Terrain_aRenderData.w);
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2015, Tamas Csala
+
+#version 330
+
+#export vec4 Terrain_virtualTexCoord(vec2 pos, int face, int level, int tex_size_w_borders);
+
+uniform usampler2DArray Terrain_uPageTable;
+uniform int Terrain_uTextureDimension;
+uniform int Terrain_uMaxTextureLevel;
+
+ivec2 Terrain_tileOf(vec2 pos, int level) {
+  float tile_size = Terrain_uTextureDimension * exp2(level);
+  int max_tile = (1 << (Terrain_uMaxTextureLevel - level)) - 1;
+  return clamp(ivec2(floor(pos / tile_size)), ivec2(0), ivec2(max_tile));
+}
+
+// Finds the most detailed resident tile, that covers pos (in face space) with
+// at most the given level of detail. Returns the texture coordinates inside the
+// page (xy), the page (z), and the derivative of the texture coordinates with
+// respect to pos (w).
+vec4 Terrain_virtualTexCoord(vec2 pos, int face, int level, int tex_size_w_borders) {
+  level = clamp(level, 0, Terrain_uMaxTextureLevel);
+  uint entry = texelFetch(Terrain_uPageTable,
+                          ivec3(Terrain_tileOf(pos, level), face), level).r;
+
+  int page = int(entry & 0xFFFu);
+  // the roots are always resident, so this should be a no-op
+  int page_level = min(int(entry >> 12u), Terrain_uMaxTextureLevel);
+
+  float texel_size = exp2(page_level);
+  vec2 tile_min = Terrain_tileOf(pos, page_level) * Terrain_uTextureDimension * texel_size;
+  float border = (tex_size_w_borders - Terrain_uTextureDimension) / 2.0;
+  vec2 texel = (pos - tile_min) / texel_size + border + 0.5;
+
+  return vec4(texel / tex_size_w_borders, page, 1.0 / (texel_size * tex_size_w_borders));
+}
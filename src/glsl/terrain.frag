@@ -22,27 +22,18 @@ in VertexData {
   flat vec3 current_diffuse_tex_pos_and_size, next_diffuse_tex_pos_and_size;
 } vIn;
 
-uniform int Terrain_uMaxHeight;
 uniform int Terrain_uTextureDimension;
 uniform int Terrain_uTextureDimensionWBorders;
 uniform float Terrain_uSmallestTextureLodDistance;
 
 const float kMorphEnd = 0.95, kMorphStart = 0.65;
 
-float GetHeight(vec2 pos, uvec2 tex_id, vec3 tex_pos_and_size) {
+vec3 GetNormalModelSpaceInternal(vec2 pos, uvec2 tex_id, vec3 tex_pos_and_size) {
   vec2 sample = (pos - tex_pos_and_size.xy) / tex_pos_and_size.z;
   sample += 0.5 / Terrain_uTextureDimensionWBorders;
-  return textureBicubic(sampler2D(tex_id), sample).r * Terrain_uMaxHeight;
-}
-
-vec3 GetNormalModelSpaceInternal(vec2 pos, uvec2 tex_id, vec3 tex_pos_and_size) {
-  float diff = tex_pos_and_size.z / Terrain_uTextureDimensionWBorders;
-  float py = GetHeight(vec2(pos.x, pos.y + diff), tex_id, tex_pos_and_size);
-  float my = GetHeight(vec2(pos.x, pos.y - diff), tex_id, tex_pos_and_size);
-  float px = GetHeight(vec2(pos.x + diff, pos.y), tex_id, tex_pos_and_size);
-  float mx = GetHeight(vec2(pos.x - diff, pos.y), tex_id, tex_pos_and_size);
-
-  return normalize(vec3(mx-px, diff, my-py));
+  // The normal textures store the x and z components of an upward normal.
+  vec2 xz = texture(sampler2D(tex_id), sample).rg * 2.0 - 1.0;
+  return normalize(vec3(xz.x, sqrt(max(1.0 - dot(xz, xz), 0.0)), xz.y));
 }
 
 vec3 GetNormalModelSpace(vec2 pos) {
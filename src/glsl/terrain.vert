@@ -5,30 +5,34 @@
 #include "engine/cdlod_terrain.vert"
 vec3 Terrain_worldPos(vec3 pos, int face); // todo
 
-in vec2 Terrain_aPosition;
-in vec4 Terrain_aRenderData;
+// xy: the position in the node, z: 1 on the skirt
+layout(location = 0) in vec3 Terrain_aPosition;
+layout(location = 1) in vec4 Terrain_aRenderData;
 
-in uvec2 Terrain_aCurrentGeometryTextureId;
-in vec3 Terrain_aCurrentGeometryTexturePosAndSize;
+layout(location = 2) in uvec2 Terrain_aCurrentGeometryTextureId;
+layout(location = 3) in vec3 Terrain_aCurrentGeometryTexturePosAndSize;
 
-in uvec2 Terrain_aNextGeometryTextureId;
-in vec3 Terrain_aNextGeometryTexturePosAndSize;
+layout(location = 4) in uvec2 Terrain_aNextGeometryTextureId;
+layout(location = 5) in vec3 Terrain_aNextGeometryTexturePosAndSize;
 
-in uvec2 Terrain_aCurrentNormalTextureId;
-in vec3 Terrain_aCurrentNormalTexturePosAndSize;
+layout(location = 6) in uvec2 Terrain_aCurrentNormalTextureId;
+layout(location = 7) in vec3 Terrain_aCurrentNormalTexturePosAndSize;
 
-in uvec2 Terrain_aNextNormalTextureId;
-in vec3 Terrain_aNextNormalTexturePosAndSize;
+layout(location = 8) in uvec2 Terrain_aNextNormalTextureId;
+layout(location = 9) in vec3 Terrain_aNextNormalTexturePosAndSize;
 
-in uvec2 Terrain_aCurrentDiffuseTextureId;
-in vec3 Terrain_aCurrentDiffuseTexturePosAndSize;
+layout(location = 10) in uvec2 Terrain_aCurrentDiffuseTextureId;
+layout(location = 11) in vec3 Terrain_aCurrentDiffuseTexturePosAndSize;
 
-in uvec2 Terrain_aNextDiffuseTextureId;
-in vec3 Terrain_aNextDiffuseTexturePosAndSize;
+layout(location = 12) in uvec2 Terrain_aNextDiffuseTextureId;
+layout(location = 13) in vec3 Terrain_aNextDiffuseTexturePosAndSize;
 
 uniform float uDepthCoef;
 uniform mat4 uProjectionMatrix, uCameraMatrix, uModelMatrix;
 
+// The depth pre-pass uses this shader too, with a different program.
+invariant gl_Position;
+
 out VertexData {
   vec3 c_pos, w_pos, m_pos;
   float morph;
@@ -42,7 +46,7 @@ out VertexData {
 } vOut;
 
 void main() {
-  vec4 temp = Terrain_modelPos(Terrain_aPosition);
+  vec4 temp = Terrain_modelPos(Terrain_aPosition.xy, Terrain_aPosition.z);
   vec3 m_pos = temp.xyz;
   vOut.morph = temp.w;
   vOut.m_pos = m_pos;
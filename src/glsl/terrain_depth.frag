@@ -0,0 +1,7 @@
+// Copyright (c) 2015, Tamas Csala
+
+#version 330
+
+// The fragment shader of the terrain's depth pre-pass, only the depth buffer
+// is written, the color attachments are masked.
+void main() { }
@@ -0,0 +1,103 @@
+// Copyright (c) 2015, Tamas Csala
+
+#version 330
+
+#include "sky.frag"
+#include "engine/cube2sphere.glsl"
+#include "engine/virtual_texture.glsl"
+
+layout (location = 0) out vec4 fragColor;
+layout (location = 1) out float fragDepth;
+
+in VertexData {
+  vec3  c_pos, w_pos, m_pos;
+  float morph; // can be useful for debugging
+  flat int face;
+} vIn;
+
+uniform int Terrain_uTextureDimensionWBorders;
+uniform int Terrain_uDiffuseTextureDimensionWBorders;
+uniform float Terrain_uSmallestTextureLodDistance;
+uniform sampler2DArray Terrain_uNormalPages;
+uniform sampler2DArray Terrain_uDiffusePages;
+
+const float kMorphEnd = 0.95, kMorphStart = 0.65;
+
+// The derivatives of the face space position, these have to be calculated in
+// uniform control flow, and the texture coordinates of the pages are not
+// continuous across the tiles anyway.
+vec2 dpos_dx, dpos_dy;
+
+// The level of the texture that should be used at this distance, like the
+// quadtree would select it for the node, and the morph towards the next level.
+int GetTextureLevel(out float morph) {
+  float dist = length(vIn.c_pos);
+  int level = max(int(floor(log2(dist / Terrain_uSmallestTextureLodDistance))), 0);
+  float next_dist = exp2(level + 1) * Terrain_uSmallestTextureLodDistance;
+  morph = smoothstep(kMorphStart*next_dist, kMorphEnd*next_dist, dist);
+  return level;
+}
+
+vec4 SamplePage(sampler2DArray pages, vec2 pos, int level, int tex_size_w_borders) {
+  vec4 coord = Terrain_virtualTexCoord(pos, vIn.face, level, tex_size_w_borders);
+  return textureGrad(pages, coord.xyz, dpos_dx * coord.w, dpos_dy * coord.w);
+}
+
+vec3 GetNormalModelSpaceInternal(vec2 pos, int level) {
+  // The normal textures store the x and z components of an upward normal.
+  vec2 xz = SamplePage(Terrain_uNormalPages, pos, level,
+                       Terrain_uTextureDimensionWBorders).rg * 2.0 - 1.0;
+  return normalize(vec3(xz.x, sqrt(max(1.0 - dot(xz, xz), 0.0)), xz.y));
+}
+
+vec3 GetNormalModelSpace(vec2 pos) {
+  float morph;
+  int level = GetTextureLevel(morph);
+  vec3 normal0 = GetNormalModelSpaceInternal(pos, level);
+  if (morph == 0.0) {
+    return normal0;
+  }
+
+  vec3 normal1 = GetNormalModelSpaceInternal(pos, level + 1);
+
+  return mix(normal0, normal1, morph);
+}
+
+vec3 GetNormal(vec2 pos) {
+  return Terrain_worldPos(vIn.m_pos + GetNormalModelSpace(pos), vIn.face)
+       - Terrain_worldPos(vIn.m_pos, vIn.face);
+}
+
+// Color
+
+vec3 GetColor(vec2 pos, int level) {
+  // the most detailed elevation level doesn't have a diffuse texture
+  return SamplePage(Terrain_uDiffusePages, pos, max(level, 1),
+                    Terrain_uDiffuseTextureDimensionWBorders).rgb;
+}
+
+vec3 GetDiffuseColor(vec2 pos) {
+  float morph;
+  int level = GetTextureLevel(morph);
+  vec3 diffuse0 = GetColor(pos, level);
+  if (morph == 0.0) {
+    return diffuse0;
+  }
+
+  vec3 diffuse1 = GetColor(pos, level + 1);
+
+  return mix(diffuse0, diffuse1, morph);
+}
+
+// main
+
+void main() {
+  dpos_dx = dFdx(vIn.m_pos.xz);
+  dpos_dy = dFdy(vIn.m_pos.xz);
+
+  float lighting = dot(GetNormal(vIn.m_pos.xz), SunPos());
+  float luminance = 0.1 + max(lighting, 0) + 0.1 * (1+lighting)/2;
+  vec3 diffuse = GetDiffuseColor(vIn.m_pos.xz);
+  fragColor = vec4(luminance*diffuse, 1);
+  fragDepth = length(vIn.c_pos);
+}
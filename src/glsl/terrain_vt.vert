@@ -0,0 +1,43 @@
+// Copyright (c) 2015, Tamas Csala
+
+#version 330
+
+#include "engine/cdlod_terrain_vt.vert"
+vec3 Terrain_worldPos(vec3 pos, int face); // todo
+
+// xy: the position in the node, z: 1 on the skirt
+layout(location = 0) in vec3 Terrain_aPosition;
+layout(location = 1) in vec4 Terrain_aRenderData;
+
+uniform float uDepthCoef;
+uniform mat4 uProjectionMatrix, uCameraMatrix, uModelMatrix;
+
+// The depth pre-pass uses this shader too, with a different program.
+invariant gl_Position;
+
+out VertexData {
+  vec3 c_pos, w_pos, m_pos;
+  float morph;
+  flat int face;
+} vOut;
+
+void main() {
+  vec4 temp = Terrain_modelPos(Terrain_aPosition.xy, Terrain_aPosition.z);
+  vec3 m_pos = temp.xyz;
+  vOut.morph = temp.w;
+  vOut.m_pos = m_pos;
+
+  vec3 w_pos = Terrain_worldPos(m_pos, Terrain_face());
+  vec3 offseted_w_pos = (uModelMatrix * vec4(w_pos, 1)).xyz;
+  vOut.w_pos = offseted_w_pos;
+
+  vec4 c_pos = uCameraMatrix * vec4(offseted_w_pos, 1);
+  vOut.c_pos = vec3(c_pos);
+
+  vOut.face = Terrain_face();
+
+  vec4 projected = uProjectionMatrix * c_pos;
+  projected.z = log2(max(1e-6, 1.0 + projected.w)) * uDepthCoef - 1.0;
+  projected.z *= projected.w;
+  gl_Position = projected;
+}